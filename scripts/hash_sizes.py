@@ -15,7 +15,7 @@
 K, M, G = 2**10, 2**20, 2**30
 
 # hash table size (in number of buckets)
-start, end_p1, end_p2 = 1 * K, 127 * M, 2 * G - 10 * M  # stay well below 2^31 - 1
+start, end_p1, end_p2 = 1 * K, 127 * M, 64 * G  # sizes >= 2^31 need the 64-bit index file format
 
 Policy = namedtuple("Policy", "upto grow")
 
@@ -27,7 +27,7 @@
     Policy(2 * M, 1.7),
     Policy(16 * M, 1.4),
     Policy(128 * M, 1.2),
-    Policy(2 * G - 1, 1.1),
+    Policy(64 * G, 1.1),
 ]
 
 
@@ -94,7 +94,7 @@ def main():
 
     print(
         """\
-static int hash_sizes[] = {
+static int64_t hash_sizes[] = {
     %s
 };
 """
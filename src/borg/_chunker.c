@@ -1,5 +1,6 @@
 #include <Python.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #if !defined(_MSC_VER)
 #   include <unistd.h>
 #endif
@@ -103,15 +104,558 @@ buzhash_update(uint32_t sum, unsigned char remove, unsigned char add, size_t len
     return BARREL_SHIFT(sum, 1) ^ BARREL_SHIFT(h[remove], lenmod) ^ h[add];
 }
 
+/* Scanning for a chunk boundary
+
+A scan kernel advances the rolling hash *sum over at most n positions, starting at p (the hash
+window starts at p[0]), and stops at the first position where (sum & chunk_mask) == 0.
+It returns the number of positions it advanced, *sum is the hash at the stop position.
+
+All kernels must produce exactly the same results as the scalar kernel (which is just the
+buzhash_update loop), otherwise the chunk cutting places would change and existing repos
+would not deduplicate any more against newly created chunks.
+
+h_rot is the pre-rotated table: h_rot[b] == BARREL_SHIFT(h[b], window_size & 0x1f), so
+removing a byte from the window costs a table lookup, but no shift.
+
+The AVX-512 kernel computes the hashes for the next 16 positions in one go:
+with t[k] = h_rot[p[k]] ^ h[p[k + window_size]], the hash after k + 1 updates is
+BARREL_SHIFT(sum, k + 1) ^ XOR(BARREL_SHIFT(t[i], k - i) for i in 0..k), and the XOR-sum
+is computed as a 4 steps prefix scan over the vector lanes. The 256 entry tables are kept
+in registers and looked up using 2-register permutes, because gather instructions are slow.
+*/
+
+typedef size_t (*buzhash_scan_func)(const uint8_t *p, size_t n, uint32_t *sum, uint32_t chunk_mask,
+                                    size_t window_size, const uint32_t *h, const uint32_t *h_rot);
+
+static uint32_t *
+buzhash_init_table_rot(const uint32_t *h, size_t window_size)
+{
+    int i;
+    uint32_t shift = window_size & 0x1f;
+    uint32_t *table_rot = malloc(1024);
+    for(i = 0; i < 256; i++)
+    {
+        table_rot[i] = BARREL_SHIFT(h[i], shift);
+    }
+    return table_rot;
+}
+
+static size_t
+buzhash_scan_scalar(const uint8_t *p, size_t n, uint32_t *sum, uint32_t chunk_mask,
+                    size_t window_size, const uint32_t *h, const uint32_t *h_rot)
+{
+    size_t i = 0;
+    uint32_t s = *sum;
+    (void)h_rot;
+    while(i < n && (s & chunk_mask)) {
+        s = buzhash_update(s, p[i], p[i + window_size], window_size, h);
+        i++;
+    }
+    *sum = s;
+    return i;
+}
+
+static size_t
+buzhash_scan_rotated(const uint8_t *p, size_t n, uint32_t *sum, uint32_t chunk_mask,
+                     size_t window_size, const uint32_t *h, const uint32_t *h_rot)
+{
+    size_t i = 0;
+    uint32_t s = *sum;
+    const uint8_t *q = p + window_size;
+    while(i < n && (s & chunk_mask)) {
+        s = BARREL_SHIFT(s, 1) ^ h_rot[p[i]] ^ h[q[i]];
+        i++;
+    }
+    *sum = s;
+    return i;
+}
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define BUZHASH_SCAN_X86 1
+#include <immintrin.h>
+
+/* look up 16 table entries, idx lanes must be in 0..255, table is in 16 registers */
+__attribute__((target("avx512f")))
+static inline __m512i
+buzhash_lookup_avx512(__m512i idx, const __m512i *table)
+{
+    __m512i r0, r1, r2, r3, r4, r5, r6, r7;
+    __mmask16 bit5 = _mm512_test_epi32_mask(idx, _mm512_set1_epi32(0x20));
+    __mmask16 bit6 = _mm512_test_epi32_mask(idx, _mm512_set1_epi32(0x40));
+    __mmask16 bit7 = _mm512_test_epi32_mask(idx, _mm512_set1_epi32(0x80));
+    /* each permute looks up idx bits 0..4 in 32 entries */
+    r0 = _mm512_permutex2var_epi32(table[0], idx, table[1]);
+    r1 = _mm512_permutex2var_epi32(table[2], idx, table[3]);
+    r2 = _mm512_permutex2var_epi32(table[4], idx, table[5]);
+    r3 = _mm512_permutex2var_epi32(table[6], idx, table[7]);
+    r4 = _mm512_permutex2var_epi32(table[8], idx, table[9]);
+    r5 = _mm512_permutex2var_epi32(table[10], idx, table[11]);
+    r6 = _mm512_permutex2var_epi32(table[12], idx, table[13]);
+    r7 = _mm512_permutex2var_epi32(table[14], idx, table[15]);
+    r0 = _mm512_mask_blend_epi32(bit5, r0, r1);
+    r2 = _mm512_mask_blend_epi32(bit5, r2, r3);
+    r4 = _mm512_mask_blend_epi32(bit5, r4, r5);
+    r6 = _mm512_mask_blend_epi32(bit5, r6, r7);
+    r0 = _mm512_mask_blend_epi32(bit6, r0, r2);
+    r4 = _mm512_mask_blend_epi32(bit6, r4, r6);
+    return _mm512_mask_blend_epi32(bit7, r0, r4);
+}
+
+__attribute__((target("avx512f")))
+static size_t
+buzhash_scan_avx512(const uint8_t *p, size_t n, uint32_t *sum, uint32_t chunk_mask,
+                    size_t window_size, const uint32_t *h, const uint32_t *h_rot)
+{
+    size_t i = 0;
+    int k;
+    uint32_t lanes[16];
+    const uint8_t *q = p + window_size;
+    const __m512i mask = _mm512_set1_epi32((int)chunk_mask);
+    const __m512i up1 = _mm512_setr_epi32(0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14);
+    const __m512i up2 = _mm512_setr_epi32(0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13);
+    const __m512i up4 = _mm512_setr_epi32(0, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11);
+    const __m512i up8 = _mm512_setr_epi32(0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7);
+    const __m512i shifts = _mm512_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16);
+    const __m512i last = _mm512_set1_epi32(15);
+    __m512i table[16], table_rot[16], t, sv, hv;
+    __mmask16 hits;
+
+    if(n < 16 || !(*sum & chunk_mask))
+        return buzhash_scan_rotated(p, n, sum, chunk_mask, window_size, h, h_rot);
+    for(k = 0; k < 16; k++) {
+        table[k] = _mm512_loadu_si512((const void *)(h + 16 * k));
+        table_rot[k] = _mm512_loadu_si512((const void *)(h_rot + 16 * k));
+    }
+    sv = _mm512_set1_epi32((int)*sum);
+    while(n - i >= 16) {
+        t = _mm512_xor_si512(
+            buzhash_lookup_avx512(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(p + i))), table_rot),
+            buzhash_lookup_avx512(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(q + i))), table));
+        /* prefix scan: lane k gets lane k - d (or 0 for k < d), barrel shifted by d */
+        t = _mm512_xor_si512(t, _mm512_rol_epi32(_mm512_maskz_permutexvar_epi32(0xfffe, up1, t), 1));
+        t = _mm512_xor_si512(t, _mm512_rol_epi32(_mm512_maskz_permutexvar_epi32(0xfffc, up2, t), 2));
+        t = _mm512_xor_si512(t, _mm512_rol_epi32(_mm512_maskz_permutexvar_epi32(0xfff0, up4, t), 4));
+        t = _mm512_xor_si512(t, _mm512_rol_epi32(_mm512_maskz_permutexvar_epi32(0xff00, up8, t), 8));
+        /* lane k: barrel shift the old sum by k + 1 */
+        hv = _mm512_xor_si512(t, _mm512_rolv_epi32(sv, shifts));
+        hits = _mm512_testn_epi32_mask(hv, mask);
+        if(hits) {
+            _mm512_storeu_si512((void *)lanes, hv);
+            k = __builtin_ctz(hits);
+            *sum = lanes[k];
+            return i + k + 1;
+        }
+        sv = _mm512_permutexvar_epi32(last, hv);
+        i += 16;
+    }
+    *sum = (uint32_t)_mm512_cvtsi512_si32(sv);
+    return i + buzhash_scan_rotated(p + i, n - i, sum, chunk_mask, window_size, h, h_rot);
+}
+#endif
+
+enum {
+    BUZHASH_SCAN_SCALAR = 0,
+    BUZHASH_SCAN_ROTATED,
+    BUZHASH_SCAN_AVX512,
+    BUZHASH_SCAN_COUNT
+};
+
+static const char *buzhash_scan_names[BUZHASH_SCAN_COUNT] = {"scalar", "rotated", "avx512"};
+
+static const buzhash_scan_func buzhash_scan_funcs[BUZHASH_SCAN_COUNT] = {
+    buzhash_scan_scalar,
+    buzhash_scan_rotated,
+#ifdef BUZHASH_SCAN_X86
+    buzhash_scan_avx512,
+#else
+    NULL,
+#endif
+};
+
+static int buzhash_scan_kernel = -1;
+
+static int
+buzhash_scan_available(int kernel)
+{
+    switch(kernel) {
+        case BUZHASH_SCAN_SCALAR:
+        case BUZHASH_SCAN_ROTATED:
+            return 1;
+#ifdef BUZHASH_SCAN_X86
+        case BUZHASH_SCAN_AVX512:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return 0;
+    }
+}
+
+/* select the scan kernel used by all Chunkers, -1 selects the best one available on this CPU.
+ * returns the selected kernel or -1 if the requested kernel is not available.
+ */
+static int
+buzhash_scan_select(int kernel)
+{
+    if(kernel < 0) {
+        kernel = BUZHASH_SCAN_COUNT - 1;
+        while(!buzhash_scan_available(kernel))
+            kernel--;
+    }
+    else if(kernel >= BUZHASH_SCAN_COUNT || !buzhash_scan_available(kernel)) {
+        return -1;
+    }
+    buzhash_scan_kernel = kernel;
+    return kernel;
+}
+
+static int
+buzhash_scan_selected(void)
+{
+    if(buzhash_scan_kernel < 0)
+        buzhash_scan_select(-1);
+    return buzhash_scan_kernel;
+}
+
+static void
+fadvise_dontneed(int fh, off_t offset, off_t length)
+{
+    #if ( ( _XOPEN_SOURCE >= 600 || _POSIX_C_SOURCE >= 200112L ) && defined(POSIX_FADV_DONTNEED) )
+    // Only do it once per run.
+    if (pagemask == 0)
+        pagemask = getpagesize() - 1;
+
+    // We tell the OS that we do not need the data that we just have read any
+    // more (that it maybe has in the cache). This avoids that we spoil the
+    // complete cache with data that we only read once and (due to cache
+    // size limit) kick out data from the cache that might be still useful
+    // for the OS or other processes.
+    // We rollback the initial offset back to the start of the page,
+    // to avoid it not being truncated as a partial page request.
+    int overshoot;
+    if (length > 0) {
+        // All Linux kernels (at least up to and including 4.6(.0)) have a bug where
+        // they truncate last partial page of POSIX_FADV_DONTNEED request, so we need
+        // to page-align it ourselves. We'll need the rest of this page on the next
+        // read (assuming this was not EOF).
+        overshoot = (offset + length) & pagemask;
+    } else {
+        // For length == 0 we set overshoot 0, so the below
+        // length - overshoot is 0, which means till end of file for
+        // fadvise. This will cancel the final page and is not part
+        // of the above workaround.
+        overshoot = 0;
+    }
+
+    posix_fadvise(fh, offset & ~pagemask, length - overshoot, POSIX_FADV_DONTNEED);
+    #else
+    (void)fh;
+    (void)offset;
+    (void)length;
+    #endif
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+static int
+is_all_zero(const uint8_t *p, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc;
+    for(; i + 64 <= n; i += 64) {
+        acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)),
+                                        _mm_loadu_si128((const __m128i *)(p + i + 16))),
+                           _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+                                        _mm_loadu_si128((const __m128i *)(p + i + 48))));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+            return 0;
+    }
+#endif
+    for(; i < n; i++) {
+        if(p[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* chunk allocation kinds, same values as CH_DATA, CH_ALLOC, CH_HOLE in constants.py */
+enum { CHUNK_DATA, CHUNK_ALLOC, CHUNK_HOLE };
+
+/* Read-ahead
+
+For big files, a reader thread reads the file in blocks of read_size bytes into a queue of
+depth blocks, while chunker_process is busy finding the chunk boundaries in the data it
+already has. chunker_fill then just copies the data from the queue.
+
+The reader thread uses its own dup()ed file descriptor, so it can not accidentally read from
+another file if the caller closes the file before the chunker is done with it.
+*/
+
+#if !defined(_MSC_VER)
+#define CHUNKER_THREADS
+#include <pthread.h>
+
+typedef struct {
+    uint8_t *data;
+    ssize_t n;  /* > 0: data bytes in the block, 0: eof, -1: read error (errno in err) */
+    int err;
+} ReadaheadBlock;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;  /* signalled when a block gets filled or consumed or on stop */
+    int fh, stop;
+    off_t offset, end;  /* end: the reader thread stops there (-1: at eof) */
+    size_t depth, read_size;
+    size_t head, count, head_pos;  /* ring buffer of filled blocks, head_pos is the consumed part of head */
+    ReadaheadBlock *blocks;
+} Readahead;
+
+static void *
+readahead_thread(void *arg)
+{
+    Readahead *ra = arg;
+    ReadaheadBlock *b;
+    ssize_t n;
+    size_t size;
+
+    for(;;) {
+        pthread_mutex_lock(&ra->mutex);
+        while(ra->count == ra->depth && !ra->stop)
+            pthread_cond_wait(&ra->cond, &ra->mutex);
+        if(ra->stop) {
+            pthread_mutex_unlock(&ra->mutex);
+            break;
+        }
+        b = &ra->blocks[(ra->head + ra->count) % ra->depth];
+        pthread_mutex_unlock(&ra->mutex);
+
+        size = ra->read_size;
+        if(ra->end >= 0 && ra->offset + (off_t)size > ra->end)
+            size = ra->end - ra->offset;
+        n = size ? read(ra->fh, b->data, size) : 0;
+        b->err = errno;
+        if(n >= 0) {
+            fadvise_dontneed(ra->fh, ra->offset, n);
+            ra->offset += n;
+        }
+
+        pthread_mutex_lock(&ra->mutex);
+        b->n = n;
+        ra->count++;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->mutex);
+        if(n <= 0)
+            break;
+    }
+    return NULL;
+}
+
+static void
+readahead_free(Readahead *ra)
+{
+    size_t i;
+    if(ra->fh >= 0)
+        close(ra->fh);
+    for(i = 0; i < ra->depth; i++)
+        free(ra->blocks[i].data);
+    free(ra->blocks);
+    free(ra);
+}
+
+static Readahead *
+readahead_start(int fh, off_t offset, off_t end, size_t depth, size_t read_size)
+{
+    /* start a reader thread for fh, positioned at offset, reading up to end (-1: up to eof).
+     * returns NULL if that fails, then the caller just reads the file without read-ahead.
+     */
+    size_t i;
+    Readahead *ra = calloc(sizeof(Readahead), 1);
+    if(!ra)
+        return NULL;
+    ra->depth = depth;
+    ra->read_size = read_size;
+    ra->offset = offset;
+    ra->end = end;
+    ra->fh = dup(fh);
+    ra->blocks = calloc(sizeof(ReadaheadBlock), depth);
+    if(ra->fh < 0 || !ra->blocks)
+        goto fail;
+    for(i = 0; i < depth; i++) {
+        ra->blocks[i].data = malloc(read_size);
+        if(!ra->blocks[i].data)
+            goto fail;
+    }
+    #if ( ( _XOPEN_SOURCE >= 600 || _POSIX_C_SOURCE >= 200112L ) && defined(POSIX_FADV_DONTNEED) )
+    if (pagemask == 0)
+        pagemask = getpagesize() - 1;  /* do it here, so the thread does not race on it */
+    #endif
+    pthread_mutex_init(&ra->mutex, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    if(pthread_create(&ra->thread, NULL, readahead_thread, ra) != 0) {
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->mutex);
+        goto fail;
+    }
+    return ra;
+fail:
+    readahead_free(ra);
+    return NULL;
+}
+
+static void
+readahead_stop(Readahead *ra)
+{
+    pthread_mutex_lock(&ra->mutex);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+    pthread_join(ra->thread, NULL);
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->mutex);
+    readahead_free(ra);
+}
+
+static ssize_t
+readahead_read(Readahead *ra, uint8_t *buf, size_t size)
+{
+    /* like read(), but from the read-ahead queue. must be called without holding the GIL. */
+    ReadaheadBlock *b;
+    size_t got = 0, n;
+    ssize_t rc = 0;
+
+    pthread_mutex_lock(&ra->mutex);
+    while(got < size) {
+        while(ra->count == 0)
+            pthread_cond_wait(&ra->cond, &ra->mutex);
+        b = &ra->blocks[ra->head];
+        if(b->n <= 0) {
+            /* eof or error, the block stays at the head of the queue */
+            if(got == 0 && b->n < 0) {
+                errno = b->err;
+                rc = -1;
+            }
+            break;
+        }
+        n = b->n - ra->head_pos;
+        if(n > size - got)
+            n = size - got;
+        /* the reader thread does not touch the filled blocks, so copy without holding the lock */
+        pthread_mutex_unlock(&ra->mutex);
+        memcpy(buf + got, b->data + ra->head_pos, n);
+        pthread_mutex_lock(&ra->mutex);
+        got += n;
+        ra->head_pos += n;
+        if(ra->head_pos == (size_t)b->n) {
+            ra->head = (ra->head + 1) % ra->depth;
+            ra->count--;
+            ra->head_pos = 0;
+            pthread_cond_broadcast(&ra->cond);
+        }
+    }
+    pthread_mutex_unlock(&ra->mutex);
+    return rc < 0 ? rc : (ssize_t)got;
+}
+
+/* Parallel scanning
+
+For big files, the candidate cutting places (positions where the hash of the window starting
+there has all chunk_mask bits zero) are searched by multiple threads, each scanning a segment
+of the buffer. As the buzhash value only depends on the window contents, each thread can just
+start with a freshly computed hash at its segment start, there is no state to carry over from
+the previous segment.
+
+chunker_process_parallel then picks the cutting places from the candidates using the same
+rules (min_size, max_size, eof handling) as chunker_process, so the chunks are identical.
+*/
+
+#define PARALLEL_SEGMENT (4 * 1024 * 1024)  /* min. bytes per thread and scan */
+#define PARALLEL_MAX_THREADS 64
+
+typedef struct {
+    const uint8_t *data;  /* start of the segment */
+    size_t n;  /* number of positions to check, data must have n - 1 + window_size bytes */
+    off_t offset;  /* file offset of data[0] */
+    size_t window_size;
+    uint32_t chunk_mask;
+    const uint32_t *table, *table_rot;
+    buzhash_scan_func scan;
+    off_t *hits;  /* file offsets of the candidate cutting places found */
+    size_t count, alloc;
+    int failed;  /* out of memory */
+} ScanJob;
+
+static void *
+scan_job_run(void *arg)
+{
+    ScanJob *j = arg;
+    const uint8_t *p = j->data;
+    size_t i = 0, w = j->window_size;
+    uint32_t sum = buzhash(p, w, j->table);
+    off_t *hits;
+
+    while(i < j->n) {
+        i += j->scan(p + i, j->n - i, &sum, j->chunk_mask, w, j->table, j->table_rot);
+        if(i >= j->n)
+            break;
+        /* the hash at p + i has all chunk_mask bits zero */
+        if(j->count == j->alloc) {
+            j->alloc = j->alloc ? 2 * j->alloc : 64;
+            hits = realloc(j->hits, j->alloc * sizeof(off_t));
+            if(!hits) {
+                j->failed = 1;
+                break;
+            }
+            j->hits = hits;
+        }
+        j->hits[j->count++] = j->offset + i;
+        sum = buzhash_update(sum, p[i], p[i + w], w, j->table);
+        i++;
+    }
+    return NULL;
+}
+
+#else
+
+typedef void Readahead;
+
+#define readahead_start(fh, offset, end, depth, read_size) NULL
+#define readahead_stop(ra)
+#define readahead_read(ra, buf, size) -1
+
+#endif  /* CHUNKER_THREADS */
+
 typedef struct {
     uint32_t chunk_mask;
     uint32_t *table;
-    uint8_t *data;
+    uint32_t *table_rot;
+    uint64_t *gear;
+    uint64_t gear_mask_s, gear_mask_l;
+    uint8_t *data;  /* points into buf or into the current mmap window */
+    uint8_t *buf;
     PyObject *fd;
     int fh;
     int done, eof;
-    size_t min_size, buf_size, window_size, remaining, position, last;
+    size_t min_size, normal_size, buf_size, window_size, remaining, position, last;
     off_t bytes_read, bytes_yielded;
+    off_t range_start, range_end;  /* the file offsets chunked, range_end is -1 for "up to eof" */
+    int use_mmap;
+    PyObject *map_view;  /* memoryview of the current mmap window */
+    uint8_t *map_data;
+    off_t map_offset, file_size;
+    size_t map_len;
+    Readahead *ra;
+    size_t readahead_depth, read_size;
+    size_t max_size, buf_alloc;
+    int threads, batch;
+    off_t scanned;  /* parallel mode: the candidates for all positions < scanned are in cands */
+    off_t *cands;
+    size_t cands_head, cands_count, cands_alloc;
 } Chunker;
 
 static Chunker *
@@ -122,37 +666,259 @@ chunker_init(size_t window_size, uint32_t chunk_mask, size_t min_size, size_t ma
     c->chunk_mask = chunk_mask;
     c->min_size = min_size;
     c->table = buzhash_init_table(seed);
-    c->buf_size = max_size;
-    c->data = malloc(c->buf_size);
+    c->table_rot = buzhash_init_table_rot(c->table, window_size);
+    c->buf_size = c->max_size = max_size;
+    c->threads = 1;
     c->fh = -1;
     return c;
 }
 
 static void
-chunker_set_fd(Chunker *c, PyObject *fd, int fh)
+chunker_set_readahead(Chunker *c, size_t depth, size_t read_size)
+{
+    /* depth == 0 disables read-ahead */
+    #if defined(CHUNKER_THREADS)
+    c->readahead_depth = depth;
+    c->read_size = read_size;
+    #endif
+}
+
+static void
+chunker_set_threads(Chunker *c, int threads)
+{
+    /* threads > 1 enables parallel scanning for the next chunker_set_fd (buzhash only) */
+    #if defined(CHUNKER_THREADS)
+    if(threads > PARALLEL_MAX_THREADS)
+        threads = PARALLEL_MAX_THREADS;
+    c->threads = threads > 1 && c->table ? threads : 1;
+    #endif
+}
+
+#define BATCH_SIZE (4 * 1024 * 1024)  /* extra buffer space in batch mode, see chunker_process_batch */
+
+static void
+chunker_set_batch(Chunker *c, int batch)
 {
+    /* batch != 0 makes the next chunker_set_fd use a bigger buffer for chunker_process_batch */
+    c->batch = batch;
+}
+
+static void
+chunker_stop_readahead(Chunker *c)
+{
+    PyThreadState *thread_state;
+    if(!c->ra)
+        return;
+    thread_state = PyEval_SaveThread();
+    readahead_stop(c->ra);
+    PyEval_RestoreThread(thread_state);
+    c->ra = NULL;
+}
+
+static void
+chunker_set_fd(Chunker *c, PyObject *fd, int fh, int use_mmap)
+{
+    chunker_stop_readahead(c);
     Py_XDECREF(c->fd);
+    Py_CLEAR(c->map_view);
     c->fd = fd;
     Py_INCREF(fd);
     c->fh = fh;
+    c->use_mmap = use_mmap && fh >= 0;
+    c->file_size = -1;
+    /* in parallel and batch mode, we read (and scan) more than max_size bytes at once */
+    c->buf_size = c->max_size;
+    #if defined(CHUNKER_THREADS)
+    if(c->threads > 1)
+        c->buf_size += (size_t)c->threads * PARALLEL_SEGMENT;
+    else
+    #endif
+    if(c->batch)
+        c->buf_size += BATCH_SIZE;
+    if(c->buf && c->buf_alloc < c->buf_size) {
+        free(c->buf);
+        c->buf = NULL;
+    }
+    c->data = c->buf;
+    c->scanned = 0;
+    c->cands_head = c->cands_count = 0;
     c->done = 0;
     c->remaining = 0;
     c->bytes_read = 0;
     c->bytes_yielded = 0;
+    c->range_start = 0;
+    c->range_end = -1;
     c->position = 0;
     c->last = 0;
     c->eof = 0;
 }
 
+static void
+chunker_set_range(Chunker *c, off_t offset, off_t size)
+{
+    /* only chunk the size bytes at offset, called after chunker_set_fd with the file
+     * positioned at offset. the byte counts are file offsets then.
+     */
+    c->bytes_read = c->bytes_yielded = c->scanned = c->range_start = offset;
+    c->range_end = offset + size;
+}
+
 static void
 chunker_free(Chunker *c)
 {
+    chunker_stop_readahead(c);
     Py_XDECREF(c->fd);
+    Py_XDECREF(c->map_view);
     free(c->table);
-    free(c->data);
+    free(c->table_rot);
+    free(c->gear);
+    free(c->buf);
+    free(c->cands);
     free(c);
 }
 
+/* mmap mode
+
+Instead of read()ing regular files into buf, the file is mapped in windows of MMAP_WINDOW
+bytes, the boundary search runs directly on the mapping and the chunks are returned as
+memoryviews into the mapping (no copying).
+
+The Python mmap module is used for the mapping, each returned chunk memoryview keeps its
+mapping alive, so chunks stay valid even after the chunker moved on to the next window.
+
+The data is presented to chunker_process exactly like read() would do it (at most buf_size
+bytes starting at c->last), so the chunks are cut at the same places as in read mode.
+
+Note: if a mapped file is truncated while we access the mapping, we get killed by SIGBUS,
+thus this mode is opt-in.
+*/
+
+#define MMAP_WINDOW (64 * 1024 * 1024)
+
+static void
+chunker_unmap(Chunker *c, off_t end)
+{
+    /* drop our reference to the current mapping, then tell the OS that we do not need the
+     * pages up to <end> in the cache any more (same as in chunker_fill).
+     */
+    off_t offset = c->map_offset;
+    if(!c->map_view)
+        return;
+    Py_CLEAR(c->map_view);
+    c->map_data = NULL;
+    #if ( ( _XOPEN_SOURCE >= 600 || _POSIX_C_SOURCE >= 200112L ) && defined(POSIX_FADV_DONTNEED) )
+    if (pagemask == 0)
+        pagemask = getpagesize() - 1;
+    end &= ~pagemask;
+    if(end > offset)
+        posix_fadvise(c->fh, offset, end - offset, POSIX_FADV_DONTNEED);
+    #else
+    (void)offset;
+    (void)end;
+    #endif
+}
+
+static int
+chunker_map(Chunker *c, off_t offset, size_t length)
+{
+    PyObject *mmap_module, *mmap_type = NULL, *access = NULL, *advice = NULL;
+    PyObject *map = NULL, *args = NULL, *kwargs = NULL, *res;
+    int rc = 0;
+
+    mmap_module = PyImport_ImportModule("mmap");
+    if(!mmap_module)
+        return 0;
+    mmap_type = PyObject_GetAttrString(mmap_module, "mmap");
+    access = PyObject_GetAttrString(mmap_module, "ACCESS_READ");
+    if(!mmap_type || !access)
+        goto fail;
+    args = Py_BuildValue("(in)", c->fh, (Py_ssize_t)length);
+    kwargs = Py_BuildValue("{sOsL}", "access", access, "offset", (long long)offset);
+    if(!args || !kwargs)
+        goto fail;
+    map = PyObject_Call(mmap_type, args, kwargs);
+    if(!map)
+        goto fail;
+    if(PyObject_HasAttrString(mmap_module, "MADV_SEQUENTIAL")) {
+        advice = PyObject_GetAttrString(mmap_module, "MADV_SEQUENTIAL");
+        if(!advice)
+            goto fail;
+        res = PyObject_CallMethod(map, "madvise", "O", advice);
+        if(!res)
+            goto fail;
+        Py_DECREF(res);
+    }
+    c->map_view = PyMemoryView_FromObject(map);
+    if(!c->map_view)
+        goto fail;
+    c->map_data = (uint8_t *)PyMemoryView_GET_BUFFER(c->map_view)->buf;
+    c->map_offset = offset;
+    c->map_len = length;
+    rc = 1;
+fail:
+    Py_XDECREF(map);
+    Py_XDECREF(args);
+    Py_XDECREF(kwargs);
+    Py_XDECREF(advice);
+    Py_XDECREF(access);
+    Py_XDECREF(mmap_type);
+    Py_DECREF(mmap_module);
+    return rc;
+}
+
+static int
+chunker_fill_mmap(Chunker *c)
+{
+    /* returns 1 on success, 0 on error (exception set), -1 if the file can not be mapped */
+    struct stat st;
+    off_t last_offset, end, limit, granularity = 65536, map_offset;
+    size_t n, map_len;
+
+    if(c->file_size < 0) {
+        if(fstat(c->fh, &st) != 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return 0;
+        }
+        if(!S_ISREG(st.st_mode) || st.st_size == 0)
+            return -1;
+        c->file_size = st.st_size;
+    }
+    limit = c->file_size;
+    if(c->range_end >= 0 && c->range_end < limit)
+        limit = c->range_end;
+    /* the file offset of c->data[c->last], our data window can be buf_size long from there */
+    last_offset = c->bytes_read - (off_t)(c->position + c->remaining - c->last);
+    end = last_offset + (off_t)c->buf_size;
+    if(c->eof || end == c->bytes_read) {
+        return 1;
+    }
+    if(c->bytes_read >= limit) {
+        c->eof = 1;
+        return 1;
+    }
+    if(end > limit)
+        end = limit;
+    if(!c->map_view || last_offset < c->map_offset || end > c->map_offset + (off_t)c->map_len) {
+        /* mmap offsets must be a multiple of ALLOCATIONGRANULARITY (64kiB is good for all platforms) */
+        map_offset = last_offset & ~(granularity - 1);
+        map_len = MMAP_WINDOW;
+        if(map_len < (size_t)(end - map_offset))
+            map_len = end - map_offset;
+        if(map_len > (size_t)(c->file_size - map_offset))
+            map_len = c->file_size - map_offset;
+        chunker_unmap(c, map_offset);
+        if(!chunker_map(c, map_offset, map_len))
+            return 0;
+    }
+    n = end - c->bytes_read;
+    c->data = c->map_data + (last_offset - c->map_offset);
+    c->position -= c->last;
+    c->last = 0;
+    c->remaining += n;
+    c->bytes_read += n;
+    return 1;
+}
+
 static int
 chunker_fill(Chunker *c)
 {
@@ -160,6 +926,21 @@ chunker_fill(Chunker *c)
     PyObject *data;
     PyThreadState *thread_state;
 
+    if(c->use_mmap) {
+        int rc = chunker_fill_mmap(c);
+        if(rc >= 0)
+            return rc;
+        c->use_mmap = 0;  /* not mappable, read it */
+    }
+    if(!c->buf) {
+        c->buf = malloc(c->buf_size);
+        if(!c->buf) {
+            PyErr_NoMemory();
+            return 0;
+        }
+        c->buf_alloc = c->buf_size;
+        c->data = c->buf;
+    }
     memmove(c->data, c->data + c->last, c->position + c->remaining - c->last);
     c->position -= c->last;
     c->last = 0;
@@ -167,15 +948,27 @@ chunker_fill(Chunker *c)
     if(c->eof || n == 0) {
         return 1;
     }
+    if(c->range_end >= 0 && c->bytes_read + n > c->range_end) {
+        n = c->range_end - c->bytes_read;
+        if(n <= 0) {
+            c->eof = 1;
+            return 1;
+        }
+    }
     if(c->fh >= 0) {
-        thread_state = PyEval_SaveThread();
-
-        #if ( ( _XOPEN_SOURCE >= 600 || _POSIX_C_SOURCE >= 200112L ) && defined(POSIX_FADV_DONTNEED) )
         off_t offset = c->bytes_read;
-        #endif
+
+        if(!c->ra && c->readahead_depth && c->bytes_read > c->range_start) {
+            /* not a small file, read the rest of it in the background */
+            c->ra = readahead_start(c->fh, c->bytes_read, c->range_end, c->readahead_depth, c->read_size);
+        }
+        thread_state = PyEval_SaveThread();
 
         // if we have a os-level file descriptor, use os-level API
-        n = read(c->fh, c->data + c->position + c->remaining, n);
+        if(c->ra)
+            n = readahead_read(c->ra, c->data + c->position + c->remaining, n);
+        else
+            n = read(c->fh, c->data + c->position + c->remaining, n);
         if(n > 0) {
             c->remaining += n;
             c->bytes_read += n;
@@ -190,37 +983,8 @@ chunker_fill(Chunker *c)
             PyErr_SetFromErrno(PyExc_OSError);
             return 0;
         }
-        #if ( ( _XOPEN_SOURCE >= 600 || _POSIX_C_SOURCE >= 200112L ) && defined(POSIX_FADV_DONTNEED) )
-        off_t length = c->bytes_read - offset;
-
-        // Only do it once per run.
-        if (pagemask == 0)
-            pagemask = getpagesize() - 1;
-
-        // We tell the OS that we do not need the data that we just have read any
-        // more (that it maybe has in the cache). This avoids that we spoil the
-        // complete cache with data that we only read once and (due to cache
-        // size limit) kick out data from the cache that might be still useful
-        // for the OS or other processes.
-        // We rollback the initial offset back to the start of the page,
-        // to avoid it not being truncated as a partial page request.
-        int overshoot;
-        if (length > 0) {
-            // All Linux kernels (at least up to and including 4.6(.0)) have a bug where
-            // they truncate last partial page of POSIX_FADV_DONTNEED request, so we need
-            // to page-align it ourselves. We'll need the rest of this page on the next
-            // read (assuming this was not EOF).
-            overshoot = (offset + length) & pagemask;
-        } else {
-            // For length == 0 we set overshoot 0, so the below
-            // length - overshoot is 0, which means till end of file for
-            // fadvise. This will cancel the final page and is not part
-            // of the above workaround.
-            overshoot = 0;
-        }
-
-        posix_fadvise(c->fh, offset & ~pagemask, length - overshoot, POSIX_FADV_DONTNEED);
-        #endif
+        if(!c->ra)
+            fadvise_dontneed(c->fh, offset, c->bytes_read - offset);
 
         PyEval_RestoreThread(thread_state);
     }
@@ -248,18 +1012,209 @@ chunker_fill(Chunker *c)
     return 1;
 }
 
+static PyObject *
+chunker_stop(Chunker *c)
+{
+    /* the chunker is done with the file, check the byte counts and end the iteration */
+    chunker_unmap(c, c->bytes_read);
+    chunker_stop_readahead(c);
+    if(c->bytes_read == c->bytes_yielded)
+        PyErr_SetNone(PyExc_StopIteration);
+    else
+        PyErr_SetString(PyExc_Exception, "chunkifier byte count mismatch");
+    return NULL;
+}
+
+static PyObject *
+chunker_view(Chunker *c, size_t offset, size_t n)
+{
+    /* a memoryview of the chunk data, in mmap mode it keeps the mapping alive */
+    Py_ssize_t start;
+    if(c->map_view) {
+        start = (c->data - c->map_data) + offset;
+        return PySequence_GetSlice(c->map_view, start, start + n);
+    }
+    return PyMemoryView_FromMemory((char *)(c->data + offset), n, PyBUF_READ);
+}
+
+static size_t
+chunker_cut(Chunker *c)
+{
+    /* the size of the next chunk, starting at c->position. there must be at least max_size
+     * bytes remaining or we must be at eof. the cutting places are the same as found by
+     * chunker_process: cut at the first place at least min_size bytes after the chunk start,
+     * that has its complete hash window before the end of the data (limited by max_size),
+     * otherwise at that end.
+     */
+    size_t end = c->remaining < c->max_size ? c->remaining : c->max_size;
+    size_t i, n, window_size = c->window_size;
+    uint8_t *p;
+    uint32_t sum;
+
+    #if defined(CHUNKER_THREADS)
+    if(c->threads > 1) {
+        /* the candidates were already found by chunker_scan_parallel */
+        off_t start = c->bytes_read - (off_t)c->remaining;
+        while(c->cands_head < c->cands_count && c->cands[c->cands_head] < start + (off_t)c->min_size)
+            c->cands_head++;
+        if(c->cands_head < c->cands_count && c->cands[c->cands_head] + (off_t)window_size < start + (off_t)end)
+            return c->cands[c->cands_head] - start;
+        return end;
+    }
+    #endif
+    if(c->min_size + window_size >= end)
+        return end;
+    p = c->data + c->position + c->min_size;
+    n = end - window_size - c->min_size;  /* the number of places to check */
+    sum = buzhash(p, window_size, c->table);
+    i = buzhash_scan_funcs[buzhash_scan_selected()](p, n, &sum, c->chunk_mask, window_size, c->table, c->table_rot);
+    return i < n ? c->min_size + i : end;
+}
+
+#if defined(CHUNKER_THREADS)
+
+static int
+chunker_scan_parallel(Chunker *c, off_t from, off_t to)
+{
+    /* find the candidate cutting places at file offsets from .. to - 1, append them to c->cands */
+    ScanJob jobs[PARALLEL_MAX_THREADS];
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    int started[PARALLEL_MAX_THREADS];
+    size_t k, njobs, seg, total = to - from, count = 0;
+    off_t base = c->bytes_read - (off_t)(c->position + c->remaining);  /* file offset of c->data[0] */
+    off_t *cands;
+    int failed = 0;
+    PyThreadState *thread_state;
+
+    njobs = total / PARALLEL_SEGMENT;
+    if(njobs > (size_t)c->threads)
+        njobs = c->threads;
+    if(njobs < 1)
+        njobs = 1;
+    seg = total / njobs;
+    memset(jobs, 0, sizeof(jobs));
+    for(k = 0; k < njobs; k++) {
+        jobs[k].data = c->data + (from - base) + k * seg;
+        jobs[k].n = k == njobs - 1 ? total - k * seg : seg;
+        jobs[k].offset = from + k * seg;
+        jobs[k].window_size = c->window_size;
+        jobs[k].chunk_mask = c->chunk_mask;
+        jobs[k].table = c->table;
+        jobs[k].table_rot = c->table_rot;
+        jobs[k].scan = buzhash_scan_funcs[buzhash_scan_selected()];
+    }
+    thread_state = PyEval_SaveThread();
+    for(k = 1; k < njobs; k++)
+        started[k] = pthread_create(&threads[k], NULL, scan_job_run, &jobs[k]) == 0;
+    scan_job_run(&jobs[0]);
+    for(k = 1; k < njobs; k++) {
+        if(started[k])
+            pthread_join(threads[k], NULL);
+        else
+            scan_job_run(&jobs[k]);
+    }
+    PyEval_RestoreThread(thread_state);
+
+    /* drop the candidates we are done with, append the new ones */
+    memmove(c->cands, c->cands + c->cands_head, (c->cands_count - c->cands_head) * sizeof(off_t));
+    c->cands_count -= c->cands_head;
+    c->cands_head = 0;
+    for(k = 0; k < njobs; k++) {
+        failed |= jobs[k].failed;
+        count += jobs[k].count;
+    }
+    if(!failed && c->cands_count + count > c->cands_alloc) {
+        cands = realloc(c->cands, (c->cands_count + count) * sizeof(off_t));
+        if(cands) {
+            c->cands = cands;
+            c->cands_alloc = c->cands_count + count;
+        }
+        else
+            failed = 1;
+    }
+    for(k = 0; k < njobs; k++) {
+        if(!failed && jobs[k].count) {
+            memcpy(c->cands + c->cands_count, jobs[k].hits, jobs[k].count * sizeof(off_t));
+            c->cands_count += jobs[k].count;
+        }
+        free(jobs[k].hits);
+    }
+    if(failed) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    return 1;
+}
+
+#endif  /* CHUNKER_THREADS */
+
+static int
+chunker_fill_cut(Chunker *c)
+{
+    /* read until there are at least max_size bytes remaining or we are at eof, as needed by
+     * chunker_cut. in parallel mode, also find the candidate cutting places in the new data.
+     */
+    while(c->remaining < c->max_size && !c->eof) {
+        if(!chunker_fill(c)) {
+            return 0;
+        }
+        #if defined(CHUNKER_THREADS)
+        if(c->threads > 1) {
+            off_t scan_to = c->bytes_read - (off_t)c->window_size;
+            if(scan_to > c->scanned) {
+                if(!chunker_scan_parallel(c, c->scanned, scan_to)) {
+                    return 0;
+                }
+                c->scanned = scan_to;
+            }
+        }
+        #endif
+    }
+    return 1;
+}
+
+#if defined(CHUNKER_THREADS)
+
+static PyObject *
+chunker_process_parallel(Chunker *c)
+{
+    size_t n, old_last;
+
+    if(c->done) {
+        return chunker_stop(c);
+    }
+    if(!chunker_fill_cut(c)) {
+        return NULL;
+    }
+    if(c->remaining == 0) {
+        c->done = 1;
+        return chunker_stop(c);
+    }
+    n = chunker_cut(c);
+    c->position += n;
+    c->remaining -= n;
+    old_last = c->last;
+    c->last = c->position;
+    c->bytes_yielded += n;
+    return chunker_view(c, old_last, n);
+}
+
+#endif  /* CHUNKER_THREADS */
+
 static PyObject *
 chunker_process(Chunker *c)
 {
     uint32_t sum, chunk_mask = c->chunk_mask;
     size_t n, old_last, min_size = c->min_size, window_size = c->window_size;
+    buzhash_scan_func scan = buzhash_scan_funcs[buzhash_scan_selected()];
+
+    #if defined(CHUNKER_THREADS)
+    if(c->threads > 1)
+        return chunker_process_parallel(c);
+    #endif
 
     if(c->done) {
-        if(c->bytes_read == c->bytes_yielded)
-            PyErr_SetNone(PyExc_StopIteration);
-        else
-            PyErr_SetString(PyExc_Exception, "chunkifier byte count mismatch");
-        return NULL;
+        return chunker_stop(c);
     }
     while(c->remaining < min_size + window_size + 1 && !c->eof) {  /* see assert in Chunker init */
         if(!chunker_fill(c)) {
@@ -271,15 +1226,9 @@ chunker_process(Chunker *c)
         c->done = 1;
         if(c->remaining) {
             c->bytes_yielded += c->remaining;
-            return PyMemoryView_FromMemory((char *)(c->data + c->position), c->remaining, PyBUF_READ);
-        }
-        else {
-            if(c->bytes_read == c->bytes_yielded)
-                PyErr_SetNone(PyExc_StopIteration);
-            else
-                PyErr_SetString(PyExc_Exception, "chunkifier byte count mismatch");
-            return NULL;
+            return chunker_view(c, c->position, c->remaining);
         }
+        return chunker_stop(c);
     }
     /* ... or we have at least min_size + window_size + 1 bytes remaining.
      * We do not want to "cut" a chunk smaller than min_size and the hash
@@ -289,15 +1238,8 @@ chunker_process(Chunker *c)
     c->remaining -= min_size;
     sum = buzhash(c->data + c->position, window_size, c->table);
     while(c->remaining > c->window_size && (sum & chunk_mask)) {
-        uint8_t *p = c->data + c->position;
-        uint8_t *stop_at = p + c->remaining - window_size;
-        size_t did_bytes;
-        while (p < stop_at && (sum & chunk_mask)) {
-            sum = buzhash_update(sum, p[0], p[window_size],
-                                 window_size, c->table);
-            p++;
-        }
-        did_bytes = p - (c->data + c->position);
+        size_t did_bytes = scan(c->data + c->position, c->remaining - window_size, &sum,
+                                chunk_mask, window_size, c->table, c->table_rot);
         c->position += did_bytes;
         c->remaining -= did_bytes;
         if(c->remaining <= window_size) {
@@ -314,5 +1256,409 @@ chunker_process(Chunker *c)
     c->last = c->position;
     n = c->last - old_last;
     c->bytes_yielded += n;
-    return PyMemoryView_FromMemory((char *)(c->data + old_last), n, PyBUF_READ);
+    return chunker_view(c, old_last, n);
+}
+
+/* Batch mode
+
+Instead of returning one chunk per call, chunker_process_batch cuts all chunks it can cut from
+the data in the buffer (at most buf_size bytes, so the data does not need to be moved) and
+returns a memoryview of these chunks' data and a list of (offset, length, allocation) tuples,
+offset being relative to the start of the memoryview. All-zero chunks have allocation
+CHUNK_ALLOC. The chunks are the same as returned by chunker_process.
+*/
+
+static PyObject *
+chunker_process_batch(Chunker *c)
+{
+    PyObject *boundaries, *boundary, *view, *result;
+    size_t n, start;
+
+    if(c->done) {
+        return chunker_stop(c);
+    }
+    if(!chunker_fill_cut(c)) {
+        return NULL;
+    }
+    if(c->remaining == 0) {
+        c->done = 1;
+        return chunker_stop(c);
+    }
+    boundaries = PyList_New(0);
+    if(!boundaries)
+        return NULL;
+    start = c->position;
+    while(c->remaining && (c->remaining >= c->max_size || c->eof)) {
+        n = chunker_cut(c);
+        boundary = Py_BuildValue("(nni)", (Py_ssize_t)(c->position - start), (Py_ssize_t)n,
+                                 is_all_zero(c->data + c->position, n) ? CHUNK_ALLOC : CHUNK_DATA);
+        if(!boundary || PyList_Append(boundaries, boundary) < 0) {
+            Py_XDECREF(boundary);
+            Py_DECREF(boundaries);
+            return NULL;
+        }
+        Py_DECREF(boundary);
+        c->position += n;
+        c->remaining -= n;
+        c->bytes_yielded += n;
+    }
+    c->last = c->position;
+    view = chunker_view(c, start, c->position - start);
+    if(!view) {
+        Py_DECREF(boundaries);
+        return NULL;
+    }
+    result = PyTuple_Pack(2, view, boundaries);
+    Py_DECREF(view);
+    Py_DECREF(boundaries);
+    return result;
+}
+
+/* FastCDC / gear hash
+
+https://www.usenix.org/conference/atc16/technical-sessions/presentation/xia
+
+The gear hash is updated by sum = (sum << 1) + gear[byte], so there is no need to remove bytes
+leaving the window: they just get shifted out. Thus, the most significant bit of the hash
+depends on the last 64 bytes, and we check the most significant bits to find cutting places.
+
+Normalized chunking: before the chunk reaches normal_size, a mask with 2 more bits is used
+(making a cut less likely), after that a mask with 2 less bits is used (making a cut more
+likely). This gives a narrower chunk size distribution around normal_size.
+
+Cut-point skipping: hashing only starts after min_size bytes of the chunk (the hash starts
+from 0 there), so min_size bytes per chunk are not looked at at all.
+
+The gear table is derived from the per-repo seed (using splitmix64), so the chunk sizes
+can not be used for fingerprinting, same as for buzhash.
+*/
+
+#define FASTCDC_NORMALIZATION 2
+
+static uint64_t *
+fastcdc_init_gear(uint32_t seed)
+{
+    int i;
+    uint64_t x = seed, z;
+    uint64_t *gear = malloc(256 * sizeof(uint64_t));
+    for(i = 0; i < 256; i++)
+    {
+        x += 0x9e3779b97f4a7c15ULL;
+        z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    return gear;
+}
+
+static uint64_t
+fastcdc_mask(int bits)
+{
+    /* the <bits> most significant bits */
+    return bits <= 0 ? 0 : ~(uint64_t)0 << (64 - bits);
+}
+
+static Chunker *
+chunker_init_fastcdc(size_t min_size, size_t normal_size, size_t max_size, int mask_bits, uint32_t seed)
+{
+    Chunker *c = calloc(sizeof(Chunker), 1);
+    c->min_size = min_size;
+    c->normal_size = normal_size;
+    c->gear = fastcdc_init_gear(seed);
+    c->gear_mask_s = fastcdc_mask(mask_bits + FASTCDC_NORMALIZATION);
+    c->gear_mask_l = fastcdc_mask(mask_bits - FASTCDC_NORMALIZATION);
+    c->buf_size = c->max_size = max_size;
+    c->threads = 1;
+    c->fh = -1;
+    return c;
+}
+
+static size_t
+fastcdc_scan(const uint8_t *p, size_t n, uint64_t *sum, uint64_t mask, const uint64_t *gear)
+{
+    /* advance over at most n bytes, stop after the first byte that gives (sum & mask) == 0 */
+    size_t i = 0;
+    uint64_t s = *sum;
+    while(i < n) {
+        s = (s << 1) + gear[p[i++]];
+        if(!(s & mask))
+            break;
+    }
+    *sum = s;
+    return i;
+}
+
+static PyObject *
+fastcdc_process(Chunker *c)
+{
+    uint64_t sum = 0, mask;
+    size_t n, did_bytes, length, old_last, min_size = c->min_size, normal_size = c->normal_size;
+    int found = 0;
+
+    if(c->done) {
+        return chunker_stop(c);
+    }
+    while(c->remaining <= min_size && !c->eof) {
+        if(!chunker_fill(c)) {
+            return NULL;
+        }
+    }
+    /* at eof, with not more than min_size bytes left: that is the last chunk. */
+    if(c->remaining <= min_size) {
+        c->done = 1;
+        if(c->remaining) {
+            c->bytes_yielded += c->remaining;
+            return chunker_view(c, c->position, c->remaining);
+        }
+        return chunker_stop(c);
+    }
+    /* skip over min_size bytes, we do not cut chunks smaller than that. */
+    c->position += min_size;
+    c->remaining -= min_size;
+    while(!found) {
+        length = c->position - c->last;
+        n = c->remaining;
+        if(length < normal_size) {
+            mask = c->gear_mask_s;
+            if(n > normal_size - length)
+                n = normal_size - length;
+        }
+        else {
+            mask = c->gear_mask_l;
+        }
+        did_bytes = fastcdc_scan(c->data + c->position, n, &sum, mask, c->gear);
+        c->position += did_bytes;
+        c->remaining -= did_bytes;
+        found = did_bytes && !(sum & mask);
+        if(!found && c->remaining == 0) {
+            if(!chunker_fill(c)) {
+                return NULL;
+            }
+            if(c->remaining == 0) {
+                /* eof or max_size reached (the buffer is full) */
+                break;
+            }
+        }
+    }
+    old_last = c->last;
+    c->last = c->position;
+    n = c->last - old_last;
+    c->bytes_yielded += n;
+    return chunker_view(c, old_last, n);
+}
+
+/* Fixed size chunker
+
+Cuts the ranges of a file map (a sequence of (start, size, is_data) tuples, see sparsemap) into
+blocks of block_size bytes (the last block of a range may be shorter). Data blocks are read into
+a reusable buffer and checked for being all-zero, hole blocks are just seeked over.
+*/
+
+typedef struct {
+    off_t start, size;
+    int is_data;
+} FixedRange;
+
+typedef struct {
+    size_t block_size;
+    uint8_t *buf;
+    PyObject *fd;
+    int fh;
+    FixedRange *ranges;
+    Py_ssize_t nranges, range;  /* range: index of the current range */
+    off_t offset, range_left;  /* current file offset, bytes left in the current range */
+    int range_started, done;
+} FixedChunker;
+
+static FixedChunker *
+fixed_chunker_init(size_t block_size)
+{
+    FixedChunker *c = calloc(sizeof(FixedChunker), 1);
+    c->block_size = block_size;
+    c->fh = -1;
+    return c;
+}
+
+static void
+fixed_chunker_free(FixedChunker *c)
+{
+    Py_XDECREF(c->fd);
+    free(c->ranges);
+    free(c->buf);
+    free(c);
+}
+
+static int
+fixed_chunker_set_fd(FixedChunker *c, PyObject *fd, int fh, PyObject *fmap)
+{
+    PyObject *seq, *item;
+    Py_ssize_t i;
+    long long start, size;
+    int is_data;
+    FixedRange *ranges;
+
+    seq = PySequence_Fast(fmap, "fmap must be iterable");
+    if(!seq)
+        return 0;
+    ranges = malloc(sizeof(FixedRange) * (PySequence_Fast_GET_SIZE(seq) + 1));
+    if(!ranges) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return 0;
+    }
+    for(i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if(!PyArg_ParseTuple(item, "LLp", &start, &size, &is_data)) {
+            free(ranges);
+            Py_DECREF(seq);
+            return 0;
+        }
+        ranges[i].start = start;
+        ranges[i].size = size;
+        ranges[i].is_data = is_data;
+    }
+    Py_DECREF(seq);
+    Py_XDECREF(c->fd);
+    c->fd = fd;
+    Py_INCREF(fd);
+    c->fh = fh;
+    free(c->ranges);
+    c->ranges = ranges;
+    c->nranges = i;
+    c->range = 0;
+    c->range_started = 0;
+    c->offset = 0;
+    c->done = 0;
+    return 1;
+}
+
+static off_t
+fixed_chunker_seek(FixedChunker *c, off_t amount, int whence)
+{
+    /* returns the new file offset, -1 on error (exception set) */
+    PyObject *res;
+    off_t pos;
+    if(c->fh >= 0) {
+        pos = lseek(c->fh, amount, whence);
+        if(pos < 0)
+            PyErr_SetFromErrno(PyExc_OSError);
+        return pos;
+    }
+    res = PyObject_CallMethod(c->fd, "seek", "Li", (long long)amount, whence);
+    if(!res)
+        return -1;
+    pos = PyLong_AsLongLong(res);
+    Py_DECREF(res);
+    if(pos < 0 && !PyErr_Occurred())
+        PyErr_SetString(PyExc_ValueError, "seek returned a negative offset");
+    return pos;
+}
+
+static PyObject *
+fixed_chunker_process(FixedChunker *c, int *allocation, Py_ssize_t *size)
+{
+    /* returns the data of the next block (None for all-zero and hole blocks) and sets
+     * *allocation and *size. returns NULL and raises StopIteration at the end.
+     */
+    FixedRange *r;
+    off_t wanted, got, pos;
+    ssize_t n;
+    PyObject *data;
+    PyThreadState *thread_state;
+
+    for(;;) {
+        if(c->done || c->range >= c->nranges) {
+            PyErr_SetNone(PyExc_StopIteration);
+            return NULL;
+        }
+        r = &c->ranges[c->range];
+        if(!c->range_started) {
+            if(r->start != c->offset) {
+                /* this is for the case when the fmap does not cover the file completely,
+                 * e.g. it could be without the ranges of holes or of unchanged data.
+                 */
+                c->offset = r->start;
+                if(fixed_chunker_seek(c, c->offset, SEEK_SET) < 0)
+                    return NULL;
+            }
+            c->range_left = r->size;
+            c->range_started = 1;
+        }
+        if(c->range_left == 0) {
+            c->range++;
+            c->range_started = 0;
+            continue;
+        }
+        wanted = c->range_left < (off_t)c->block_size ? c->range_left : (off_t)c->block_size;
+        if(r->is_data) {
+            if(c->fh >= 0) {
+                if(!c->buf) {
+                    c->buf = malloc(c->block_size);
+                    if(!c->buf)
+                        return PyErr_NoMemory();
+                }
+                thread_state = PyEval_SaveThread();
+                n = read(c->fh, c->buf, wanted);
+                if(n > 0)
+                    fadvise_dontneed(c->fh, c->offset, n);
+                PyEval_RestoreThread(thread_state);
+                if(n < 0)
+                    return PyErr_SetFromErrno(PyExc_OSError);
+                got = n;
+                if(is_all_zero(c->buf, got)) {
+                    *allocation = CHUNK_ALLOC;
+                    data = Py_None;
+                    Py_INCREF(data);
+                }
+                else {
+                    *allocation = CHUNK_DATA;
+                    data = PyMemoryView_FromMemory((char *)c->buf, got, PyBUF_READ);
+                }
+            }
+            else {
+                data = PyObject_CallMethod(c->fd, "read", "L", (long long)wanted);
+                if(!data)
+                    return NULL;
+                if(!PyBytes_Check(data)) {
+                    Py_DECREF(data);
+                    PyErr_SetString(PyExc_TypeError, "read did not return bytes");
+                    return NULL;
+                }
+                got = PyBytes_GET_SIZE(data);
+                if(is_all_zero((const uint8_t *)PyBytes_AS_STRING(data), got)) {
+                    *allocation = CHUNK_ALLOC;
+                    Py_DECREF(data);
+                    data = Py_None;
+                    Py_INCREF(data);
+                }
+                else {
+                    *allocation = CHUNK_DATA;
+                }
+            }
+        }
+        else {
+            /* hole: seek over block from the range */
+            pos = fixed_chunker_seek(c, wanted, SEEK_CUR);
+            if(pos < 0)
+                return NULL;
+            got = pos - c->offset;
+            *allocation = CHUNK_HOLE;
+            data = Py_None;
+            Py_INCREF(data);
+        }
+        if(!data)
+            return NULL;
+        if(got < wanted) {
+            /* we did not get enough data, looks like EOF. */
+            c->done = 1;
+        }
+        if(got > 0) {
+            c->offset += got;
+            c->range_left -= got;
+            *size = got;
+            return data;
+        }
+        Py_DECREF(data);
+    }
 }
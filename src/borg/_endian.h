@@ -24,7 +24,11 @@
 #if BORG_BIG_ENDIAN
 #define _le32toh(x) __builtin_bswap32(x)
 #define _htole32(x) __builtin_bswap32(x)
+#define _le64toh(x) __builtin_bswap64(x)
+#define _htole64(x) __builtin_bswap64(x)
 #else
 #define _le32toh(x) (x)
 #define _htole32(x) (x)
+#define _le64toh(x) (x)
+#define _htole64(x) (x)
 #endif
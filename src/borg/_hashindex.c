@@ -51,22 +51,35 @@ typedef struct {
     int32_t num_empty;
     int32_t key_size;
     int32_t value_size;
-    char reserved[1024 - 32];  // filler to 1024 bytes total
+    // version 3 (only used for tables too big for version 2) has 64-bit counts here, the ones above are 0.
+    int64_t num_entries64;
+    int64_t num_buckets64;
+    int64_t num_empty64;
+    char reserved[1024 - 32 - 24];  // filler to 1024 bytes total
 }) HashHeader;
 
-typedef struct {
+typedef struct HashIndex {
     unsigned char *buckets;
-    int num_entries;
-    int num_buckets;
-    int num_empty;
+    /* one control byte per bucket: CTRL_EMPTY, CTRL_DELETED or the tag of the key stored there.
+     * NULL for a memory mapped index until it gets modified the first time, see hashindex_writable. */
+    uint8_t *ctrl;
+    int64_t num_entries;
+    int64_t num_buckets;
+    int64_t num_empty;
     int key_size;
     int value_size;
     off_t bucket_size;
-    int lower_limit;
-    int upper_limit;
-    int min_empty;
+    int64_t lower_limit;
+    int64_t upper_limit;
+    int64_t min_empty;
+    /* while an incremental resize is in progress, the buckets of the old table from migrate_pos on
+     * are not moved to this one yet. */
+    struct HashIndex *old;
+    int64_t migrate_pos;
+    int64_t migrate_step;
 #ifndef BORG_NO_PYTHON
-    /* buckets may be backed by a Python buffer. If buckets_buffer.buf is NULL then this is not used. */
+    /* buckets may be backed by a Python buffer (bytes or a copy-on-write memory mapping of the index file).
+     * If buckets_buffer.buf is NULL then this is not used. */
     Py_buffer buckets_buffer;
 #endif
 } HashIndex;
@@ -85,7 +98,7 @@ typedef struct {
  *         otoh, for now, we do not need to change the sizes as they do no harm.
  *         see ticket #2830.
  */
-static int hash_sizes[] = {
+static int64_t hash_sizes[] = {
     1031, 2053, 4099, 8209, 16411, 32771, 65537, 131101, 262147, 445649,
     757607, 1287917, 2189459, 3065243, 4291319, 6007867, 8410991,
     11775359, 16485527, 23079703, 27695653, 33234787, 39881729, 47858071,
@@ -94,14 +107,28 @@ static int hash_sizes[] = {
     306647623, 337318939, 370742809, 408229973, 449387209, 493428073,
     543105119, 596976533, 657794869, 722676499, 795815791, 874066969,
     962279771, 1057701643, 1164002657, 1280003147, 1407800297, 1548442699,
-    1703765389, 1873768367, 2062383853, /* 32bit int ends about here */
+    1703765389, 1873768367, 2062383853, /* 32bit int ends about here, bigger tables need the 64-bit file format */
+    2266990367, 2493879461, 2743575431, 3017913313, 3319252439, 3651131807,
+    4016303971, 4417783633, 4859503013, 5345394331, 5882142361, 6467780993,
+    7114500109, 7826231929, 8608743709, 9469899889, 10416516317, 11459209987,
+    12603879229, 13864942183, 15251049733, 16775571427, 18453842923,
+    20298840547, 22329045733, 24561367027, 27017562713, 29722798999,
+    32692018321, 35960610659, 39556101553, 43512439169, 47863047377,
+    52648952339, 57914457067, 63706617127,
 };
 
 #define HASH_MIN_LOAD .25
-#define HASH_MAX_LOAD .75  /* don't go higher than 0.75, otherwise performance severely suffers! */
-#define HASH_MAX_EFF_LOAD .93
+#define HASH_MAX_LOAD .85  /* probing is cheap thanks to the control bytes, but long clusters still cost */
+#define HASH_MAX_EFF_LOAD .95
+
+/* growing tables with at least that many buckets is done incrementally, see hashindex_resize_start */
+#define HASH_INCREMENTAL_RESIZE_MIN 65537
+#define HASH_MIGRATE_MIN_STEP 16
+
+#define WRITE_BLOCK_BUCKETS 4096  /* see hashindex_write_transformed */
 
 #define MAX(x, y) ((x) > (y) ? (x): (y))
+#define MIN(x, y) ((x) < (y) ? (x): (y))
 #define NELEMS(x) (sizeof(x) / sizeof((x)[0]))
 
 #define EMPTY _htole32(0xffffffff)
@@ -111,12 +138,93 @@ static int hash_sizes[] = {
 
 #define BUCKET_MATCHES_KEY(index, idx, key) (memcmp(key, BUCKET_ADDR(index, idx), index->key_size) == 0)
 
-#define BUCKET_IS_DELETED(index, idx) (*((uint32_t *)(BUCKET_ADDR(index, idx) + index->key_size)) == DELETED)
-#define BUCKET_IS_EMPTY(index, idx) (*((uint32_t *)(BUCKET_ADDR(index, idx) + index->key_size)) == EMPTY)
-#define BUCKET_IS_EMPTY_OR_DELETED(index, idx) (BUCKET_IS_EMPTY(index, idx) || BUCKET_IS_DELETED(index, idx))
+#define BUCKET_MARKER(index, idx) (*((uint32_t *)(BUCKET_ADDR(index, idx) + index->key_size)))
+
+/* The in-band EMPTY / DELETED markers in the buckets are what goes to disk, but lookups only look at
+ * the control bytes, which mirror the state of each bucket. A used bucket has the 7 bit tag of its
+ * key as control byte, so the full key only needs to be compared if the tag matches.
+ */
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+#define CTRL_IS_FREE(c) ((c) & 0x80)  /* EMPTY or DELETED */
+
+#define BUCKET_IS_DELETED(index, idx) (index->ctrl[idx] == CTRL_DELETED)
+#define BUCKET_IS_EMPTY(index, idx) (index->ctrl[idx] == CTRL_EMPTY)
+#define BUCKET_IS_EMPTY_OR_DELETED(index, idx) CTRL_IS_FREE(index->ctrl[idx])
+
+/* deleting entries does not leave tombstones (see hashindex_delete_shift), but index files written by
+ * older versions, tables read with permit_compact and the old table of an incremental resize can have them. */
+#define HAS_TOMBSTONES(index) ((index)->num_entries + (index)->num_empty < (index)->num_buckets)
+
+#define BUCKET_MARK_DELETED(index, idx) do { \
+    BUCKET_MARKER(index, idx) = DELETED; \
+    index->ctrl[idx] = CTRL_DELETED; \
+} while (0)
+#define BUCKET_MARK_EMPTY(index, idx) do { \
+    BUCKET_MARKER(index, idx) = EMPTY; \
+    index->ctrl[idx] = CTRL_EMPTY; \
+} while (0)
+
+/* Control bytes are scanned in groups of GROUP_WIDTH, giving a bitmask with one bit per bucket. */
+#define GROUP_WIDTH 16
 
-#define BUCKET_MARK_DELETED(index, idx) (*((uint32_t *)(BUCKET_ADDR(index, idx) + index->key_size)) = DELETED)
-#define BUCKET_MARK_EMPTY(index, idx) (*((uint32_t *)(BUCKET_ADDR(index, idx) + index->key_size)) = EMPTY)
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#elif defined(_M_X64)
+#define PREFETCH(addr) _mm_prefetch((const char *)(addr), _MM_HINT_T0)
+#else
+#define PREFETCH(addr) ((void)(addr))
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static inline int
+ctz32(uint32_t x)
+{
+    unsigned long r;
+    _BitScanForward(&r, x);
+    return (int)r;
+}
+#else
+#define ctz32(x) __builtin_ctz(x)
+#endif
+
+static inline void
+ctrl_group_match(const uint8_t *ctrl, uint8_t tag, uint32_t *match, uint32_t *empty, uint32_t *deleted)
+{
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    *match = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+    *empty = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)CTRL_EMPTY)));
+    *deleted = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)CTRL_DELETED)));
+#else
+    int i;
+    *match = *empty = *deleted = 0;
+    for(i = 0; i < GROUP_WIDTH; i++) {
+        *match |= (uint32_t)(ctrl[i] == tag) << i;
+        *empty |= (uint32_t)(ctrl[i] == CTRL_EMPTY) << i;
+        *deleted |= (uint32_t)(ctrl[i] == CTRL_DELETED) << i;
+    }
+#endif
+}
+
+static inline uint32_t
+ctrl_group_used(const uint8_t *ctrl)
+{
+#if defined(__SSE2__) || defined(_M_X64)
+    return ~(uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl)) & 0xffff;
+#else
+    int i;
+    uint32_t used = 0;
+    for(i = 0; i < GROUP_WIDTH; i++)
+        used |= (uint32_t)!CTRL_IS_FREE(ctrl[i]) << i;
+    return used;
+#endif
+}
 
 #define EPRINTF_MSG(msg, ...) fprintf(stderr, "hashindex: " msg "\n", ##__VA_ARGS__)
 #define EPRINTF_MSG_PATH(path, msg, ...) fprintf(stderr, "hashindex: %s: " msg "\n", path, ##__VA_ARGS__)
@@ -124,16 +232,18 @@ static int hash_sizes[] = {
 #define EPRINTF_PATH(path, msg, ...) fprintf(stderr, "hashindex: %s: " msg " (%s)\n", path, ##__VA_ARGS__, strerror(errno))
 
 #ifndef BORG_NO_PYTHON
-static HashIndex *hashindex_read(PyObject *file_py, int permit_compact, int legacy);
+static HashIndex *hashindex_read(PyObject *file_py, int permit_compact, int legacy, int mmap);
 static void hashindex_write(HashIndex *index, PyObject *file_py, int legacy);
 #endif
 
 static uint64_t hashindex_compact(HashIndex *index);
-static HashIndex *hashindex_init(int capacity, int key_size, int value_size);
+static HashIndex *hashindex_init(int64_t capacity, int key_size, int value_size);
 static const unsigned char *hashindex_get(HashIndex *index, const unsigned char *key);
 static int hashindex_set(HashIndex *index, const unsigned char *key, const void *value);
+static int hashindex_writable(HashIndex *index);
 static int hashindex_delete(HashIndex *index, const unsigned char *key);
 static unsigned char *hashindex_next_key(HashIndex *index, const unsigned char *key);
+static int64_t hashindex_len(HashIndex *index);
 
 /* Private API */
 static void hashindex_free(HashIndex *index);
@@ -144,6 +254,7 @@ hashindex_free_buckets(HashIndex *index)
 #ifndef BORG_NO_PYTHON
     if(index->buckets_buffer.buf) {
         PyBuffer_Release(&index->buckets_buffer);
+        index->buckets_buffer.buf = NULL;
     } else
 #endif
     {
@@ -151,51 +262,148 @@ hashindex_free_buckets(HashIndex *index)
     }
 }
 
-static int
+static int64_t
 hashindex_index(HashIndex *index, const unsigned char *key)
 {
+    if(index->num_buckets > UINT32_MAX) {
+        /* 32 bits of the key are not enough to reach all buckets, tables this big use 64 bits */
+        return (int64_t)(_le64toh(*((uint64_t *)key)) % (uint64_t)index->num_buckets);
+    }
     return _le32toh(*((uint32_t *)key)) % index->num_buckets;
 }
 
-static int
-hashindex_lookup(HashIndex *index, const unsigned char *key, int *start_idx)
+static inline uint8_t
+hashindex_tag(HashIndex *index, const unsigned char *key)
+{
+    /* the last key byte is independent of the first 32 (or 64) bits hashindex_index uses */
+    return key[index->key_size - 1] & 0x7f;
+}
+
+static inline void
+hashindex_prefetch(HashIndex *index, const unsigned char *key)
+{
+    /* start loading the memory a lookup of key will look at first, so that looking up a batch of keys
+     * can overlap the cache misses of the next keys with the lookup of the current one. */
+    int64_t idx;
+    if(!index->num_buckets)
+        return;
+    idx = hashindex_index(index, key);
+    if(index->ctrl)
+        PREFETCH(index->ctrl + idx);
+    PREFETCH(BUCKET_ADDR(index, idx));
+}
+
+static uint8_t *
+hashindex_alloc_ctrl(int64_t num_buckets)
+{
+    /* padding, so a group load never reads beyond the allocation */
+    uint8_t *ctrl = malloc((size_t)num_buckets + GROUP_WIDTH);
+    if(ctrl)
+        memset(ctrl, CTRL_EMPTY, (size_t)num_buckets + GROUP_WIDTH);
+    return ctrl;
+}
+
+static void
+hashindex_build_ctrl(HashIndex *index)
+{
+    /* derive the control bytes from the in-band markers, e.g. for buckets read from disk */
+    int64_t i;
+    for(i = 0; i < index->num_buckets; i++) {
+        if(BUCKET_MARKER(index, i) == EMPTY)
+            index->ctrl[i] = CTRL_EMPTY;
+        else if(BUCKET_MARKER(index, i) == DELETED)
+            index->ctrl[i] = CTRL_DELETED;
+        else
+            index->ctrl[i] = hashindex_tag(index, BUCKET_ADDR(index, i));
+    }
+}
+
+static int64_t
+hashindex_lookup_mapped(HashIndex *index, const unsigned char *key)
 {
-    int didx = -1;
-    int start = hashindex_index(index, key);  /* perfect index for this key, if there is no collision. */
-    int idx = start;
+    /* lookup in a memory mapped index which has no control bytes (yet), only used for reading.
+     * this looks at the in-band markers, as the file may still have tombstones from older versions. */
+    int64_t start = hashindex_index(index, key);
+    int64_t idx = start;
+    uint32_t marker;
     for(;;) {
-        if(BUCKET_IS_EMPTY(index, idx))
-        {
-            break;  /* if we encounter an empty bucket, we do not need to look any further. */
+        marker = BUCKET_MARKER(index, idx);
+        if(marker == EMPTY)
+            return -1;
+        if(marker != DELETED && BUCKET_MATCHES_KEY(index, idx, key))
+            return idx;
+        idx++;
+        if (idx >= index->num_buckets) {
+            idx = 0;
         }
-        if(BUCKET_IS_DELETED(index, idx)) {
-            if(didx == -1) {
-                didx = idx;  /* remember the index of the first deleted bucket. */
+        if(idx == start)
+            return -1;
+    }
+}
+
+static int64_t
+hashindex_lookup(HashIndex *index, const unsigned char *key, int64_t *start_idx)
+{
+    int64_t didx = -1;
+    int64_t start = hashindex_index(index, key);  /* perfect index for this key, if there is no collision. */
+    int64_t idx = start;
+    int64_t scanned = 0;  /* number of buckets we have looked at, == num_buckets after a full pass. */
+    uint8_t tag = hashindex_tag(index, key);
+    uint32_t match, empty, deleted, before_empty;
+    if(!index->ctrl) {
+        assert(start_idx == NULL);  /* callers inserting a key made the index writable before */
+        return hashindex_lookup_mapped(index, key);
+    }
+    for(;;) {
+        if(idx + GROUP_WIDTH <= index->num_buckets && scanned + GROUP_WIDTH <= index->num_buckets) {
+            /* look at a whole group of buckets, up to the first empty one, at once */
+            ctrl_group_match(index->ctrl + idx, tag, &match, &empty, &deleted);
+            before_empty = empty ? (empty & -empty) - 1 : 0xffff;
+            match &= before_empty;
+            deleted &= before_empty;
+            while(match) {
+                int i = ctz32(match);
+                if(BUCKET_MATCHES_KEY(index, idx + i, key)) {
+                    return idx + i;
+                }
+                match &= match - 1;
             }
+            if(didx == -1 && deleted) {
+                didx = idx + ctz32(deleted);  /* remember the index of the first deleted bucket. */
+            }
+            if(empty) {
+                idx += ctz32(empty);
+                break;  /* if we encounter an empty bucket, we do not need to look any further. */
+            }
+            idx += GROUP_WIDTH;
+            scanned += GROUP_WIDTH;
         }
-        else if(BUCKET_MATCHES_KEY(index, idx, key)) {
-            /* we found the bucket with the key we are looking for! */
-            if (didx != -1) {
-                // note: although lookup is logically a read-only operation,
-                // we optimize (change) the hashindex here "on the fly":
-                // swap this full bucket with a previous deleted/tombstone bucket.
-                memcpy(BUCKET_ADDR(index, didx), BUCKET_ADDR(index, idx), index->bucket_size);
-                BUCKET_MARK_DELETED(index, idx);
-                idx = didx;
+        else {
+            if(BUCKET_IS_EMPTY(index, idx))
+            {
+                break;  /* if we encounter an empty bucket, we do not need to look any further. */
             }
-            return idx;
+            if(BUCKET_IS_DELETED(index, idx)) {
+                if(didx == -1) {
+                    didx = idx;  /* remember the index of the first deleted bucket. */
+                }
+            }
+            else if(index->ctrl[idx] == tag && BUCKET_MATCHES_KEY(index, idx, key)) {
+                return idx;
+            }
+            idx++;
+            scanned++;
         }
-        idx++;
         if (idx >= index->num_buckets) {  /* triggers at == already */
             idx = 0;
         }
-        /* When idx == start, we have done a full pass over all buckets.
+        /* When scanned == num_buckets, we have done a full pass over all buckets.
          * - We did not find a bucket with the key we searched for.
          * - We did not find an empty bucket either.
          * - We may have found a deleted/tombstone bucket, though.
          * This can easily happen if we have a compact hashtable.
          */
-        if(idx == start) {
+        if(scanned >= index->num_buckets) {
             if(didx != -1)
                 break;  /* we have found a deleted/tombstone bucket at least */
             return -2;  /* HT is completely full, no empty or deleted buckets. */
@@ -212,17 +420,50 @@ hashindex_lookup(HashIndex *index, const unsigned char *key, int *start_idx)
     return -1;
 }
 
+static int64_t
+hashindex_next_idx(HashIndex *index, int64_t idx)
+{
+    /* return the index of the first used bucket at or after idx, -1 if there is none. */
+    if(!index->ctrl) {
+        for(; idx < index->num_buckets; idx++) {
+            if(BUCKET_MARKER(index, idx) != EMPTY && BUCKET_MARKER(index, idx) != DELETED) {
+                return idx;
+            }
+        }
+        return -1;
+    }
+    while(idx < index->num_buckets) {
+        if(idx + GROUP_WIDTH <= index->num_buckets) {
+            uint32_t used = ctrl_group_used(index->ctrl + idx);
+            if(used) {
+                return idx + ctz32(used);
+            }
+            idx += GROUP_WIDTH;
+        }
+        else {
+            if(!BUCKET_IS_EMPTY_OR_DELETED(index, idx)) {
+                return idx;
+            }
+            idx++;
+        }
+    }
+    return -1;
+}
+
 static int
-hashindex_resize(HashIndex *index, int capacity)
+hashindex_resize(HashIndex *index, int64_t capacity)
 {
+    /* rebuild this table (not including an old one, while an incremental resize is in progress) */
     HashIndex *new;
-    unsigned char *key = NULL;
+    unsigned char *key;
+    int64_t idx = 0;
     int32_t key_size = index->key_size;
 
     if(!(new = hashindex_init(capacity, key_size, index->value_size))) {
         return 0;
     }
-    while((key = hashindex_next_key(index, key))) {
+    while((idx = hashindex_next_idx(index, idx)) >= 0) {
+        key = BUCKET_ADDR(index, idx++);
         if(!hashindex_set(new, key, key + key_size)) {
             /* This can only happen if there's a bug in the code calculating capacity */
             hashindex_free(new);
@@ -232,7 +473,9 @@ hashindex_resize(HashIndex *index, int capacity)
     assert(index->num_entries == new->num_entries);
 
     hashindex_free_buckets(index);
+    free(index->ctrl);
     index->buckets = new->buckets;
+    index->ctrl = new->ctrl;
     index->num_buckets = new->num_buckets;
     index->num_empty = index->num_buckets - index->num_entries;
     index->lower_limit = new->lower_limit;
@@ -242,40 +485,131 @@ hashindex_resize(HashIndex *index, int capacity)
     return 1;
 }
 
-int get_lower_limit(int num_buckets){
-    int min_buckets = hash_sizes[0];
+/* Incremental resize: instead of rehashing all buckets at once, this table becomes the old one and
+ * a new, empty table takes its place. Every modification then moves migrate_step buckets of the
+ * old table over (see hashindex_migrate), which is chosen so that the old table is empty before the
+ * new one is full. Lookups look into both tables. hashindex_get itself does not migrate, so that
+ * lookups and iterations (which may be mixed) can rely on entries staying where they are, but the
+ * lookups of the Python API do (see hashindex_migrate_lookups), and iterating there first finishes
+ * the resize. So the old table is freed after a bounded number of operations, also if the index is
+ * only looked up after growing.
+ * Note: the memory peak is the same as for a resize all at once, both tables exist meanwhile.
+ */
+static int
+hashindex_resize_start(HashIndex *index, int64_t capacity)
+{
+    HashIndex *new, *old;
+    int64_t headroom;
+
+    assert(!index->old);
+    if(!(new = hashindex_init(capacity, index->key_size, index->value_size))) {
+        return 0;
+    }
+    if(!(old = malloc(sizeof(HashIndex)))) {
+        EPRINTF("malloc header failed");
+        hashindex_free(new);
+        return 0;
+    }
+    *old = *index;  /* takes over the buckets (and the Python buffer backing them) */
+    *index = *new;
+    free(new);
+    index->old = old;
+    index->migrate_pos = 0;
+    headroom = MAX(index->upper_limit - old->num_entries, 1);
+    index->migrate_step = MAX(HASH_MIGRATE_MIN_STEP, old->num_buckets / headroom + 1);
+    return 1;
+}
+
+static int
+hashindex_migrate(HashIndex *index, int64_t count)
+{
+    /* move the entries of up to count buckets of the old table to this one */
+    HashIndex *old = index->old;
+    unsigned char *key;
+    int64_t end = count >= old->num_buckets - index->migrate_pos ? old->num_buckets : index->migrate_pos + count;
+    int ok = 1;
+
+    /* detach the old table meanwhile, so hashindex_set just inserts into this one. note: a key is only
+     * in one of both tables at any time, so it can not be in this table yet. */
+    index->old = NULL;
+    for(; index->migrate_pos < end && ok; index->migrate_pos++) {
+        if(!BUCKET_IS_EMPTY_OR_DELETED(old, index->migrate_pos)) {
+            key = BUCKET_ADDR(old, index->migrate_pos);
+            ok = hashindex_set(index, key, key + index->key_size);
+            old->num_entries -= ok;
+        }
+    }
+    if(!ok) {
+        index->migrate_pos--;
+        index->old = old;
+        return 0;
+    }
+    if(index->migrate_pos < old->num_buckets) {
+        index->old = old;
+    }
+    else {
+        hashindex_free(old);
+    }
+    return 1;
+}
+
+static int
+hashindex_migrate_all(HashIndex *index)
+{
+    return !index->old || hashindex_migrate(index, index->old->num_buckets);
+}
+
+static int
+hashindex_migrate_lookups(HashIndex *index, int64_t lookups)
+{
+    /* move the buckets of an incremental resize along with <lookups> lookups, as much as modifications do */
+    if(!index->old)
+        return 1;
+    return hashindex_migrate(index, MIN(lookups, index->old->num_buckets) * index->migrate_step);
+}
+
+static int64_t
+hashindex_lookup_old(HashIndex *index, const unsigned char *key)
+{
+    /* find key in the old table, if it was not moved from there yet. */
+    int64_t idx = hashindex_lookup(index->old, key, NULL);
+    return idx >= index->migrate_pos ? idx : -1;
+}
+
+int64_t get_lower_limit(int64_t num_buckets){
+    int64_t min_buckets = hash_sizes[0];
     if (num_buckets <= min_buckets)
         return 0;
-    return (int)(num_buckets * HASH_MIN_LOAD);
+    return (int64_t)(num_buckets * HASH_MIN_LOAD);
 }
 
-int get_upper_limit(int num_buckets){
-    int max_buckets = hash_sizes[NELEMS(hash_sizes) - 1];
+int64_t get_upper_limit(int64_t num_buckets){
+    int64_t max_buckets = hash_sizes[NELEMS(hash_sizes) - 1];
     if (num_buckets >= max_buckets)
         return num_buckets;
-    return (int)(num_buckets * HASH_MAX_LOAD);
+    return (int64_t)(num_buckets * HASH_MAX_LOAD);
 }
 
-int get_min_empty(int num_buckets){
+int64_t get_min_empty(int64_t num_buckets){
     /* Differently from load, the effective load also considers tombstones (deleted buckets).
      * We always add 1, so this never can return 0 (0 empty buckets would be a bad HT state).
      */
-    return 1 + (int)(num_buckets * (1.0 - HASH_MAX_EFF_LOAD));
+    return 1 + (int64_t)(num_buckets * (1.0 - HASH_MAX_EFF_LOAD));
 }
 
-int size_idx(int size){
+int size_idx(int64_t size){
     /* find the smallest hash_sizes index with entry >= size */
     int i = NELEMS(hash_sizes) - 1;
     while(i >= 0 && hash_sizes[i] >= size) i--;
     return i + 1;
 }
 
-int fit_size(int current){
+int64_t fit_size(int64_t current){
     int i = size_idx(current);
     return hash_sizes[i];
 }
 
-int grow_size(int current){
+int64_t grow_size(int64_t current){
     int i = size_idx(current) + 1;
     int elems = NELEMS(hash_sizes);
     if (i >= elems)
@@ -283,19 +617,19 @@ int grow_size(int current){
     return hash_sizes[i];
 }
 
-int shrink_size(int current){
+int64_t shrink_size(int64_t current){
     int i = size_idx(current) - 1;
     if (i < 0)
         return hash_sizes[0];
     return hash_sizes[i];
 }
 
-int
+int64_t
 count_empty(HashIndex *index)
 {   /* count empty (never used) buckets. this does NOT include deleted buckets (tombstones). */
-    int i, count = 0, capacity = index->num_buckets;
+    int64_t i, count = 0, capacity = index->num_buckets;
     for(i = 0; i < capacity; i++) {
-        if(BUCKET_IS_EMPTY(index, i))
+        if(BUCKET_MARKER(index, i) == EMPTY)
             count++;
     }
     return count;
@@ -408,12 +742,23 @@ fail:
 HashIndex *
 read_hashheader(PyObject *file_py)
 {
-    Py_ssize_t bytes_read, length, buckets_length;
+    Py_ssize_t bytes_read, start, length, buckets_length;
     Py_buffer header_buffer;
     PyObject *header_bytes, *length_object, *tmp;
     HashIndex *index = NULL;
     HashHeader *header;
 
+    /* the index is usually the whole file, but it may also be the end of a file (like in the files cache) */
+    length_object = PyObject_CallMethod(file_py, "tell", NULL);
+    if(!length_object) {
+        goto fail;
+    }
+    start = PyNumber_AsSsize_t(length_object, PyExc_OverflowError);
+    Py_DECREF(length_object);
+    if(PyErr_Occurred()) {
+        goto fail;
+    }
+
     header_bytes = PyObject_CallMethod(file_py, "read", "n", (Py_ssize_t)sizeof(*header));
     if(!header_bytes) {
         assert(PyErr_Occurred());
@@ -460,7 +805,7 @@ read_hashheader(PyObject *file_py)
         goto fail_decref_header;
     }
 
-    tmp = PyObject_CallMethod(file_py, "seek", "ni", (Py_ssize_t)sizeof(*header), SEEK_SET);
+    tmp = PyObject_CallMethod(file_py, "seek", "ni", start + (Py_ssize_t)sizeof(*header), SEEK_SET);
     Py_XDECREF(tmp);
     if(PyErr_Occurred()) {
         goto fail_decref_header;
@@ -483,24 +828,31 @@ read_hashheader(PyObject *file_py)
         goto fail_release_header_buffer;
     }
 
-    buckets_length = (Py_ssize_t)_le32toh(header->num_buckets) *
-                         (_le32toh(header->key_size) + _le32toh(header->value_size));
-    if ((Py_ssize_t)length != (Py_ssize_t)sizeof(*header) + buckets_length) {
-        PyErr_Format(PyExc_ValueError, "Incorrect file length (expected %zd, got %zd)",
-                     sizeof(*header) + buckets_length, length);
+    int header_version = _le32toh(header->version);
+    if (header_version == 2) {
+        index->num_entries = (int32_t)_le32toh(header->num_entries);
+        index->num_buckets = (int32_t)_le32toh(header->num_buckets);
+        index->num_empty = (int32_t)_le32toh(header->num_empty);
+    } else if (header_version == 3) {
+        index->num_entries = (int64_t)_le64toh(header->num_entries64);
+        index->num_buckets = (int64_t)_le64toh(header->num_buckets64);
+        index->num_empty = (int64_t)_le64toh(header->num_empty64);
+    } else {
+        PyErr_Format(PyExc_ValueError, "Unsupported header version (expected %d or %d, got %d)",
+                     2, 3, header_version);
         goto fail_release_header_buffer;
     }
-
-    index->num_entries = _le32toh(header->num_entries);
-    index->num_buckets = _le32toh(header->num_buckets);
-    index->num_empty = _le32toh(header->num_empty);
     index->key_size = _le32toh(header->key_size);
     index->value_size = _le32toh(header->value_size);
 
-    int header_version = _le32toh(header->version);
-    if (header_version != 2) {
-        PyErr_Format(PyExc_ValueError, "Unsupported header version (expected %d, got %d)",
-                     2, header_version);
+    if (index->num_buckets < 0 || index->num_buckets > PY_SSIZE_T_MAX / (index->key_size + index->value_size)) {
+        PyErr_Format(PyExc_ValueError, "Invalid number of buckets (%lld)", (long long)index->num_buckets);
+        goto fail_release_header_buffer;
+    }
+    buckets_length = (Py_ssize_t)index->num_buckets * (index->key_size + index->value_size);
+    if ((Py_ssize_t)length != start + (Py_ssize_t)sizeof(*header) + buckets_length) {
+        PyErr_Format(PyExc_ValueError, "Incorrect file length (expected %zd, got %zd)",
+                     start + sizeof(*header) + buckets_length, length);
         goto fail_release_header_buffer;
     }
 
@@ -521,10 +873,10 @@ fail:
 
 #ifndef BORG_NO_PYTHON
 static HashIndex *
-hashindex_read(PyObject *file_py, int permit_compact, int legacy)
+hashindex_read(PyObject *file_py, int permit_compact, int legacy, int mmap)
 {
-    Py_ssize_t buckets_length, bytes_read;
-    PyObject *bucket_bytes;
+    Py_ssize_t buckets_length;
+    PyObject *bucket_bytes = NULL;
     HashIndex *index = NULL;
 
     if (legacy)
@@ -535,6 +887,9 @@ hashindex_read(PyObject *file_py, int permit_compact, int legacy)
     if (!index)
         goto fail;
 
+    index->ctrl = NULL;
+    index->old = NULL;
+    index->migrate_pos = index->migrate_step = 0;
     index->bucket_size = index->key_size + index->value_size;
     index->lower_limit = get_lower_limit(index->num_buckets);
     index->upper_limit = get_upper_limit(index->num_buckets);
@@ -547,36 +902,59 @@ hashindex_read(PyObject *file_py, int permit_compact, int legacy)
      * Note: Issuing read(buckets_length) is okay here, because buffered readers
      * will issue multiple underlying reads if necessary. This supports indices
      * >2 GB on Linux. We also compare lengths later.
+     *
+     * If mmap is requested and the file object supports it, mmap_read gives us a
+     * copy-on-write memory mapping of the buckets instead, so nothing is read yet
+     * (except for verifying the integrity), unmodified pages are shared with the page
+     * cache and other processes, and modifications never go to the file.
      */
     buckets_length = (Py_ssize_t)(index->num_buckets) * (index->key_size + index->value_size);
-    bucket_bytes = PyObject_CallMethod(file_py, "read", "n", buckets_length);
-    if(!bucket_bytes) {
-        assert(PyErr_Occurred());
-        goto fail_free_index;
-    }
-    bytes_read = PyBytes_Size(bucket_bytes);
-    if(PyErr_Occurred()) {
-        /* TypeError, not a bytes() object */
-        goto fail_decref_buckets;
+    if(mmap) {
+        bucket_bytes = PyObject_CallMethod(file_py, "mmap_read", "n", buckets_length);
+        if(!bucket_bytes) {
+            if(!PyErr_ExceptionMatches(PyExc_AttributeError)) {
+                goto fail_free_index;
+            }
+            PyErr_Clear();  /* file object without mmap support, just read it. */
+            mmap = 0;
+        }
     }
-    if(bytes_read != buckets_length) {
-        PyErr_Format(PyExc_ValueError, "Could not read buckets (expected %zd, got %zd)", buckets_length, bytes_read);
-        goto fail_decref_buckets;
+    if(!mmap) {
+        bucket_bytes = PyObject_CallMethod(file_py, "read", "n", buckets_length);
+        if(!bucket_bytes) {
+            assert(PyErr_Occurred());
+            goto fail_free_index;
+        }
     }
 
     PyObject_GetBuffer(bucket_bytes, &index->buckets_buffer, PyBUF_SIMPLE);
     if(PyErr_Occurred()) {
+        /* TypeError, not a bytes-like object */
         goto fail_decref_buckets;
     }
+    if(index->buckets_buffer.len != buckets_length) {
+        PyErr_Format(PyExc_ValueError, "Could not read buckets (expected %zd, got %zd)",
+                     buckets_length, index->buckets_buffer.len);
+        goto fail_free_buckets;
+    }
     index->buckets = index->buckets_buffer.buf;
 
+    if(!mmap) {
+        if(!(index->ctrl = hashindex_alloc_ctrl(index->num_buckets))) {
+            PyErr_NoMemory();
+            goto fail_free_buckets;
+        }
+        hashindex_build_ctrl(index);
+    }
+
     index->min_empty = get_min_empty(index->num_buckets);
     if (index->num_empty == -1)  // we read a legacy index without num_empty value
         index->num_empty = count_empty(index);
 
-    if(!permit_compact) {
-        if(index->num_empty < index->min_empty) {
-            /* too many tombstones here / not enough empty buckets, do a same-size rebuild */
+    if(!permit_compact && index->ctrl) {  /* for a mapped index, this is deferred to hashindex_writable */
+        if(index->num_empty < index->min_empty || HAS_TOMBSTONES(index)) {
+            /* purge tombstones (once, for files written by older versions) / not enough empty buckets,
+             * do a same-size rebuild */
             if(!hashindex_resize(index, index->num_buckets)) {
                 PyErr_Format(PyExc_ValueError, "Failed to rebuild table");
                 goto fail_free_buckets;
@@ -592,6 +970,7 @@ hashindex_read(PyObject *file_py, int permit_compact, int legacy)
 fail_free_buckets:
     if(PyErr_Occurred()) {
         hashindex_free_buckets(index);
+        free(index->ctrl);
     }
 fail_decref_buckets:
     Py_DECREF(bucket_bytes);
@@ -605,11 +984,46 @@ fail:
 }
 #endif
 
+/* Before the first modification of a memory mapped index, build the control bytes (and clean up
+ * tombstones, like hashindex_read does). The mapping is copy-on-write, so the buckets themselves stay
+ * where they are and only the modified pages get copied. Returns 0 on failure. */
+static int
+hashindex_writable(HashIndex *index)
+{
+    if(index->ctrl)
+        return 1;
+    if(!(index->ctrl = hashindex_alloc_ctrl(index->num_buckets))) {
+        EPRINTF("malloc control bytes failed");
+        return 0;
+    }
+    hashindex_build_ctrl(index);
+    if(index->num_empty < index->min_empty || HAS_TOMBSTONES(index)) {
+        /* tombstones / not enough empty buckets, do a same-size rebuild */
+        if(!hashindex_resize(index, index->num_buckets))
+            return 0;
+    }
+    return 1;
+}
+
+#ifndef BORG_NO_PYTHON
+/* Make sure the buckets are not backed by a Python buffer (but by memory of our own), so the index can be
+ * modified by a thread not holding the GIL. Returns 0 on failure. */
+static int
+hashindex_detach_buffer(HashIndex *index)
+{
+    if(!hashindex_writable(index) || !hashindex_migrate_all(index))
+        return 0;
+    if(index->buckets_buffer.buf)
+        return hashindex_resize(index, index->num_buckets);
+    return 1;
+}
+#endif
+
 static HashIndex *
-hashindex_init(int capacity, int key_size, int value_size)
+hashindex_init(int64_t capacity, int key_size, int value_size)
 {
     HashIndex *index;
-    int i;
+    int64_t i;
     capacity = fit_size(capacity);
 
     if(!(index = malloc(sizeof(HashIndex)))) {
@@ -621,6 +1035,12 @@ hashindex_init(int capacity, int key_size, int value_size)
         free(index);
         return NULL;
     }
+    if(!(index->ctrl = hashindex_alloc_ctrl(capacity))) {
+        EPRINTF("malloc control bytes failed");
+        free(index->buckets);
+        free(index);
+        return NULL;
+    }
     index->num_entries = 0;
     index->key_size = key_size;
     index->value_size = value_size;
@@ -630,6 +1050,8 @@ hashindex_init(int capacity, int key_size, int value_size)
     index->lower_limit = get_lower_limit(index->num_buckets);
     index->upper_limit = get_upper_limit(index->num_buckets);
     index->min_empty = get_min_empty(index->num_buckets);
+    index->old = NULL;
+    index->migrate_pos = index->migrate_step = 0;
 #ifndef BORG_NO_PYTHON
     index->buckets_buffer.buf = NULL;
 #endif
@@ -642,12 +1064,16 @@ hashindex_init(int capacity, int key_size, int value_size)
 static void
 hashindex_free(HashIndex *index)
 {
+    if(index->old) {
+        hashindex_free(index->old);
+    }
     hashindex_free_buckets(index);
+    free(index->ctrl);
     free(index);
 }
 
 int
-write_hashheader(HashIndex *index, PyObject *file_py)
+write_hashheader(HashIndex *index, PyObject *file_py, int64_t num_entries)
 {
     PyObject *length_object, *tmp;
     Py_ssize_t length;
@@ -657,13 +1083,22 @@ write_hashheader(HashIndex *index, PyObject *file_py)
     HashHeader header = {
         .magic = MAGIC,
         .version = _htole32(2),
-        .num_entries = _htole32(index->num_entries),
+        .num_entries = _htole32(num_entries),
         .num_buckets = _htole32(index->num_buckets),
         .num_empty = _htole32(index->num_empty),
         .key_size = _htole32(index->key_size),
         .value_size = _htole32(index->value_size),
         .reserved = {0}
     };
+    if(index->num_buckets > INT32_MAX) {
+        /* only tables which do not fit into version 2 get written as version 3, so that smaller ones
+         * stay readable by borg versions which do not know about version 3. */
+        header.version = _htole32(3);
+        header.num_entries = header.num_buckets = header.num_empty = 0;
+        header.num_entries64 = _htole64(num_entries);
+        header.num_buckets64 = _htole64(index->num_buckets);
+        header.num_empty64 = _htole64(index->num_empty);
+    }
 
     length_object = PyObject_CallMethod(file_py, "write", "y#", &header, (Py_ssize_t)sizeof(header));
     if(PyErr_Occurred()) {
@@ -701,11 +1136,17 @@ hashindex_write(HashIndex *index, PyObject *file_py, int legacy)
 {
     PyObject *length_object, *buckets_view;
     Py_ssize_t length;
-    Py_ssize_t buckets_length = (Py_ssize_t)index->num_buckets * index->bucket_size;
+    Py_ssize_t buckets_length;
 
     assert(!legacy);  // we do not ever write legacy hashindexes
 
-    if(!write_hashheader(index, file_py))
+    if(!hashindex_migrate_all(index)) {
+        PyErr_NoMemory();
+        return;
+    }
+    buckets_length = (Py_ssize_t)index->num_buckets * index->bucket_size;
+
+    if(!write_hashheader(index, file_py, index->num_entries))
         return;
 
     /* Note: explicitly construct view; BuildValue can convert (pointer, length) to Python objects, but copies them for doing so */
@@ -729,29 +1170,109 @@ hashindex_write(HashIndex *index, PyObject *file_py, int legacy)
         return;
     }
 }
+
+/* Write the index like hashindex_write, but pass a copy of each used bucket to transform() before writing
+ * it, so that values can be written differently from how they are kept in memory. The used buckets are
+ * visited in the same order as hashindex_next_key visits them (after hashindex_migrate_all).
+ * If transform() returns 0, the bucket is written as a tombstone instead, so the index itself is not
+ * modified; <num_entries> is the number of buckets it keeps.
+ * The buckets are copied and transformed without holding the GIL (only the writes need it), so transform()
+ * must not use the Python API and the index must not be modified by another thread meanwhile. */
+static void
+hashindex_write_transformed(HashIndex *index, PyObject *file_py,
+                            int (*transform)(void *ctx, unsigned char *bucket), void *ctx, int64_t num_entries)
+{
+    PyObject *length_object;
+    Py_ssize_t length, block_length;
+    unsigned char *block;
+    int64_t start, idx, count;
+
+    if(!hashindex_migrate_all(index)) {
+        PyErr_NoMemory();
+        return;
+    }
+    if(!write_hashheader(index, file_py, num_entries))
+        return;
+    if(!(block = malloc(WRITE_BLOCK_BUCKETS * index->bucket_size))) {
+        PyErr_NoMemory();
+        return;
+    }
+    for(start = 0; start < index->num_buckets; start += count) {
+        count = MIN(WRITE_BLOCK_BUCKETS, index->num_buckets - start);
+        block_length = (Py_ssize_t)(count * index->bucket_size);
+        Py_BEGIN_ALLOW_THREADS
+        memcpy(block, BUCKET_ADDR(index, start), block_length);
+        for(idx = start; (idx = hashindex_next_idx(index, idx)) >= 0 && idx < start + count; idx++) {
+            if(!transform(ctx, block + (idx - start) * index->bucket_size))
+                *((uint32_t *)(block + (idx - start) * index->bucket_size + index->key_size)) = DELETED;
+        }
+        Py_END_ALLOW_THREADS
+        length_object = PyObject_CallMethod(file_py, "write", "y#", block, block_length);
+        if(!length_object)
+            break;
+        length = PyNumber_AsSsize_t(length_object, PyExc_OverflowError);
+        Py_DECREF(length_object);
+        if(PyErr_Occurred())
+            break;
+        if(length != block_length) {
+            PyErr_SetString(PyExc_ValueError, "Failed to write buckets");
+            break;
+        }
+    }
+    free(block);
+}
 #endif
 
 static const unsigned char *
 hashindex_get(HashIndex *index, const unsigned char *key)
 {
-    int idx = hashindex_lookup(index, key, NULL);
+    int64_t idx = hashindex_lookup(index, key, NULL);
     if(idx < 0) {
+        if(index->old && (idx = hashindex_lookup_old(index, key)) >= 0) {
+            return BUCKET_ADDR(index->old, idx) + index->key_size;
+        }
         return NULL;
     }
     return BUCKET_ADDR(index, idx) + index->key_size;
 }
 
+static int
+hashindex_grow(HashIndex *index)
+{
+    if(!hashindex_migrate_all(index)) {
+        return 0;
+    }
+    if(index->num_buckets >= HASH_INCREMENTAL_RESIZE_MIN) {
+        return hashindex_resize_start(index, grow_size(index->num_buckets));
+    }
+    return hashindex_resize(index, grow_size(index->num_buckets));
+}
+
 static int
 hashindex_set(HashIndex *index, const unsigned char *key, const void *value)
 {
-    int start_idx;
-    int idx = hashindex_lookup(index, key, &start_idx);  /* if idx < 0: start_idx -> EMPTY or DELETED */
+    int64_t start_idx;
+    int64_t idx;
     uint8_t *ptr;
+    if(!hashindex_writable(index)) {
+        return 0;
+    }
+    if(index->old) {
+        if(!hashindex_migrate(index, index->migrate_step)) {
+            return 0;
+        }
+        if(index->old && (idx = hashindex_lookup_old(index, key)) >= 0) {
+            /* not moved yet, do that now: drop it from the old table, insert it into this one below. */
+            BUCKET_MARK_DELETED(index->old, idx);
+            index->old->num_entries--;
+        }
+    }
+    idx = hashindex_lookup(index, key, &start_idx);  /* if idx < 0: start_idx -> EMPTY or DELETED */
     if(idx < 0)
     {
-        if(index->num_entries >= index->upper_limit || idx == -2) {
+        if(hashindex_len(index) >= index->upper_limit || idx == -2) {
             /* hashtable too full or even a compact hashtable, grow/rebuild it! */
-            if(!hashindex_resize(index, grow_size(index->num_buckets))) {
+            if(!hashindex_grow(index)) {
                 return 0;
             }
             /* we have just built a fresh hashtable and removed all tombstones,
@@ -784,6 +1305,7 @@ hashindex_set(HashIndex *index, const unsigned char *key, const void *value)
         ptr = BUCKET_ADDR(index, idx);
         memcpy(ptr, key, index->key_size);
         memcpy(ptr + index->key_size, value, index->value_size);
+        index->ctrl[idx] = hashindex_tag(index, key);
         index->num_entries += 1;
     }
     else
@@ -793,16 +1315,59 @@ hashindex_set(HashIndex *index, const unsigned char *key, const void *value)
     return 1;
 }
 
+static void
+hashindex_delete_shift(HashIndex *index, int64_t idx)
+{
+    /* empty the bucket at idx without leaving a tombstone (backward-shift deletion): the following entries
+     * of the cluster move back into the hole, unless that would move them before their home bucket, so
+     * that all of them are still found by probing from their home bucket up to the first empty bucket.
+     * this keeps probe sequences as short as if the deleted entries had never been inserted. */
+    int64_t n = index->num_buckets, hole = idx, home;
+    for(;;) {
+        if(++idx >= n)
+            idx = 0;
+        if(idx == hole || BUCKET_IS_EMPTY(index, idx))
+            break;
+        home = hashindex_index(index, BUCKET_ADDR(index, idx));
+        if((idx - home + n) % n >= (idx - hole + n) % n) {
+            memcpy(BUCKET_ADDR(index, hole), BUCKET_ADDR(index, idx), index->bucket_size);
+            index->ctrl[hole] = index->ctrl[idx];
+            hole = idx;
+        }
+    }
+    BUCKET_MARK_EMPTY(index, hole);
+    index->num_empty++;
+}
+
 static int
 hashindex_delete(HashIndex *index, const unsigned char *key)
 {
-    int idx = hashindex_lookup(index, key, NULL);
+    int64_t idx;
+    if(!hashindex_writable(index)) {
+        return 0;
+    }
+    if(index->old && !hashindex_migrate(index, index->migrate_step)) {
+        return 0;
+    }
+    idx = hashindex_lookup(index, key, NULL);
     if (idx < 0) {
+        if(index->old && (idx = hashindex_lookup_old(index, key)) >= 0) {
+            /* shifting could move entries of the old table before migrate_pos, it is dropped soon anyway. */
+            BUCKET_MARK_DELETED(index->old, idx);
+            index->old->num_entries -= 1;
+            return 1;
+        }
         return -1;
     }
-    BUCKET_MARK_DELETED(index, idx);
+    if(HAS_TOMBSTONES(index)) {
+        /* shifting needs clusters to end at an empty bucket, tombstones would be skipped by probing. */
+        BUCKET_MARK_DELETED(index, idx);
+    }
+    else {
+        hashindex_delete_shift(index, idx);
+    }
     index->num_entries -= 1;
-    if(index->num_entries < index->lower_limit) {
+    if(!index->old && index->num_entries < index->lower_limit) {
         if(!hashindex_resize(index, shrink_size(index->num_buckets))) {
             return 0;
         }
@@ -813,29 +1378,88 @@ hashindex_delete(HashIndex *index, const unsigned char *key)
 static unsigned char *
 hashindex_next_key(HashIndex *index, const unsigned char *key)
 {
-    int idx = 0;
+    /* note: while an incremental resize is in progress, we iterate over this table first, then over
+     * the buckets of the old table which were not moved yet. */
+    HashIndex *table = index;
+    int64_t idx = 0;
     if(key) {
-        idx = 1 + (key - index->buckets) / index->bucket_size;
+        if(index->old && (key < index->buckets || key >= BUCKET_ADDR(index, index->num_buckets))) {
+            table = index->old;
+        }
+        idx = 1 + (key - table->buckets) / table->bucket_size;
     }
-    if (idx == index->num_buckets) {
-        return NULL;
+    idx = hashindex_next_idx(table, idx);
+    if(idx < 0 && table == index && index->old) {
+        table = index->old;
+        idx = hashindex_next_idx(table, index->migrate_pos);
     }
-    while(BUCKET_IS_EMPTY_OR_DELETED(index, idx)) {
-        idx ++;
-        if (idx == index->num_buckets) {
-            return NULL;
+    return idx < 0 ? NULL : BUCKET_ADDR(table, idx);
+}
+
+static int64_t
+hashindex_range_keys(HashIndex *table, int64_t start, int64_t end, unsigned char *out,
+                     int flags_offset, uint32_t mask, uint32_t value)
+{
+    /* copy the (matching) keys of the used buckets from start (inclusive) to end (exclusive) to out */
+    int64_t idx = start, count = 0;
+    const unsigned char *key;
+
+    while((idx = hashindex_next_idx(table, idx)) >= 0 && idx < end) {
+        key = BUCKET_ADDR(table, idx++);
+        if(flags_offset < 0 || (_le32toh(*(const uint32_t *)(key + table->key_size + flags_offset)) & mask) == value) {
+            memcpy(out + count * table->key_size, key, table->key_size);
+            count++;
         }
     }
-    return BUCKET_ADDR(index, idx);
+    return count;
+}
+
+/* Copy the keys in the part-th of parts equally sized ranges of bucket positions to out, which must have room
+ * for hashindex_part_size(index, parts) keys, and return how many were copied. Positions number the buckets
+ * of this table and then, while an incremental resize is in progress, the buckets of the old table, so the
+ * parts of an unmodified index together contain every key exactly once and can be requested independently.
+ * If flags_offset >= 0, only keys with (LE uint32 at flags_offset in the value & mask) == value are copied. */
+static int64_t
+hashindex_part_keys(HashIndex *index, int64_t part, int64_t parts, unsigned char *out,
+                    int flags_offset, uint32_t mask, uint32_t value)
+{
+    int64_t num_buckets = index->num_buckets;
+    int64_t positions = num_buckets + (index->old ? index->old->num_buckets : 0);
+    int64_t start = positions * part / parts, end = positions * (part + 1) / parts;
+    int64_t count = 0;
+
+    if(start < num_buckets) {
+        count = hashindex_range_keys(index, start, MIN(end, num_buckets), out, flags_offset, mask, value);
+    }
+    if(end > num_buckets) {
+        /* buckets of the old table before migrate_pos were already moved to this one */
+        count += hashindex_range_keys(index->old, MAX(start - num_buckets, index->migrate_pos), end - num_buckets,
+                                      out + count * index->key_size, flags_offset, mask, value);
+    }
+    return count;
+}
+
+static int64_t
+hashindex_part_size(HashIndex *index, int64_t parts)
+{
+    /* an upper limit for the number of keys in a part, see hashindex_part_keys */
+    int64_t positions = index->num_buckets + (index->old ? index->old->num_buckets : 0);
+    return positions / parts + 1;
 }
 
 /* Move all non-empty/non-deleted entries in the hash table to the beginning. This does not preserve the order, and it does not mark the previously used entries as empty or deleted. But it reduces num_buckets so that those entries will never be accessed. */
 static uint64_t
 hashindex_compact(HashIndex *index)
 {
-    int idx = index->num_buckets - 1;
-    int tail = 0;
-    uint64_t saved_size = (index->num_buckets - index->num_entries) * (uint64_t)index->bucket_size;
+    int64_t idx;
+    int64_t tail = 0;
+    uint64_t saved_size;
+
+    if(!hashindex_writable(index) || !hashindex_migrate_all(index)) {
+        return 0;
+    }
+    idx = index->num_buckets - 1;
+    saved_size = (index->num_buckets - index->num_entries) * (uint64_t)index->bucket_size;
 
     /* idx will point to the last filled spot and tail will point to the first empty or deleted spot. */
     for(;;) {
@@ -853,6 +1477,7 @@ hashindex_compact(HashIndex *index)
         }
         assert(tail < index->num_entries);
         memcpy(BUCKET_ADDR(index, tail), BUCKET_ADDR(index, idx), index->bucket_size);
+        index->ctrl[tail] = index->ctrl[idx];
         idx--;
         tail++;
     }
@@ -864,18 +1489,220 @@ hashindex_compact(HashIndex *index)
     return saved_size;
 }
 
-static int
+static int64_t
 hashindex_len(HashIndex *index)
 {
-    return index->num_entries;
+    return index->num_entries + (index->old ? index->old->num_entries : 0);
 }
 
-static int
+static int64_t
 hashindex_size(HashIndex *index)
 {
     return sizeof(HashHeader) + index->num_buckets * index->bucket_size;
 }
 
+/* Merging (ChunkIndex)
+
+hashindex_merge_many adds the entries of all sources to index, with the same result as merging
+them one source after the other: the refcounts (first value) of a key get added (saturating at
+max_refcount), the other values are taken from the last source containing the key.
+
+With threads > 1, every thread scans all the sources, but only merges the keys of its own shard
+(first key byte modulo threads) into a temporary table of its own. As the sources (usually the
+chunk indexes of similar archives) share most of their keys, the shard tables are a lot smaller
+than the sum of the sources, so merging them into index afterwards is cheap. The sources are
+only read, so they may be read-only (mmap) indexes, but none of them must be index itself.
+
+Returns 1 on success, 0 if memory allocation failed and -1 if a refcount is > max_refcount.
+*/
+
+static int
+hashindex_merge_entry(HashIndex *index, const unsigned char *key, const uint32_t *values, uint32_t max_refcount)
+{
+    uint32_t *ours;
+    uint64_t refcount;
+
+    if(_le32toh(values[0]) > max_refcount) {
+        return -1;
+    }
+    ours = (uint32_t *)hashindex_get(index, key);
+    if(!ours) {
+        return hashindex_set(index, key, values);
+    }
+    if(_le32toh(ours[0]) > max_refcount) {
+        return -1;
+    }
+    refcount = (uint64_t)_le32toh(ours[0]) + _le32toh(values[0]);
+    ours[0] = _htole32(MIN(refcount, max_refcount));
+    memcpy(ours + 1, values + 1, index->value_size - sizeof(uint32_t));
+    return 1;
+}
+
+static int
+hashindex_merge_source(HashIndex *index, HashIndex *source, int shard, int num_shards, uint32_t max_refcount)
+{
+    /* merge the keys of the given shard (all keys if num_shards is 1) */
+    unsigned char *key = NULL;
+    int rc;
+
+    while((key = hashindex_next_key(source, key))) {
+        if(num_shards > 1 && key[0] % num_shards != shard) {
+            continue;
+        }
+        rc = hashindex_merge_entry(index, key, (const uint32_t *)(key + source->key_size), max_refcount);
+        if(rc != 1) {
+            return rc;
+        }
+    }
+    return 1;
+}
+
+#if !defined(_MSC_VER)
+#define HASHINDEX_THREADS
+#include <pthread.h>
+
+typedef struct {
+    HashIndex *shard_index;
+    HashIndex **sources;
+    int num_sources, shard, num_shards;
+    uint32_t max_refcount;
+    int result;
+    pthread_t thread;
+    int started;
+} MergeJob;
+
+static void *
+hashindex_merge_job(void *arg)
+{
+    MergeJob *job = arg;
+    int i;
+
+    job->result = 1;
+    for(i = 0; i < job->num_sources && job->result == 1; i++) {
+        job->result = hashindex_merge_source(job->shard_index, job->sources[i],
+                                             job->shard, job->num_shards, job->max_refcount);
+    }
+    return NULL;
+}
+
+static int
+hashindex_merge_parallel(HashIndex *index, HashIndex **sources, int num_sources, uint32_t max_refcount, int threads)
+{
+    MergeJob *jobs;
+    int64_t capacity = 0;
+    int i, result = 1;
+
+    for(i = 0; i < num_sources; i++) {
+        capacity = MAX(capacity, hashindex_len(sources[i]) / threads);
+    }
+    jobs = calloc(threads, sizeof(MergeJob));
+    if(!jobs) {
+        EPRINTF("calloc jobs failed");
+        return 0;
+    }
+    for(i = 0; i < threads; i++) {
+        jobs[i].sources = sources;
+        jobs[i].num_sources = num_sources;
+        jobs[i].shard = i;
+        jobs[i].num_shards = threads;
+        jobs[i].max_refcount = max_refcount;
+        jobs[i].shard_index = hashindex_init(capacity, index->key_size, index->value_size);
+        if(!jobs[i].shard_index) {
+            result = 0;
+        }
+    }
+    if(result == 1) {
+#ifndef BORG_NO_PYTHON
+        Py_BEGIN_ALLOW_THREADS
+#endif
+        for(i = 0; i < threads; i++) {
+            /* if a thread can not be started, its job just runs here after the others got started */
+            jobs[i].started = pthread_create(&jobs[i].thread, NULL, hashindex_merge_job, &jobs[i]) == 0;
+        }
+        for(i = 0; i < threads; i++) {
+            if(jobs[i].started) {
+                pthread_join(jobs[i].thread, NULL);
+            } else {
+                hashindex_merge_job(&jobs[i]);
+            }
+        }
+#ifndef BORG_NO_PYTHON
+        Py_END_ALLOW_THREADS
+#endif
+        /* index itself is only modified while holding the GIL, it might use a Python buffer */
+        for(i = 0; i < threads && result == 1; i++) {
+            result = jobs[i].result;
+        }
+        for(i = 0; i < threads && result == 1; i++) {
+            result = hashindex_merge_source(index, jobs[i].shard_index, 0, 1, max_refcount);
+        }
+    }
+    for(i = 0; i < threads; i++) {
+        if(jobs[i].shard_index) {
+            hashindex_free(jobs[i].shard_index);
+        }
+    }
+    free(jobs);
+    return result;
+}
+#endif
+
+static int
+hashindex_merge_many(HashIndex *index, HashIndex **sources, int num_sources, uint32_t max_refcount, int threads)
+{
+    int i, result = 1;
+
+#ifdef HASHINDEX_THREADS
+    if(threads > 1 && num_sources > 1) {
+        return hashindex_merge_parallel(index, sources, num_sources, max_refcount, threads);
+    }
+#endif
+    for(i = 0; i < num_sources && result == 1; i++) {
+        result = hashindex_merge_source(index, sources[i], 0, 1, max_refcount);
+    }
+    return result;
+}
+
+/* Return a malloc()ed array of pointers to all keys of index (into its buckets), in ascending (memcmp) order,
+ * or NULL if memory allocation failed. The pointers are only valid as long as index is not modified. */
+static unsigned char **
+hashindex_sorted_keys(HashIndex *index)
+{
+    int64_t count = hashindex_len(index), i = 0, width, lo, mid, hi, a, b;
+    unsigned char **keys, **tmp, **swap, *key = NULL;
+
+    keys = malloc(MAX(count, 1) * sizeof(unsigned char *));
+    tmp = malloc(MAX(count, 1) * sizeof(unsigned char *));
+    if(!keys || !tmp) {
+        EPRINTF("malloc sorted keys failed");
+        free(keys);
+        free(tmp);
+        return NULL;
+    }
+    while((key = hashindex_next_key(index, key))) {
+        keys[i++] = key;
+    }
+    /* bottom-up merge sort. the keys are hashes, so memcmp is usually decided by the first byte */
+    for(width = 1; width < count; width *= 2) {
+        for(lo = 0; lo < count; lo += 2 * width) {
+            mid = MIN(lo + width, count);
+            hi = MIN(lo + 2 * width, count);
+            for(a = lo, b = mid, i = lo; i < hi; i++) {
+                if(a < mid && (b >= hi || memcmp(keys[a], keys[b], index->key_size) <= 0)) {
+                    tmp[i] = keys[a++];
+                } else {
+                    tmp[i] = keys[b++];
+                }
+            }
+        }
+        swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+    free(tmp);
+    return keys;
+}
+
 /*
  * Used by the FuseVersionsIndex.
  */
@@ -659,6 +659,8 @@ def save(self, name=None, comment=None, timestamp=None, stats=None, additional_m
         if name in self.manifest.archives:
             raise self.AlreadyExists(name)
         self.items_buffer.flush(flush=True)
+        # no files get added any more, so the cache can already write the files cache while we finish up
+        self.cache.start_commit()
         item_ptrs = archive_put_items(
             self.items_buffer.chunks, repo_objs=self.repo_objs, cache=self.cache, stats=self.stats
         )
@@ -701,6 +703,7 @@ def save(self, name=None, comment=None, timestamp=None, stats=None, additional_m
                 raise Error("%s - archive too big (issue #1473)!" % err_msg)
             else:
                 raise
+        self.cache.flush_chunks()
         while self.repository.async_response(wait=True) is not None:
             pass
         self.manifest.archives[name] = (self.id, metadata.time)
@@ -1066,6 +1069,17 @@ def chunk_decref(id, size, stats):
             else:
                 fetch_async_response(wait=False)
 
+        def chunk_decref_many(chunks, stats):
+            missing = self.cache.chunk_decref_many(chunks, stats, wait=False)
+            if missing:
+                nonlocal error
+                if forced == 0:
+                    cid = bin_to_hex(missing[0])
+                    raise ChunksIndexError(cid)
+                error = True
+            for _ in range(len(chunks) - len(missing)):
+                fetch_async_response(wait=False)
+
         error = False
         try:
             unpacker = msgpack.Unpacker(use_list=False)
@@ -1079,18 +1093,25 @@ def chunk_decref(id, size, stats):
                 _, data = self.repo_objs.parse(items_id, data, ro_type=ROBJ_ARCHIVE_STREAM)
                 unpacker.feed(data)
                 chunk_decref(items_id, 1, stats)
+                # decref the content chunks of all items in this metadata chunk in one batch
+                chunks = []
                 try:
                     for item in unpacker:
                         item = Item(internal_dict=item)
                         if "chunks" in item:
                             for chunk_id, size in item.chunks:
-                                chunk_decref(chunk_id, size, stats)
+                                if not isinstance(chunk_id, bytes) or len(chunk_id) != 32 or not isinstance(size, int):
+                                    raise TypeError("bad chunk list entry")
+                                chunks.append((chunk_id, size))
                 except (TypeError, ValueError):
                     # if items metadata spans multiple chunks and one chunk got dropped somehow,
                     # it could be that unpacker yields bad types
                     if forced == 0:
                         raise
                     error = True
+                finally:
+                    # also if the items metadata is corrupted, release the chunks of the items before that
+                    chunk_decref_many(chunks, stats)
             if progress:
                 pi.finish()
         except (msgpack.UnpackException, Repository.ObjectNotFound):
@@ -1258,6 +1279,42 @@ def cached_hash(chunk, id_hash):
     return chunk_id, data
 
 
+def cached_hash_batch(data, boundaries, key, workers=None):
+    """
+    Like cached_hash, but for a batch of chunks as yielded by Chunker.chunkify_batch.
+
+    The data chunks are hashed using a single key.id_hash_batch call. If a concurrent.futures.Executor
+    is given as *workers*, a big batch is split into parts which are hashed in parallel.
+    Return a list of (chunk_id, data) tuples.
+    """
+    data_boundaries = [boundary for boundary in boundaries if boundary[2] == CH_DATA]
+    parts = [[]]
+    if workers is not None:
+        part_size = 0
+        for boundary in data_boundaries:
+            if part_size >= PARALLEL_HASHING_MIN_SIZE:
+                parts.append([])
+                part_size = 0
+            parts[-1].append(boundary)
+            part_size += boundary[1]
+    else:
+        parts[0] = data_boundaries
+    # id_hash_batch does not hold the GIL, so we hash the first part while the workers do the others.
+    futures = [workers.submit(key.id_hash_batch, data, part) for part in parts[1:]]
+    chunk_ids = key.id_hash_batch(data, parts[0]) if parts[0] else []
+    for future in futures:
+        chunk_ids += future.result()
+    chunk_ids = iter(chunk_ids)
+    view = memoryview(data) if data is not None else None
+    result = []
+    for offset, size, allocation in boundaries:
+        if allocation == CH_DATA:
+            result.append((next(chunk_ids), view[offset : offset + size]))
+        else:
+            result.append(cached_hash(Chunk(None, size=size, allocation=allocation), key.id_hash))
+    return result
+
+
 class ChunksProcessor:
     # Processes an iterator of chunks for an Item
 
@@ -1340,6 +1397,26 @@ def chunk_processor(chunk):
                 stats.show_progress(item=item, dt=0.2)
             self.maybe_checkpoint(item)
 
+    def process_file_chunk_batches(self, item, cache, stats, show_progress, batch_iter):
+        # like process_file_chunks, but for the (data, boundaries) batches of Chunker.chunkify_batch
+        item.chunks = []
+        if self.rechunkify and "chunks_healthy" in item:
+            del item.chunks_healthy
+        for data, boundaries in batch_iter:
+            started_hashing = time.monotonic()
+            hashed = cached_hash_batch(data, boundaries, self.key, workers=cache.workers)
+            stats.hashing_time += time.monotonic() - started_hashing
+            for chunk_id, chunk_data in hashed:
+                chunk_entry = cache.add_chunk(
+                    chunk_id, {}, chunk_data, stats=stats, wait=False, ro_type=ROBJ_FILE_STREAM
+                )
+                self.cache.repository.async_response(wait=False)
+                item.chunks.append(chunk_entry)
+                self.current_volume += chunk_entry[1]
+                if show_progress:
+                    stats.show_progress(item=item, dt=0.2)
+                self.maybe_checkpoint(item)
+
 
 class FilesystemObjectProcessors:
     # When ported to threading, then this doesn't need chunker, cache, key any more.
@@ -1360,19 +1437,29 @@ def __init__(
         log_json,
         iec,
         file_status_printer=None,
+        use_mmap=False,
+        process_file_chunk_batches=None,
     ):
         self.metadata_collector = metadata_collector
         self.cache = cache
         self.key = key
         self.add_item = add_item
         self.process_file_chunks = process_file_chunks
+        self.process_file_chunk_batches = process_file_chunk_batches
         self.show_progress = show_progress
         self.print_file_status = file_status_printer or (lambda *args: None)
 
         self.hlm = HardLinkManager(id_type=tuple, info_type=(list, type(None)))  # (dev, ino) -> chunks or None
         self.stats = Statistics(output_json=log_json, iec=iec)  # threading: done by cache (including progress)
         self.cwd = os.getcwd()
-        self.chunker = get_chunker(*chunker_params, seed=key.chunk_seed, sparse=sparse)
+        self.chunker = get_chunker(
+            *chunker_params,
+            seed=key.chunk_seed,
+            sparse=sparse,
+            use_mmap=use_mmap,
+            readahead=READAHEAD_DEPTH,
+            threads=min(os.cpu_count() or 1, PARALLEL_CHUNKING_THREADS),
+        )
 
     @contextmanager
     def create_helper(self, path, st, status=None, hardlinkable=True, strip_prefix=None):
@@ -1566,17 +1653,12 @@ def process_file(self, *, path, parent_fd, name, st, cache, flags=flags_normal,
                             known, chunks = False, None
                         if chunks is not None:
                             # Make sure all ids are available
-                            for chunk in chunks:
-                                if not cache.seen_chunk(chunk.id):
-                                    # cache said it is unmodified, but we lost a chunk: process file like modified
-                                    status = "M"
-                                    break
+                            if not all(cache.seen_chunks([chunk.id for chunk in chunks])):
+                                # cache said it is unmodified, but we lost a chunk: process file like modified
+                                status = "M"
                             else:
-                                item.chunks = []
-                                for chunk in chunks:
-                                    # process one-by-one, so we will know in item.chunks how far we got
-                                    cache.chunk_incref(chunk.id, chunk.size, self.stats)
-                                    item.chunks.append(chunk)
+                                # all chunks are known, so incref can not fail half-way
+                                item.chunks = cache.chunk_incref_many(chunks, self.stats)
                                 status = "U"  # regular file, unchanged
                         else:
                             status = "M" if known else "A"  # regular file, modified or added
@@ -1585,13 +1667,22 @@ def process_file(self, *, path, parent_fd, name, st, cache, flags=flags_normal,
                         changed_while_backup = False
                         if "chunks" not in item:
                             with backup_io("read"):
-                                self.process_file_chunks(
-                                    item,
-                                    cache,
-                                    self.stats,
-                                    self.show_progress,
-                                    backup_io_iter(self.chunker.chunkify(None, fd)),
-                                )
+                                if self.process_file_chunk_batches and hasattr(self.chunker, "chunkify_batch"):
+                                    self.process_file_chunk_batches(
+                                        item,
+                                        cache,
+                                        self.stats,
+                                        self.show_progress,
+                                        backup_io_iter(self.chunker.chunkify_batch(None, fd)),
+                                    )
+                                else:
+                                    self.process_file_chunks(
+                                        item,
+                                        cache,
+                                        self.stats,
+                                        self.show_progress,
+                                        backup_io_iter(self.chunker.chunkify(None, fd)),
+                                    )
                                 self.stats.chunking_time = self.chunker.chunking_time
                             if not is_win32:  # TODO for win32
                                 with backup_io("fstat2"):
@@ -1888,15 +1979,9 @@ def init_chunks(self):
         # due to hash table "resonance".
         # Since reconstruction of archive items can add some new chunks, add 10 % headroom.
         self.chunks = ChunkIndex(usable=len(self.repository) * 1.1)
-        marker = None
-        while True:
-            result = self.repository.list(limit=LIST_SCAN_LIMIT, marker=marker)
-            if not result:
-                break
-            marker = result[-1]
-            init_entry = ChunkIndexEntry(refcount=0, size=0)
-            for id_ in result:
-                self.chunks[id_] = init_entry
+        init_entry = ChunkIndexEntry(refcount=0, size=0)
+        for ids in self.repository.list_packed_many(len(self.repository) // LIST_SCAN_LIMIT + 1):
+            self.chunks.set_many(ids, init_entry)
 
     def make_key(self, repository):
         attempt = 0
@@ -2116,9 +2201,11 @@ def replacement_chunk(size):
                 del item.chunks_healthy
                 has_chunks_healthy = False
                 chunks_healthy = chunks_current
-            for chunk_current, chunk_healthy in zip(chunks_current, chunks_healthy):
+            # batched lookup, chunks are only ever added to the index below, so a present chunk stays present
+            present = self.chunks.contains_many(b"".join(chunk_id for chunk_id, _ in chunks_healthy))
+            for chunk_present, chunk_current, chunk_healthy in zip(present, chunks_current, chunks_healthy):
                 chunk_id, size = chunk_healthy
-                if chunk_id not in self.chunks:
+                if not chunk_present and chunk_id not in self.chunks:
                     # a chunk of the healthy list is missing
                     if chunk_current == chunk_healthy:
                         logger.error(
@@ -269,6 +269,7 @@ def create_inner(archive, cache, fso):
                     cache=cache,
                     key=key,
                     process_file_chunks=cp.process_file_chunks,
+                    process_file_chunk_batches=cp.process_file_chunk_batches,
                     add_item=archive.add_item,
                     chunker_params=args.chunker_params,
                     show_progress=args.progress,
@@ -276,8 +277,11 @@ def create_inner(archive, cache, fso):
                     log_json=args.log_json,
                     iec=args.iec,
                     file_status_printer=self.print_file_status,
+                    use_mmap=args.mmap,
                 )
-                create_inner(archive, cache, fso)
+                # hash and compress chunks in worker threads, while this one reads files and stores chunks (in order)
+                with cache.worker_threads(min(os.cpu_count() or 1, CREATE_WORKER_THREADS)):
+                    create_inner(archive, cache, fso)
         else:
             create_inner(None, None, None)
 
@@ -917,7 +921,14 @@ def build_parser_create(self, subparsers, common_parser, mid_common_parser):
             "--sparse",
             dest="sparse",
             action="store_true",
-            help="detect sparse holes in input (supported only by fixed chunker)",
+            help="detect sparse holes in input (supported only by fixed and buzhash chunkers)",
+        )
+        fs_group.add_argument(
+            "--mmap",
+            dest="mmap",
+            action="store_true",
+            help="mmap regular files instead of reading them (avoids copying, supported only by buzhash and "
+            "fastcdc chunkers). WARNING: borg will crash if a file gets truncated while it is read.",
         )
         fs_group.add_argument(
             "--files-cache",
@@ -2,7 +2,10 @@
 import os
 import shutil
 import stat
-from collections import namedtuple
+import threading
+from collections import deque, namedtuple
+from concurrent.futures import ThreadPoolExecutor
+from contextlib import contextmanager
 from time import perf_counter
 
 from .logger import create_logger
@@ -12,7 +15,9 @@
 files_cache_logger = create_logger("borg.debug.files_cache")
 
 from .constants import CACHE_README, FILES_CACHE_MODE_DISABLED, ROBJ_FILE_STREAM
-from .hashindex import ChunkIndex, ChunkIndexEntry, CacheSynchronizer
+from .constants import CACHE_SYNC_MERGE_BATCH, CACHE_SYNC_MERGE_THREADS, CACHE_SYNC_PARSE_THREADS
+from .constants import CREATE_WORKER_QUEUE
+from .hashindex import ChunkIndex, ChunkIndexEntry, CacheSynchronizer, FilesCacheIndex, FileCacheEntry
 from .helpers import Error
 from .helpers import get_cache_dir, get_security_dir
 from .helpers import bin_to_hex, hex_to_bin, parse_stringified_list
@@ -24,18 +29,16 @@
 from .helpers import set_ec, EXIT_WARNING
 from .helpers import safe_unlink
 from .helpers import msgpack
-from .helpers.msgpack import int_to_timestamp, timestamp_to_int
 from .item import ArchiveItem, ChunkListEntry
 from .crypto.key import PlaintextKey
 from .crypto.file_integrity import IntegrityCheckedFile, DetachedIntegrityCheckedFile, FileIntegrityError
 from .locking import Lock
 from .manifest import Manifest
 from .platform import SaveFile
+from .platformflags import is_win32
 from .remote import cache_if_remote
 from .repository import LIST_SCAN_LIMIT
 
-# note: cmtime might be either a ctime or a mtime timestamp, chunks is a list of ChunkListEntry
-FileCacheEntry = namedtuple("FileCacheEntry", "age inode size cmtime chunks")
 
 
 class SecurityManager:
@@ -475,6 +478,7 @@ def __init__(self, cache_mode):
         self.cache_mode = cache_mode
         self.files = None
         self._newest_cmtime = None
+        self._files_cache_writer = None
 
     def files_cache_name(self):
         suffix = os.environ.get("BORG_FILES_CACHE_SUFFIX", "")
@@ -485,7 +489,19 @@ def discover_files_cache_name(self, path):
             fn for fn in os.listdir(path) if fn == self.FILES_CACHE_NAME or fn.startswith(self.FILES_CACHE_NAME + ".")
         ][0]
 
+    def _unlink_files_cache(self, path):
+        # the files cache file is memory mapped while we use it (see FilesCacheIndex.read), so it
+        # must not be overwritten in place, but replaced by a new file. Windows does not permit
+        # removing a mapped file, so there the index stops using the mapping first.
+        if is_win32 and self.files is not None and path == self.path:
+            self.files.detach()
+        try:
+            os.unlink(os.path.join(path, self.files_cache_name()))
+        except FileNotFoundError:
+            pass
+
     def _create_empty_files_cache(self, path):
+        self._unlink_files_cache(path)
         with IntegrityCheckedFile(path=os.path.join(path, self.files_cache_name()), write=True) as fd:
             pass  # empty file
         return fd.integrity_data
@@ -494,7 +510,7 @@ def _read_files_cache(self):
         if "d" in self.cache_mode:  # d(isabled)
             return
 
-        self.files = {}
+        self.files = FilesCacheIndex()
         logger.debug("Reading files cache ...")
         files_cache_logger.debug("FILES-CACHE-LOAD: starting...")
         msg = None
@@ -504,20 +520,11 @@ def _read_files_cache(self):
                 write=False,
                 integrity_data=self.cache_config.integrity.get(self.files_cache_name()),
             ) as fd:
-                u = msgpack.Unpacker(use_list=True)
-                while True:
-                    data = fd.read(64 * 1024)
-                    if not data:
-                        break
-                    u.feed(data)
-                    try:
-                        for path_hash, item in u:
-                            entry = FileCacheEntry(*item)
-                            # in the end, this takes about 240 Bytes per file
-                            self.files[path_hash] = msgpack.packb(entry._replace(age=entry.age + 1))
-                    except (TypeError, ValueError) as exc:
-                        msg = "The files cache seems invalid. [%s]" % str(exc)
-                        break
+                try:
+                    # this is memory mapped, so it only takes memory for the parts that are used (or modified)
+                    self.files = FilesCacheIndex.read(fd)
+                except ValueError as exc:
+                    msg = "The files cache seems invalid. [%s]" % str(exc)
         except OSError as exc:
             msg = "The files cache can't be read. [%s]" % str(exc)
         except FileIntegrityError as fie:
@@ -525,7 +532,7 @@ def _read_files_cache(self):
         if msg is not None:
             logger.warning(msg)
             logger.warning("Continuing without files cache - expect lower performance.")
-            self.files = {}
+            self.files = FilesCacheIndex()
         files_cache_logger.debug("FILES-CACHE-LOAD: finished, %d entries loaded.", len(self.files))
 
     def _write_files_cache(self):
@@ -534,21 +541,12 @@ def _write_files_cache(self):
             self._newest_cmtime = 2**63 - 1  # nanoseconds, good until y2262
         ttl = int(os.environ.get("BORG_FILES_CACHE_TTL", 20))
         files_cache_logger.debug("FILES-CACHE-SAVE: starting...")
+        self._unlink_files_cache(self.path)
         with IntegrityCheckedFile(path=os.path.join(self.path, self.files_cache_name()), write=True) as fd:
-            entry_count = 0
-            for path_hash, item in self.files.items():
-                # Only keep files seen in this backup that are older than newest cmtime seen in this backup -
-                # this is to avoid issues with filesystem snapshots and cmtime granularity.
-                # Also keep files from older backups that have not reached BORG_FILES_CACHE_TTL yet.
-                entry = FileCacheEntry(*msgpack.unpackb(item))
-                if (
-                    entry.age == 0
-                    and timestamp_to_int(entry.cmtime) < self._newest_cmtime
-                    or entry.age > 0
-                    and entry.age < ttl
-                ):
-                    msgpack.pack((path_hash, entry), fd)
-                    entry_count += 1
+            # Only keep files seen in this backup that are older than newest cmtime seen in this backup -
+            # this is to avoid issues with filesystem snapshots and cmtime granularity.
+            # Also keep files from older backups that have not reached BORG_FILES_CACHE_TTL yet.
+            entry_count = self.files.write(fd, ttl=ttl, newest_cmtime=self._newest_cmtime)
         files_cache_logger.debug("FILES-CACHE-KILL: removed all old entries with age >= TTL [%d]", ttl)
         files_cache_logger.debug(
             "FILES-CACHE-KILL: removed all current entries with newest cmtime %d", self._newest_cmtime
@@ -556,6 +554,46 @@ def _write_files_cache(self):
         files_cache_logger.debug("FILES-CACHE-SAVE: finished, %d remaining entries saved.", entry_count)
         return fd.integrity_data
 
+    def _start_files_cache_write(self):
+        """Start writing the files cache in a background thread, see _finish_files_cache_write."""
+        if self.files is None or self._files_cache_writer is not None:
+            return
+        result = {}
+
+        def write():
+            try:
+                result["integrity_data"] = self._write_files_cache()
+            except BaseException as exc:
+                result["exception"] = exc
+
+        thread = threading.Thread(target=write, name="files-cache-writer")
+        thread.start()
+        self._files_cache_writer = thread, result
+
+    def _finish_files_cache_write(self, check=True):
+        """
+        Wait until the files cache is written, return its integrity data (None if no writer was started).
+
+        If *check* is True, an exception raised by the writer is raised here.
+        """
+        if self._files_cache_writer is None:
+            return None
+        thread, result = self._files_cache_writer
+        thread.join()
+        self._files_cache_writer = None
+        if check and "exception" in result:
+            raise result["exception"]
+        return result.get("integrity_data")
+
+    def start_commit(self):
+        """
+        Start the parts of commit() that can run in the background while the caller finishes its work.
+
+        The files cache must not be modified any more after this.
+        """
+        if self._txn_active:
+            self._start_files_cache_write()
+
     def file_known_and_unchanged(self, hashed_path, path_hash, st):
         """
         Check if we know the file that has this path_hash (know == it is in our files cache) and
@@ -584,17 +622,16 @@ def file_known_and_unchanged(self, hashed_path, path_hash, st):
             files_cache_logger.debug("UNKNOWN: no file metadata in cache for: %r", hashed_path)
             return False, None
         # we know the file!
-        entry = FileCacheEntry(*msgpack.unpackb(entry))
         if "s" in cache_mode and entry.size != st.st_size:
             files_cache_logger.debug("KNOWN-CHANGED: file size has changed: %r", hashed_path)
             return True, None
         if "i" in cache_mode and entry.inode != st.st_ino:
             files_cache_logger.debug("KNOWN-CHANGED: file inode number has changed: %r", hashed_path)
             return True, None
-        if "c" in cache_mode and timestamp_to_int(entry.cmtime) != st.st_ctime_ns:
+        if "c" in cache_mode and entry.cmtime != st.st_ctime_ns:
             files_cache_logger.debug("KNOWN-CHANGED: file ctime has changed: %r", hashed_path)
             return True, None
-        elif "m" in cache_mode and timestamp_to_int(entry.cmtime) != st.st_mtime_ns:
+        elif "m" in cache_mode and entry.cmtime != st.st_mtime_ns:
             files_cache_logger.debug("KNOWN-CHANGED: file mtime has changed: %r", hashed_path)
             return True, None
         # we ignored the inode number in the comparison above or it is still same.
@@ -605,7 +642,7 @@ def file_known_and_unchanged(self, hashed_path, path_hash, st):
         # number comparison in a future backup run (and avoid chunking everything
         # again at that time), we need to update the inode number in the cache with what
         # we see in the filesystem.
-        self.files[path_hash] = msgpack.packb(entry._replace(inode=st.st_ino, age=0))
+        self.files.refresh(path_hash, st.st_ino)
         chunks = [ChunkListEntry(*chunk) for chunk in entry.chunks]  # convert to list of namedtuple
         return True, chunks
 
@@ -626,10 +663,8 @@ def memorize_file(self, hashed_path, path_hash, st, chunks):
         else:  # neither 'c' nor 'm' in cache_mode, avoid UnboundLocalError
             cmtime_type = "ctime"
             cmtime_ns = safe_ns(st.st_ctime_ns)
-        entry = FileCacheEntry(
-            age=0, inode=st.st_ino, size=st.st_size, cmtime=int_to_timestamp(cmtime_ns), chunks=chunks
-        )
-        self.files[path_hash] = msgpack.packb(entry)
+        entry = FileCacheEntry(age=0, inode=st.st_ino, size=st.st_size, cmtime=cmtime_ns, chunks=chunks)
+        self.files[path_hash] = entry
         self._newest_cmtime = max(self._newest_cmtime or 0, cmtime_ns)
         files_cache_logger.debug(
             "FILES-CACHE-UPDATE: put %r [has %s] <- %r",
@@ -644,6 +679,58 @@ class ChunksMixin:
     Chunks index related code for misc. Cache implementations.
     """
 
+    workers = None  # see worker_threads
+
+    @contextmanager
+    def worker_threads(self, threads):
+        """
+        Use *threads* worker threads while in this context: new chunks added with add_chunk(..., wait=False)
+        get compressed by them, while the caller continues. The chunks are then encrypted and stored in
+        the order they were added, by later add_chunk calls or by flush_chunks.
+
+        The caller can also use the thread pool (a concurrent.futures.Executor) in .workers for its own jobs.
+        """
+        if threads <= 1:
+            yield
+            return
+        self.workers = ThreadPoolExecutor(max_workers=threads, thread_name_prefix="chunk-worker")
+        self._pending_chunks = deque()  # (id, size, ro_type, future giving (meta, compressed data))
+        self._max_pending_chunks = threads * CREATE_WORKER_QUEUE
+        try:
+            yield
+        finally:
+            # usually everything got stored by Archive.save, if not, we are aborting and do not store the rest.
+            self.workers.shutdown(cancel_futures=True)
+            self.workers = None
+            del self._pending_chunks
+
+    def _store_pending_chunks(self, max_pending):
+        # store the compressed chunks in order, waiting for the workers while more than max_pending are left.
+        pending = self._pending_chunks
+        while pending and (len(pending) > max_pending or pending[0][3].done()):
+            id, size, ro_type, future = pending.popleft()
+            meta, data = future.result()
+            try:
+                cdata = self.repo_objs.format(
+                    id,
+                    meta,
+                    data,
+                    compress=False,
+                    size=size,
+                    ctype=meta["ctype"],
+                    clevel=meta["clevel"],
+                    ro_type=ro_type,
+                )
+                self.repository.put(id, cdata, wait=False)
+            except OSError as err:
+                # we are called while processing some other file, this must not look like an error reading that one.
+                raise Error(f"Storing chunk {bin_to_hex(id)} failed: {err}") from err
+
+    def flush_chunks(self):
+        """Store all chunks which are still being processed by the worker threads, see worker_threads."""
+        if self.workers is not None:
+            self._store_pending_chunks(0)
+
     def chunk_incref(self, id, size, stats):
         assert isinstance(size, int) and size > 0
         if not self._txn_active:
@@ -656,6 +743,7 @@ def chunk_decref(self, id, size, stats, wait=True):
         assert isinstance(size, int) and size > 0
         if not self._txn_active:
             self.begin_txn()
+        self.flush_chunks()  # the chunk might still be pending, we must not delete it before it gets stored
         count, _size = self.chunks.decref(id)
         if count == 0:
             del self.chunks[id]
@@ -664,10 +752,61 @@ def chunk_decref(self, id, size, stats, wait=True):
         else:
             stats.update(-size, False)
 
+    def chunk_incref_many(self, chunks, stats):
+        """
+        Increase the refcount of all *chunks* (ChunkListEntry-like), which must all be in the chunks index.
+
+        Same as calling chunk_incref for each of them, but uses a batched (prefetching) index lookup.
+        Returns the list of ChunkListEntry.
+        """
+        if not self._txn_active:
+            self.begin_txn()
+        results = self.chunks.incref_many(b"".join(id for id, _ in chunks))
+        entries = []
+        for (id, size), result in zip(chunks, results):
+            assert isinstance(size, int) and size > 0
+            if result is None:
+                raise KeyError(id)
+            stats.update(size, False)
+            entries.append(ChunkListEntry(id, size))
+        return entries
+
+    def chunk_decref_many(self, chunks, stats, wait=True):
+        """
+        Decrease the refcount of all *chunks* (id, size), deleting chunks which are not referenced any more.
+
+        Same as calling chunk_decref for each of them, but uses a batched (prefetching) index lookup.
+        Chunks which are not in the chunks index are skipped, their ids are returned as a list.
+        """
+        if not self._txn_active:
+            self.begin_txn()
+        self.flush_chunks()
+        results = self.chunks.decref_many(b"".join(id for id, _ in chunks))
+        missing = []
+        for (id, size), result in zip(chunks, results):
+            assert isinstance(size, int) and size > 0
+            if result is None:
+                missing.append(id)
+            elif result[0] == 0:
+                del self.chunks[id]
+                self.repository.delete(id, wait=wait)
+                stats.update(-size, True)
+            else:
+                stats.update(-size, False)
+        return missing
+
+    def seen_chunks(self, ids):
+        """Return the refcount (0 if unknown) of each of the chunk *ids*, like seen_chunk without a size."""
+        if not self._txn_active:
+            self.begin_txn()
+        return [0 if entry is None else entry.refcount for entry in self.chunks.get_many(b"".join(ids))]
+
     def seen_chunk(self, id, size=None):
         if not self._txn_active:
             self.begin_txn()
-        entry = self.chunks.get(id, ChunkIndexEntry(0, None))
+        entry = self.chunks.get(id)
+        if entry is None:
+            return 0  # a new chunk, the common case when backing up new data
         if entry.refcount and size is not None:
             assert isinstance(entry.size, int)
             if entry.size:
@@ -709,6 +848,15 @@ def add_chunk(
         refcount = self.seen_chunk(id, size)
         if refcount:
             return self.chunk_incref(id, size, stats)
+        if self.workers is not None and not wait and compress:
+            # the caller might reuse the buffer behind data, so the worker gets a copy.
+            meta["type"] = ro_type
+            future = self.workers.submit(self.repo_objs.compressor.compress, meta, bytes(data))
+            self._pending_chunks.append((id, size, ro_type, future))
+            self.chunks.add(id, 1, size)
+            stats.update(size, True)
+            self._store_pending_chunks(self._max_pending_chunks)
+            return ChunkListEntry(id, size)
         cdata = self.repo_objs.format(
             id, meta, data, compress=compress, size=size, ctype=ctype, clevel=clevel, ro_type=ro_type
         )
@@ -727,21 +875,15 @@ def _load_chunks_from_repo(self):
             total=num_chunks, msg="Downloading chunk list... %3.0f%%", msgid="cache.download_chunks"
         )
         t0 = perf_counter()
-        num_requests = 0
-        marker = None
-        while True:
-            result = self.repository.list(limit=LIST_SCAN_LIMIT, marker=marker)
-            num_requests += 1
-            if not result:
-                break
-            pi.show(increase=len(result))
-            marker = result[-1]
-            # All chunks from the repository have a refcount of MAX_VALUE, which is sticky,
-            # therefore we can't/won't delete them. Chunks we added ourselves in this transaction
-            # (e.g. checkpoint archives) are tracked correctly.
-            init_entry = ChunkIndexEntry(refcount=ChunkIndex.MAX_VALUE, size=0)
-            for id_ in result:
-                chunks[id_] = init_entry
+        # the parts of the ID list are independent of each other, so a remote repository can pipeline the requests.
+        num_requests = num_chunks // LIST_SCAN_LIMIT + 1
+        # All chunks from the repository have a refcount of MAX_VALUE, which is sticky,
+        # therefore we can't/won't delete them. Chunks we added ourselves in this transaction
+        # (e.g. checkpoint archives) are tracked correctly.
+        init_entry = ChunkIndexEntry(refcount=ChunkIndex.MAX_VALUE, size=0)
+        for ids in self.repository.list_packed_many(num_requests):
+            pi.show(increase=len(ids) // ChunkIndex._key_size)
+            chunks.set_many(ids, init_entry)
         assert len(chunks) == num_chunks
         # LocalCache does not contain the manifest, either.
         del chunks[self.manifest.MANIFEST_ID]
@@ -752,10 +894,9 @@ def _load_chunks_from_repo(self):
             num_chunks,
             duration,
             num_requests,
-            format_file_size(num_chunks * 34 / duration),
+            format_file_size(num_chunks * 32 / duration),
         )
-        # Chunk IDs in a list are encoded in 34 bytes: 1 byte msgpack header, 1 byte length, 32 ID bytes.
-        # Protocol overhead is neglected in this calculation.
+        # Chunk IDs are transferred as packed 32 byte strings, protocol overhead is neglected in this calculation.
         return chunks
 
 
@@ -855,6 +996,7 @@ def open(self):
         self.rollback()
 
     def close(self):
+        self._finish_files_cache_write(check=False)
         if self.cache_config is not None:
             self.cache_config.close()
             self.cache_config = None
@@ -885,7 +1027,8 @@ def commit(self):
         pi = ProgressIndicatorMessage(msgid="cache.commit")
         if self.files is not None:
             pi.output("Saving files cache")
-            integrity_data = self._write_files_cache()
+            self._start_files_cache_write()  # if start_commit() did not already
+            integrity_data = self._finish_files_cache_write()
             self.cache_config.integrity[self.files_cache_name()] = integrity_data
         pi.output("Saving chunks cache")
         with IntegrityCheckedFile(path=os.path.join(self.path, "chunks"), write=True) as fd:
@@ -908,6 +1051,7 @@ def rollback(self):
         if os.path.exists(txn_dir):
             shutil.copy(os.path.join(txn_dir, "config"), self.path)
             shutil.copy(os.path.join(txn_dir, "chunks"), self.path)
+            self._unlink_files_cache(self.path)
             shutil.copy(os.path.join(txn_dir, self.discover_files_cache_name(txn_dir)), self.path)
             txn_tmp = os.path.join(self.path, "txn.tmp")
             os.replace(txn_dir, txn_tmp)
@@ -930,7 +1074,7 @@ def sync(self):
         # Instrumentation
         processed_item_metadata_bytes = 0
         processed_item_metadata_chunks = 0
-        compact_chunks_archive_saved_space = 0
+        sorted_chunks_archive_saved_space = 0
 
         def mkpath(id, suffix=""):
             id_hex = bin_to_hex(id)
@@ -941,10 +1085,13 @@ def cached_archives():
             if self.do_cache:
                 fns = os.listdir(archive_path)
                 # filenames with 64 hex digits == 256bit,
-                # or compact indices which are 64 hex digits + ".compact"
-                return {hex_to_bin(fn) for fn in fns if len(fn) == 64} | {
-                    hex_to_bin(fn[:64]) for fn in fns if len(fn) == 72 and fn.endswith(".compact")
-                }
+                # or compact indices which are 64 hex digits + ".compact",
+                # or sorted indices which are 64 hex digits + ".sorted"
+                return (
+                    {hex_to_bin(fn) for fn in fns if len(fn) == 64}
+                    | {hex_to_bin(fn[:64]) for fn in fns if len(fn) == 72 and fn.endswith(".compact")}
+                    | {hex_to_bin(fn[:64]) for fn in fns if len(fn) == 71 and fn.endswith(".sorted")}
+                )
             else:
                 return set()
 
@@ -955,21 +1102,21 @@ def cleanup_outdated(ids):
             for id in ids:
                 cleanup_cached_archive(id)
 
-        def cleanup_cached_archive(id, cleanup_compact=True):
-            try:
-                os.unlink(mkpath(id))
-                os.unlink(mkpath(id) + ".integrity")
-            except FileNotFoundError:
-                pass
-            if not cleanup_compact:
-                return
-            try:
-                os.unlink(mkpath(id, suffix=".compact"))
-                os.unlink(mkpath(id, suffix=".compact") + ".integrity")
-            except FileNotFoundError:
-                pass
+        def cleanup_cached_archive(id, cleanup_sorted=True):
+            for suffix in ("", ".compact", ".sorted") if cleanup_sorted else ("", ".compact"):
+                try:
+                    os.unlink(mkpath(id, suffix=suffix))
+                    os.unlink(mkpath(id, suffix=suffix) + ".integrity")
+                except FileNotFoundError:
+                    pass
 
         def fetch_and_build_idx(archive_id, decrypted_repository, chunk_idx):
+            """
+            Fetch the item metadata of the archive, it gets parsed into *chunk_idx* in the background.
+
+            Returns a function to call when *chunk_idx* is needed, it waits for the parser, completes
+            the index and returns it.
+            """
             nonlocal processed_item_metadata_bytes
             nonlocal processed_item_metadata_chunks
             csize, data = decrypted_repository.get(archive_id)
@@ -986,44 +1133,59 @@ def fetch_and_build_idx(archive_id, decrypted_repository, chunk_idx):
                     chunk_idx.add(chunk_id, 1, len(data))
                     ids = msgpack.unpackb(data)
                     items.extend(ids)
-            sync = CacheSynchronizer(chunk_idx)
+            sync = CacheSynchronizer(chunk_idx, threaded=True)
+            item_sizes = []  # the parser owns chunk_idx meanwhile, the items chunks get added when it is done
             for item_id, (csize, data) in zip(items, decrypted_repository.get_many(items)):
-                chunk_idx.add(item_id, 1, len(data))
+                item_sizes.append(len(data))
                 processed_item_metadata_bytes += len(data)
                 processed_item_metadata_chunks += 1
                 sync.feed(data)
-            if self.do_cache:
-                write_archive_index(archive_id, chunk_idx)
+
+            def finish():
+                sync.finish()
+                for item_id, size in zip(items, item_sizes):
+                    chunk_idx.add(item_id, 1, size)
+                if self.do_cache:
+                    write_archive_index(archive_id, chunk_idx)
+                return chunk_idx
+
+            return finish
 
         def write_archive_index(archive_id, chunk_idx):
-            nonlocal compact_chunks_archive_saved_space
-            compact_chunks_archive_saved_space += chunk_idx.compact()
-            fn = mkpath(archive_id, suffix=".compact")
+            nonlocal sorted_chunks_archive_saved_space
+            fn = mkpath(archive_id, suffix=".sorted")
             fn_tmp = mkpath(archive_id, suffix=".tmp")
             try:
                 with DetachedIntegrityCheckedFile(
-                    path=fn_tmp, write=True, filename=bin_to_hex(archive_id) + ".compact"
+                    path=fn_tmp, write=True, filename=bin_to_hex(archive_id) + ".sorted"
                 ) as fd:
-                    chunk_idx.write(fd)
+                    written = chunk_idx.write_sorted(fd)
             except Exception:
                 safe_unlink(fn_tmp)
             else:
                 os.replace(fn_tmp, fn)
+                sorted_chunks_archive_saved_space += chunk_idx.size() - written
 
         def read_archive_index(archive_id, archive_name):
+            """Return the cached archive chunk index, a ChunkIndex or the data of a sorted index (or None)."""
             archive_chunk_idx_path = mkpath(archive_id)
             logger.info("Reading cached archive chunk index for %s", archive_name)
             try:
                 try:
-                    # Attempt to load compact index first
-                    with DetachedIntegrityCheckedFile(path=archive_chunk_idx_path + ".compact", write=False) as fd:
-                        archive_chunk_idx = ChunkIndex.read(fd, permit_compact=True)
-                    # In case a non-compact index exists, delete it.
-                    cleanup_cached_archive(archive_id, cleanup_compact=False)
-                    # Compact index read - return index, no conversion necessary (below).
+                    # Attempt to load sorted index first
+                    with DetachedIntegrityCheckedFile(path=archive_chunk_idx_path + ".sorted", write=False) as fd:
+                        archive_chunk_idx = fd.read()
+                    # In case a hash table index exists, delete it.
+                    cleanup_cached_archive(archive_id, cleanup_sorted=False)
+                    # Sorted index read - return it, no conversion necessary (below).
                     return archive_chunk_idx
                 except FileNotFoundError:
-                    # No compact index found, load non-compact index, and convert below.
+                    pass
+                try:
+                    # No sorted index found, load compact index (or non-compact index), and convert below.
+                    with DetachedIntegrityCheckedFile(path=archive_chunk_idx_path + ".compact", write=False) as fd:
+                        archive_chunk_idx = ChunkIndex.read(fd, permit_compact=True, mmap=True)
+                except FileNotFoundError:
                     with DetachedIntegrityCheckedFile(path=archive_chunk_idx_path, write=False) as fd:
                         archive_chunk_idx = ChunkIndex.read(fd)
             except FileIntegrityError as fie:
@@ -1033,8 +1195,8 @@ def read_archive_index(archive_id, archive_name):
                 set_ec(EXIT_WARNING)
                 return None
 
-            # Convert to compact index. Delete the existing index first.
-            logger.debug("Found non-compact index for %s, converting to compact.", archive_name)
+            # Convert to sorted index. Delete the existing index first.
+            logger.debug("Found hash table index for %s, converting to sorted.", archive_name)
             cleanup_cached_archive(archive_id)
             write_archive_index(archive_id, archive_chunk_idx)
             return archive_chunk_idx
@@ -1051,6 +1213,24 @@ def get_archive_ids_to_names(archive_ids):
             assert len(archive_names) == len(archive_ids)
             return archive_names
 
+        def add_pending(archive_chunk_idx, chunk_idx, pending_idxs, pending_sorted, threads):
+            if isinstance(archive_chunk_idx, ChunkIndex):
+                pending_idxs.append(archive_chunk_idx)
+            else:
+                pending_sorted.append(archive_chunk_idx)
+            if len(pending_idxs) + len(pending_sorted) >= CACHE_SYNC_MERGE_BATCH:
+                merge_pending(chunk_idx, pending_idxs, pending_sorted, threads)
+
+        def merge_pending(chunk_idx, pending_idxs, pending_sorted, threads):
+            logger.debug(
+                "Merging %d archive indexes into master chunks index.", len(pending_idxs) + len(pending_sorted)
+            )
+            chunk_idx.merge_many(pending_idxs, threads=threads)
+            # the sorted indexes are merged by a streaming k-way merge, so every chunk id is added only once
+            chunk_idx.merge_sorted(pending_sorted)
+            pending_idxs.clear()
+            pending_sorted.clear()
+
         def create_master_idx(chunk_idx):
             logger.debug("Synchronizing chunks index...")
             cached_ids = cached_archives()
@@ -1076,9 +1256,16 @@ def create_master_idx(chunk_idx):
                     msgid="cache.sync",
                 )
                 archive_ids_to_names = get_archive_ids_to_names(archive_ids)
+                merge_threads = min(os.cpu_count() or 1, CACHE_SYNC_MERGE_THREADS)
+                pending_idxs = []  # archive chunk indexes not merged into the master index yet
+                pending_sorted = []  # same, data of sorted archive chunk indexes
+                # archive chunk indexes being built (see fetch_and_build_idx), while the next archives are fetched
+                building = []
+                parse_threads = min(os.cpu_count() or 1, CACHE_SYNC_PARSE_THREADS)
                 for archive_id, archive_name in archive_ids_to_names.items():
                     pi.show(info=[remove_surrogates(archive_name)])  # legacy. borg2 always has pure unicode arch names.
                     if self.do_cache:
+                        archive_chunk_idx = None
                         if archive_id in cached_ids:
                             archive_chunk_idx = read_archive_index(archive_id, archive_name)
                             if archive_chunk_idx is None:
@@ -1087,14 +1274,19 @@ def create_master_idx(chunk_idx):
                             # Do not make this an else branch; the FileIntegrityError exception handler
                             # above can remove *archive_id* from *cached_ids*.
                             logger.info("Fetching and building archive index for %s.", archive_name)
-                            archive_chunk_idx = ChunkIndex()
-                            fetch_and_build_idx(archive_id, decrypted_repository, archive_chunk_idx)
-                        logger.debug("Merging into master chunks index.")
-                        chunk_idx.merge(archive_chunk_idx)
+                            building.append(fetch_and_build_idx(archive_id, decrypted_repository, ChunkIndex()))
+                            if len(building) >= parse_threads:
+                                archive_chunk_idx = building.pop(0)()
+                        if archive_chunk_idx is not None:
+                            add_pending(archive_chunk_idx, chunk_idx, pending_idxs, pending_sorted, merge_threads)
                     else:
                         chunk_idx = chunk_idx or ChunkIndex(usable=master_index_capacity)
                         logger.info("Fetching archive index for %s.", archive_name)
-                        fetch_and_build_idx(archive_id, decrypted_repository, chunk_idx)
+                        fetch_and_build_idx(archive_id, decrypted_repository, chunk_idx)()
+                for finish in building:
+                    add_pending(finish(), chunk_idx, pending_idxs, pending_sorted, merge_threads)
+                if pending_idxs or pending_sorted:
+                    merge_pending(chunk_idx, pending_idxs, pending_sorted, merge_threads)
                 pi.finish()
                 logger.debug(
                     "Chunks index sync: processed %s (%d chunks) of metadata.",
@@ -1102,8 +1294,8 @@ def create_master_idx(chunk_idx):
                     processed_item_metadata_chunks,
                 )
                 logger.debug(
-                    "Chunks index sync: compact chunks.archive.d storage saved %s bytes.",
-                    format_file_size(compact_chunks_archive_saved_space),
+                    "Chunks index sync: sorted chunks.archive.d storage saved %s bytes.",
+                    format_file_size(sorted_chunks_archive_saved_space),
                 )
             logger.debug("Chunks index sync done.")
             return chunk_idx
@@ -1243,6 +1435,7 @@ def open(self):
         self.rollback()
 
     def close(self):
+        self._finish_files_cache_write(check=False)
         if self.cache_config is not None:
             self.cache_config.close()
             self.cache_config = None
@@ -1270,7 +1463,8 @@ def commit(self):
         pi = ProgressIndicatorMessage(msgid="cache.commit")
         if self.files is not None:
             pi.output("Saving files cache")
-            integrity_data = self._write_files_cache()
+            self._start_files_cache_write()  # if start_commit() did not already
+            integrity_data = self._finish_files_cache_write()
             self.cache_config.integrity[self.files_cache_name()] = integrity_data
         pi.output("Saving cache config")
         self.cache_config.save(self.manifest)
@@ -1287,6 +1481,7 @@ def rollback(self):
         txn_dir = os.path.join(self.path, "txn.active")
         if os.path.exists(txn_dir):
             shutil.copy(os.path.join(txn_dir, "config"), self.path)
+            self._unlink_files_cache(self.path)
             shutil.copy(os.path.join(txn_dir, self.discover_files_cache_name(txn_dir)), self.path)
             txn_tmp = os.path.join(self.path, "txn.tmp")
             os.replace(txn_dir, txn_tmp)
@@ -1374,6 +1569,9 @@ def file_known_and_unchanged(self, hashed_path, path_hash, st):
     def memorize_file(self, hashed_path, path_hash, st, chunks):
         pass
 
+    def start_commit(self):
+        pass
+
     def commit(self):
         if not self._txn_active:
             return
@@ -14,10 +14,34 @@
  *
  * unpack.h implements these callbacks and uses another state machine to
  * extract chunk references from it.
+ *
+ * Optionally (cache_sync_start), the parsing is done by a thread of its own, see below.
  */
 
 #include "unpack.h"
 
+#if !defined(_MSC_VER)
+#define CACHE_SYNC_THREADS
+#include <pthread.h>
+
+#define CACHE_SYNC_QUEUE_DEPTH 8
+
+typedef struct {
+    char *data;
+    uint32_t length;
+} SyncBlock;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;  /* signalled when a block gets queued or parsed, or on finish */
+    SyncBlock queue[CACHE_SYNC_QUEUE_DEPTH];
+    size_t head, count;
+    int finish;  /* no more blocks will be queued */
+    int failed;  /* parsing failed, the remaining blocks just get dropped */
+} SyncWorker;
+#endif
+
 typedef struct {
     unpack_context ctx;
 
@@ -25,6 +49,11 @@ typedef struct {
     size_t head;
     size_t tail;
     size_t size;
+
+    const char *feed_error;  /* set by cache_sync_feed itself (the parser sets ctx.user.last_error) */
+#ifdef CACHE_SYNC_THREADS
+    SyncWorker *worker;
+#endif
 } CacheSyncCtx;
 
 static CacheSyncCtx *
@@ -44,13 +73,20 @@ cache_sync_init(HashIndex *chunks)
     ctx->head = 0;
     ctx->tail = 0;
     ctx->size = 0;
+    ctx->feed_error = NULL;
+#ifdef CACHE_SYNC_THREADS
+    ctx->worker = NULL;
+#endif
 
     return ctx;
 }
 
+static int cache_sync_finish(CacheSyncCtx *ctx);
+
 static void
 cache_sync_free(CacheSyncCtx *ctx)
 {
+    cache_sync_finish(ctx);
     if(ctx->buf) {
         free(ctx->buf);
     }
@@ -60,7 +96,7 @@ cache_sync_free(CacheSyncCtx *ctx)
 static const char *
 cache_sync_error(const CacheSyncCtx *ctx)
 {
-    return ctx->ctx.user.last_error;
+    return ctx->feed_error ? ctx->feed_error : ctx->ctx.user.last_error;
 }
 
 static uint64_t
@@ -75,13 +111,8 @@ cache_sync_size_totals(const CacheSyncCtx *ctx)
     return ctx->ctx.user.totals.size;
 }
 
-/**
- * feed data to the cache synchronizer
- * 0 = abort, 1 = continue
- * abort is a regular condition, check cache_sync_error
- */
 static int
-cache_sync_feed(CacheSyncCtx *ctx, void *data, uint32_t length)
+cache_sync_parse(CacheSyncCtx *ctx, void *data, uint32_t length)
 {
     size_t new_size;
     int ret;
@@ -98,7 +129,7 @@ cache_sync_feed(CacheSyncCtx *ctx, void *data, uint32_t length)
             new_size = (ctx->tail - ctx->head) + length;
             new_buf = (char*) malloc(new_size);
             if(!new_buf) {
-                ctx->ctx.user.last_error = "cache_sync_feed: unable to allocate buffer";
+                ctx->ctx.user.last_error = "cache_sync_parse: unable to allocate buffer";
                 return 0;
             }
             if(ctx->buf) {
@@ -136,3 +167,141 @@ cache_sync_feed(CacheSyncCtx *ctx, void *data, uint32_t length)
     /* unreachable */
     return 1;
 }
+
+/* Background parsing
+
+After cache_sync_start, cache_sync_feed only appends a copy of the data to a queue (waiting while it
+is full), a thread of the synchronizer parses it. So the caller can fetch and decrypt the next item
+metadata meanwhile, and several synchronizers (each with a chunks index of its own) can parse in
+parallel. The chunks index must not be used otherwise until cache_sync_finish returned.
+
+cache_sync_feed must then be called without holding the GIL, as it may wait for the thread.
+*/
+
+#ifdef CACHE_SYNC_THREADS
+static void *
+cache_sync_thread(void *arg)
+{
+    CacheSyncCtx *ctx = arg;
+    SyncWorker *w = ctx->worker;
+    SyncBlock b;
+    int ok = 1;
+
+    for(;;) {
+        pthread_mutex_lock(&w->mutex);
+        while(w->count == 0 && !w->finish)
+            pthread_cond_wait(&w->cond, &w->mutex);
+        if(w->count == 0) {
+            pthread_mutex_unlock(&w->mutex);
+            break;
+        }
+        b = w->queue[w->head];
+        pthread_mutex_unlock(&w->mutex);
+
+        if(ok)
+            ok = cache_sync_parse(ctx, b.data, b.length);
+        free(b.data);
+
+        pthread_mutex_lock(&w->mutex);
+        w->head = (w->head + 1) % CACHE_SYNC_QUEUE_DEPTH;
+        w->count--;
+        w->failed = !ok;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+    }
+    return NULL;
+}
+#endif
+
+static int
+cache_sync_start(CacheSyncCtx *ctx)
+{
+    /* start the parser thread. returns 0 if that fails, then cache_sync_feed just parses the data itself. */
+#ifdef CACHE_SYNC_THREADS
+    SyncWorker *w;
+    if(ctx->worker)
+        return 1;
+#ifndef BORG_NO_PYTHON
+    /* the thread does not hold the GIL */
+    if(!hashindex_detach_buffer(ctx->ctx.user.chunks))
+        return 0;
+#endif
+    if(!(w = calloc(sizeof(SyncWorker), 1)))
+        return 0;
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    ctx->worker = w;
+    if(pthread_create(&w->thread, NULL, cache_sync_thread, ctx) != 0) {
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->mutex);
+        free(w);
+        ctx->worker = NULL;
+        return 0;
+    }
+    return 1;
+#else
+    (void)ctx;
+    return 0;
+#endif
+}
+
+static int
+cache_sync_finish(CacheSyncCtx *ctx)
+{
+    /* wait until the parser thread (if any) parsed all data. 0 = parsing failed, check cache_sync_error */
+#ifdef CACHE_SYNC_THREADS
+    SyncWorker *w = ctx->worker;
+    int failed;
+    if(!w)
+        return !ctx->feed_error;
+    pthread_mutex_lock(&w->mutex);
+    w->finish = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, NULL);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+    failed = w->failed;
+    free(w);
+    ctx->worker = NULL;
+    return !failed && !ctx->feed_error;
+#else
+    return !ctx->feed_error;
+#endif
+}
+
+/**
+ * feed data to the cache synchronizer
+ * 0 = abort, 1 = continue
+ * abort is a regular condition, check cache_sync_error
+ */
+static int
+cache_sync_feed(CacheSyncCtx *ctx, void *data, uint32_t length)
+{
+#ifdef CACHE_SYNC_THREADS
+    SyncWorker *w = ctx->worker;
+    char *copy;
+    if(w) {
+        if(!(copy = malloc(length ? length : 1))) {
+            ctx->feed_error = "cache_sync_feed: unable to allocate buffer";
+            return 0;
+        }
+        memcpy(copy, data, length);
+        pthread_mutex_lock(&w->mutex);
+        while(w->count == CACHE_SYNC_QUEUE_DEPTH && !w->failed)
+            pthread_cond_wait(&w->cond, &w->mutex);
+        if(w->failed) {
+            pthread_mutex_unlock(&w->mutex);
+            free(copy);
+            return 0;
+        }
+        w->queue[(w->head + w->count) % CACHE_SYNC_QUEUE_DEPTH].data = copy;
+        w->queue[(w->head + w->count) % CACHE_SYNC_QUEUE_DEPTH].length = length;
+        w->count++;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+        return 1;
+    }
+#endif
+    return cache_sync_parse(ctx, data, length);
+}
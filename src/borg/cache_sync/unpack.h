@@ -131,6 +131,12 @@ static inline void unpack_init_user_state(unpack_user *u)
     u->expect = expect_item_begin;
 }
 
+/* the next object belongs to a value we don't care about, so it can be skipped as a whole */
+static inline int unpack_callback_skippable(unpack_user* u)
+{
+    return u->expect == expect_map_item_end;
+}
+
 static inline int unpack_callback_uint64(unpack_user* u, int64_t d)
 {
     switch(u->expect) {
@@ -394,6 +400,7 @@ static inline int unpack_callback_bin(unpack_user* u, const char* b, const char*
             return -1;
         }
         memcpy(u->current.key, p, 32);
+        hashindex_prefetch(u->chunks, u->current.key);  /* looked up at the end of the entry */
         u->expect = expect_size;
         break;
     default:
@@ -39,6 +39,7 @@ struct unpack_context {
     unsigned int cs;
     unsigned int trail;
     unsigned int top;
+    uint64_t skip;  /* objects of a value that is being skipped (see unpack_skip) */
     unpack_stack stack[MSGPACK_EMBED_STACK_SIZE];
 };
 
@@ -47,11 +48,121 @@ static inline void unpack_init(unpack_context* ctx)
     ctx->cs = CS_HEADER;
     ctx->trail = 0;
     ctx->top = 0;
+    ctx->skip = 0;
     unpack_init_user_state(&ctx->user);
 }
 
 #define construct 1
 
+/*
+ * Skip *todo msgpack objects starting at p, without any callbacks (nested containers are just counted,
+ * not tracked). *todo gets decremented for each object skipped (and incremented by the number of
+ * elements of a container). Returns the position after the last object skipped, the next one is
+ * incomplete if *todo is not 0 then. NULL if an object is invalid.
+ */
+static inline const unsigned char* unpack_skip(const unsigned char* p, const unsigned char* const pe,
+                                               uint64_t* todo)
+{
+    size_t len, trail;
+
+    while(*todo && p < pe) {
+        trail = 0;
+        len = 0;
+        if(*p <= 0x7f || *p >= 0xe0) {  // Positive / Negative Fixnum
+        } else if(*p <= 0x8f) {  // FixMap
+            *todo += 2 * (*p & 0x0f);
+        } else if(*p <= 0x9f) {  // FixArray
+            *todo += *p & 0x0f;
+        } else if(*p <= 0xbf) {  // FixRaw
+            len = *p & 0x1f;
+        } else {
+            switch(*p) {
+            case 0xc0:  // nil
+            case 0xc2:  // false
+            case 0xc3:  // true
+                break;
+            case 0xc4:  // bin 8
+            case 0xc7:  // ext 8
+            case 0xd9:  // str 8
+                trail = 1;
+                break;
+            case 0xc5:  // bin 16
+            case 0xc8:  // ext 16
+            case 0xda:  // raw 16
+            case 0xdc:  // array 16
+            case 0xde:  // map 16
+                trail = 2;
+                break;
+            case 0xc6:  // bin 32
+            case 0xc9:  // ext 32
+            case 0xdb:  // raw 32
+            case 0xdd:  // array 32
+            case 0xdf:  // map 32
+                trail = 4;
+                break;
+            case 0xca:  // float
+            case 0xcb:  // double
+            case 0xcc:  // unsigned int  8
+            case 0xcd:  // unsigned int 16
+            case 0xce:  // unsigned int 32
+            case 0xcf:  // unsigned int 64
+            case 0xd0:  // signed int  8
+            case 0xd1:  // signed int 16
+            case 0xd2:  // signed int 32
+            case 0xd3:  // signed int 64
+                len = 1 << (*p & 0x03);
+                break;
+            case 0xd4:  // fixext 1
+            case 0xd5:  // fixext 2
+            case 0xd6:  // fixext 4
+            case 0xd7:  // fixext 8
+                len = (1 << (*p & 0x03)) + 1;
+                break;
+            case 0xd8:  // fixext 16
+                len = 16 + 1;
+                break;
+            default:  // 0xc1, never used
+                return NULL;
+            }
+            if(trail) {
+                if((size_t)(pe - p) <= trail) { break; }
+                switch(trail) {
+                case 1:
+                    len = *(uint8_t*)(p + 1);
+                    break;
+                case 2:
+                    len = _msgpack_load16(uint16_t, p + 1);
+                    break;
+                default:
+                    len = _msgpack_load32(uint32_t, p + 1);
+                    break;
+                }
+                switch(*p) {
+                case 0xc7:
+                case 0xc8:
+                case 0xc9:
+                    len += 1;  // ext type
+                    break;
+                case 0xdc:
+                case 0xdd:
+                    *todo += len;
+                    len = 0;
+                    break;
+                case 0xde:
+                case 0xdf:
+                    *todo += 2 * (uint64_t)len;
+                    len = 0;
+                    break;
+                }
+            }
+        }
+        if((size_t)(pe - p) - 1 - trail < len) { break; }
+        p += 1 + trail + len;
+        (*todo)--;
+    }
+    return p;
+}
+
 static inline int unpack_execute(unpack_context* ctx, const char* data, size_t len, size_t* off)
 {
     const unsigned char* p = (unsigned char*)data + *off;
@@ -120,10 +231,17 @@ static inline int unpack_execute(unpack_context* ctx, const char* data, size_t l
 #define SWITCH_RANGE_END       } }
 #endif
 
+    if(ctx->skip) { goto _skip; }  /* continue skipping a value */
     if(p == pe) { goto _out; }
     do {
         switch(cs) {
         case CS_HEADER:
+            if(((*p >= 0x80 && *p <= 0x9f) || *p >= 0xdc) && *p <= 0xdf && construct_cb(_skippable)(user)) {
+                /* skip whole containers we don't care about, instead of parsing them object by object.
+                 * (scalars, strings etc. are skipped in one step by the parser anyway) */
+                ctx->skip = 1;
+                goto _skip;
+            }
             SWITCH_RANGE_BEGIN
             SWITCH_RANGE(0x00, 0x7f)  // Positive Fixnum
                 push_fixed_value(_uint8, *(uint8_t*)p);
@@ -320,6 +438,14 @@ _header_again:
     } while(p != pe);
     goto _out;
 
+_skip:
+    n = unpack_skip(p, pe, &ctx->skip);
+    if(!n) { goto _failed; }
+    p = (const unsigned char*)n;
+    if(ctx->skip) { goto _out; }  /* the rest of the value is in the next data */
+    --p;  /* _push expects p at the last byte of the value */
+    goto _push;
+
 
 _finish:
     if (!construct)
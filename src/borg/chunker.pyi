@@ -1,4 +1,4 @@
-from typing import NamedTuple, Tuple, List, Dict, Any, Type, Iterator, BinaryIO
+from typing import NamedTuple, Tuple, List, Dict, Any, Type, Iterator, BinaryIO, Optional
 
 API_VERSION: str
 
@@ -11,6 +11,8 @@ class _Chunk(NamedTuple):
 def Chunk(data: bytes, **meta) -> Type[_Chunk]: ...
 def buzhash(data: bytes, seed: int) -> int: ...
 def buzhash_update(sum: int, remove: int, add: int, len: int, seed: int) -> int: ...
+def buzhash_scan_kernels() -> List[str]: ...
+def set_buzhash_scan_kernel(name: str = None) -> str: ...
 def get_chunker(algo: str, *params, **kw) -> Any: ...
 
 fmap_entry = Tuple[int, int, bool]
@@ -27,6 +29,32 @@ class ChunkerFixed:
 
 class Chunker:
     def __init__(
-        self, seed: int, chunk_min_exp: int, chunk_max_exp: int, hash_mask_bits: int, hash_window_size: int
+        self,
+        seed: int,
+        chunk_min_exp: int,
+        chunk_max_exp: int,
+        hash_mask_bits: int,
+        hash_window_size: int,
+        use_mmap: bool = False,
+        readahead: int = 0,
+        read_size: int = ...,
+        threads: int = 1,
+        sparse: bool = False,
+    ) -> None: ...
+    def chunkify(self, fd: BinaryIO = None, fh: int = -1, fmap: List[fmap_entry] = None) -> Iterator: ...
+    def chunkify_batch(
+        self, fd: BinaryIO = None, fh: int = -1, fmap: List[fmap_entry] = None
+    ) -> Iterator[Tuple[Optional[memoryview], List[Tuple[int, int, int]]]]: ...
+
+class ChunkerFastCDC:
+    def __init__(
+        self,
+        seed: int,
+        chunk_min_exp: int,
+        chunk_max_exp: int,
+        hash_mask_bits: int,
+        use_mmap: bool = False,
+        readahead: int = 0,
+        read_size: int = ...,
     ) -> None: ...
     def chunkify(self, fd: BinaryIO = None, fh: int = -1) -> Iterator: ...
@@ -1,11 +1,12 @@
-API_VERSION = '1.2_01'
+API_VERSION = '1.2_03'
 
 import errno
 import os
+import stat
 import time
 from collections import namedtuple
 
-from .constants import CH_DATA, CH_ALLOC, CH_HOLE, zeros
+from .constants import CH_DATA, CH_ALLOC, CH_HOLE, READAHEAD_READ_SIZE, PARALLEL_CHUNKING_MIN_SIZE, zeros
 
 from libc.stdlib cimport free
 
@@ -14,12 +15,30 @@ cdef extern from "_chunker.c":
     ctypedef struct _Chunker "Chunker":
         pass
     _Chunker *chunker_init(int window_size, int chunk_mask, int min_size, int max_size, uint32_t seed)
-    void chunker_set_fd(_Chunker *chunker, object f, int fd)
+    void chunker_set_fd(_Chunker *chunker, object f, int fd, int use_mmap)
+    void chunker_set_range(_Chunker *chunker, long long offset, long long size)
     void chunker_free(_Chunker *chunker)
+    void chunker_set_readahead(_Chunker *chunker, size_t depth, size_t read_size)
+    void chunker_set_threads(_Chunker *chunker, int threads)
+    void chunker_set_batch(_Chunker *chunker, int batch)
     object chunker_process(_Chunker *chunker)
+    object chunker_process_batch(_Chunker *chunker)
+    _Chunker *chunker_init_fastcdc(size_t min_size, size_t normal_size, size_t max_size, int mask_bits, uint32_t seed)
+    object fastcdc_process(_Chunker *chunker)
+    ctypedef struct _FixedChunker "FixedChunker":
+        pass
+    _FixedChunker *fixed_chunker_init(size_t block_size)
+    void fixed_chunker_free(_FixedChunker *chunker)
+    int fixed_chunker_set_fd(_FixedChunker *chunker, object fd, int fh, object fmap) except 0
+    object fixed_chunker_process(_FixedChunker *chunker, int *allocation, Py_ssize_t *size)
     uint32_t *buzhash_init_table(uint32_t seed)
     uint32_t c_buzhash "buzhash"(unsigned char *data, size_t len, uint32_t *h)
     uint32_t c_buzhash_update  "buzhash_update"(uint32_t sum, unsigned char remove, unsigned char add, size_t len, uint32_t *h)
+    int BUZHASH_SCAN_COUNT
+    const char *buzhash_scan_names[]
+    int buzhash_scan_available(int kernel)
+    int buzhash_scan_select(int kernel)
+    int buzhash_scan_selected()
 
 
 # this will be True if Python's seek implementation supports data/holes seeking.
@@ -170,7 +189,7 @@ class ChunkerFailing:
                 return
 
 
-class ChunkerFixed:
+cdef class ChunkerFixed:
     """
     This is a simple chunker for input data with data usually staying at same
     offset and / or with known block/record sizes:
@@ -189,8 +208,16 @@ class ChunkerFixed:
 
     Note: the last block of a data or hole range may be less than the block size,
           this is supported and not considered to be an error.
+
+    The per-block reading / seeking and the all-zero detection are done in C.
     """
-    def __init__(self, block_size, header_size=0, sparse=False):
+    cdef _FixedChunker *chunker
+    cdef readonly int block_size
+    cdef readonly int header_size
+    cdef readonly bint try_sparse
+    cdef readonly float chunking_time
+
+    def __cinit__(self, int block_size, int header_size=0, sparse=False):
         self.block_size = block_size
         self.header_size = header_size
         self.chunking_time = 0.0
@@ -198,6 +225,11 @@ class ChunkerFixed:
         # whether it actually can be done depends on the input file being seekable.
         self.try_sparse = sparse and has_seek_hole
         assert block_size <= len(zeros)
+        self.chunker = fixed_chunker_init(block_size)
+
+    def __dealloc__(self):
+        if self.chunker:
+            fixed_chunker_free(self.chunker)
 
     def chunkify(self, fd=None, fh=-1, fmap=None):
         """
@@ -239,39 +271,19 @@ class ChunkerFixed:
                     body_map = [(0, 2 ** 62, True), ]
                 fmap = header_map + body_map
 
-        offset = 0
-        for range_start, range_size, is_data in fmap:
-            if range_start != offset:
-                # this is for the case when the fmap does not cover the file completely,
-                # e.g. it could be without the ranges of holes or of unchanged data.
-                offset = range_start
-                dseek(offset, os.SEEK_SET, fd, fh)
-            while range_size:
-                started_chunking = time.monotonic()
-                wanted = min(range_size, self.block_size)
-                if is_data:
-                    # read block from the range
-                    data = dread(offset, wanted, fd, fh)
-                    got = len(data)
-                    if zeros.startswith(data):
-                        data = None
-                        allocation = CH_ALLOC
-                    else:
-                        allocation = CH_DATA
-                else:  # hole
-                    # seek over block from the range
-                    pos = dseek(wanted, os.SEEK_CUR, fd, fh)
-                    got = pos - offset
-                    data = None
-                    allocation = CH_HOLE
-                if got > 0:
-                    offset += got
-                    range_size -= got
-                    self.chunking_time += time.monotonic() - started_chunking
-                    yield Chunk(data, size=got, allocation=allocation)
-                if got < wanted:
-                    # we did not get enough data, looks like EOF.
-                    return
+        fixed_chunker_set_fd(self.chunker, fd, fh, fmap)
+        return self
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        cdef int allocation = 0
+        cdef Py_ssize_t size = 0
+        started_chunking = time.monotonic()
+        data = fixed_chunker_process(self.chunker, &allocation, &size)
+        self.chunking_time += time.monotonic() - started_chunking
+        return Chunk(data, size=size, allocation=allocation)
 
 
 cdef class Chunker:
@@ -285,32 +297,138 @@ cdef class Chunker:
     window contents. If the last n bits of the rolling hash are 0, a chunk is cut.
     Additionally it obeys some more criteria, like a minimum and maximum chunk size.
     It also uses a per-repo random seed to avoid some chunk length fingerprinting attacks.
+
+    If use_mmap is True, regular files given via an OS-level file handle are mmap'd instead of
+    read and the chunks are memoryviews into the mapping (no copying). Note that a file
+    getting truncated while it is chunked will crash the process (SIGBUS) in this mode.
+
+    If readahead is > 0, big files given via an OS-level file handle are read by a background
+    thread in blocks of read_size bytes, keeping up to readahead blocks queued, so reading
+    and chunking overlap.
+
+    If threads is > 1, the chunk cutting places of big regular files (given via an OS-level
+    file handle) are searched by that many threads in parallel. The result is the same as
+    with a single thread.
+
+    If sparse is True, the holes of sparse files are not read, but yielded as CH_HOLE chunks
+    of up to max_size bytes. The data ranges between the holes are chunked content-defined.
     """
     cdef _Chunker *chunker
     cdef readonly float chunking_time
-
-    def __cinit__(self, int seed, int chunk_min_exp, int chunk_max_exp, int hash_mask_bits, int hash_window_size):
+    cdef bint use_mmap
+    cdef int threads
+    cdef int max_size
+    cdef readonly bint try_sparse
+
+    def __cinit__(self, int seed, int chunk_min_exp, int chunk_max_exp, int hash_mask_bits, int hash_window_size,
+                  bint use_mmap=False, int readahead=0, int read_size=READAHEAD_READ_SIZE, int threads=1,
+                  sparse=False):
         min_size = 1 << chunk_min_exp
         max_size = 1 << chunk_max_exp
         assert max_size <= len(zeros)
         # see chunker_process, first while loop condition, first term must be able to get True:
         assert hash_window_size + min_size + 1 <= max_size, "too small max_size"
         hash_mask = (1 << hash_mask_bits) - 1
+        assert readahead >= 0 and read_size > 0
         self.chunker = chunker_init(hash_window_size, hash_mask, min_size, max_size, seed & 0xffffffff)
+        chunker_set_readahead(self.chunker, readahead, read_size)
         self.chunking_time = 0.0
+        self.use_mmap = use_mmap
+        self.threads = threads
+        self.max_size = max_size
+        # should borg try to do sparse input processing?
+        # whether it actually can be done depends on the input file being seekable.
+        self.try_sparse = sparse and has_seek_hole
 
 
-    def chunkify(self, fd, fh=-1):
+    def chunkify(self, fd, fh=-1, fmap=None):
         """
         Cut a file into chunks.
 
         :param fd: Python file object
         :param fh: OS-level file handle (if available),
                    defaults to -1 which means not to use OS-level fd.
+        :param fmap: a file map, same format as generated by sparsemap
         """
-        chunker_set_fd(self.chunker, fd, fh)
+        fmap = self._start(fd, fh, fmap, batch=False)
+        if fmap is not None:
+            return self._chunkify_fmap(fd, fh, fmap, batch=False)
+        chunker_set_fd(self.chunker, fd, fh, self.use_mmap)
         return self
 
+    def chunkify_batch(self, fd, fh=-1, fmap=None):
+        """
+        Cut a file into chunks, like chunkify, but yield batches of chunks.
+
+        Each batch is a (data, boundaries) tuple. boundaries is a list of (offset, length, allocation)
+        tuples, one for each chunk, offset is relative to data. data is None for a batch of holes.
+        The data is only valid until the next batch is requested.
+        """
+        fmap = self._start(fd, fh, fmap, batch=True)
+        if fmap is not None:
+            return self._chunkify_fmap(fd, fh, fmap, batch=True)
+        chunker_set_fd(self.chunker, fd, fh, self.use_mmap)
+        return self._batches()
+
+    def _start(self, fd, fh, fmap, batch):
+        if fmap is None and self.try_sparse:
+            try:
+                fmap = list(sparsemap(fd, fh))
+            except OSError as err:
+                # seeking did not work
+                pass
+            else:
+                if len(fmap) <= 1 and all(is_data for _, _, is_data in fmap):
+                    # not sparse, just chunk the whole file.
+                    fmap = None
+        threads = 1
+        if self.threads > 1 and fh >= 0:
+            st = os.fstat(fh)
+            if stat.S_ISREG(st.st_mode) and st.st_size >= PARALLEL_CHUNKING_MIN_SIZE:
+                threads = self.threads
+        chunker_set_threads(self.chunker, threads)
+        chunker_set_batch(self.chunker, batch)
+        return fmap
+
+    def _batches(self):
+        while True:
+            started_chunking = time.monotonic()
+            try:
+                batch = chunker_process_batch(self.chunker)
+            except StopIteration:
+                return
+            finally:
+                self.chunking_time += time.monotonic() - started_chunking
+            yield batch
+
+    def _chunkify_fmap(self, fd, fh, fmap, batch):
+        for range_start, range_size, is_data in fmap:
+            if is_data:
+                # chunk the data range content-defined, the chunker reads only this range.
+                dseek(range_start, os.SEEK_SET, fd, fh)
+                chunker_set_fd(self.chunker, fd, fh, self.use_mmap)
+                chunker_set_range(self.chunker, range_start, range_size)
+                got = 0
+                if batch:
+                    for data, boundaries in self._batches():
+                        got += len(data)
+                        yield data, boundaries
+                else:
+                    for chunk in self:
+                        got += chunk.meta['size']
+                        yield chunk
+                if got < range_size:
+                    # looks like EOF, the file was truncated meanwhile.
+                    return
+            else:  # hole
+                # do not read the hole, just cut it into max_size pieces.
+                sizes = [min(range_size - offset, self.max_size) for offset in range(0, range_size, self.max_size)]
+                if batch:
+                    yield None, [(i * self.max_size, size, CH_HOLE) for i, size in enumerate(sizes)]
+                else:
+                    for size in sizes:
+                        yield Chunk(None, size=size, allocation=CH_HOLE)
+
     def __dealloc__(self):
         if self.chunker:
             chunker_free(self.chunker)
@@ -334,10 +452,76 @@ cdef class Chunker:
         return Chunk(data, size=got, allocation=allocation)
 
 
+cdef class ChunkerFastCDC:
+    """
+    Content-Defined Chunker using the FastCDC algorithm, variable chunk sizes.
+
+    Like Chunker, but it uses the gear rolling-hash, which is much cheaper to compute
+    than buzhash. It skips hashing the first chunk_min bytes of each chunk and uses
+    normalized chunking (a stricter cut condition below and a more relaxed one above
+    the target chunk size of 2^hash_mask_bits), which results in a narrower chunk size
+    distribution. It also uses a per-repo random seed to derive the gear table.
+
+    use_mmap, readahead, read_size: see Chunker.
+    """
+    cdef _Chunker *chunker
+    cdef readonly float chunking_time
+    cdef bint use_mmap
+
+    def __cinit__(self, int seed, int chunk_min_exp, int chunk_max_exp, int hash_mask_bits, bint use_mmap=False,
+                  int readahead=0, int read_size=READAHEAD_READ_SIZE):
+        min_size = 1 << chunk_min_exp
+        normal_size = 1 << hash_mask_bits
+        max_size = 1 << chunk_max_exp
+        assert max_size <= len(zeros)
+        assert min_size <= normal_size <= max_size and min_size < max_size, "bad chunk sizes"
+        assert readahead >= 0 and read_size > 0
+        self.chunker = chunker_init_fastcdc(min_size, normal_size, max_size, hash_mask_bits, seed & 0xffffffff)
+        chunker_set_readahead(self.chunker, readahead, read_size)
+        self.chunking_time = 0.0
+        self.use_mmap = use_mmap
+
+    def chunkify(self, fd, fh=-1):
+        """
+        Cut a file into chunks.
+
+        :param fd: Python file object
+        :param fh: OS-level file handle (if available),
+                   defaults to -1 which means not to use OS-level fd.
+        """
+        chunker_set_fd(self.chunker, fd, fh, self.use_mmap)
+        return self
+
+    def __dealloc__(self):
+        if self.chunker:
+            chunker_free(self.chunker)
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        started_chunking = time.monotonic()
+        data = fastcdc_process(self.chunker)
+        got = len(data)
+        if zeros.startswith(data):
+            data = None
+            allocation = CH_ALLOC
+        else:
+            allocation = CH_DATA
+        self.chunking_time += time.monotonic() - started_chunking
+        return Chunk(data, size=got, allocation=allocation)
+
+
 def get_chunker(algo, *params, **kw):
-    if algo == 'buzhash':
+    if algo in ('buzhash', 'fastcdc'):
         seed = kw['seed']
-        return Chunker(seed, *params)
+        cls = Chunker if algo == 'buzhash' else ChunkerFastCDC
+        kwargs = dict(use_mmap=kw.get('use_mmap', False),
+                      readahead=kw.get('readahead', 0), read_size=kw.get('read_size', READAHEAD_READ_SIZE))
+        if algo == 'buzhash':
+            kwargs['threads'] = kw.get('threads', 1)
+            kwargs['sparse'] = kw.get('sparse', False)
+        return cls(seed, *params, **kwargs)
     if algo == 'fixed':
         sparse = kw['sparse']
         return ChunkerFixed(*params, sparse=sparse)
@@ -346,6 +530,35 @@ def get_chunker(algo, *params, **kw):
     raise TypeError('unsupported chunker algo %r' % algo)
 
 
+def buzhash_scan_kernels():
+    """
+    Return the names of the buzhash scan kernels usable on this CPU.
+
+    All kernels find exactly the same chunk cutting places, they only differ in speed.
+    """
+    return [buzhash_scan_names[i].decode() for i in range(BUZHASH_SCAN_COUNT) if buzhash_scan_available(i)]
+
+
+def set_buzhash_scan_kernel(name=None):
+    """
+    Select the buzhash scan kernel used by all Chunker instances (None: best one available).
+
+    Return the name of the previously selected kernel.
+    """
+    previous = buzhash_scan_names[buzhash_scan_selected()].decode()
+    if name is None:
+        buzhash_scan_select(-1)
+    else:
+        for i in range(BUZHASH_SCAN_COUNT):
+            if buzhash_scan_names[i].decode() == name:
+                break
+        else:
+            raise ValueError('unknown buzhash scan kernel %r' % name)
+        if buzhash_scan_select(i) < 0:
+            raise ValueError('buzhash scan kernel %r is not supported by this CPU' % name)
+    return previous
+
+
 def buzhash(data, unsigned long seed):
     cdef uint32_t *table
     cdef uint32_t sum
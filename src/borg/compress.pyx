@@ -18,6 +18,7 @@ decompressor.
 from argparse import ArgumentTypeError
 import random
 from struct import Struct
+import threading
 import zlib
 
 try:
@@ -29,7 +30,7 @@ except ImportError:
 from .constants import MAX_DATA_SIZE
 from .helpers import Buffer, DecompressionError
 
-API_VERSION = '1.2_02'
+API_VERSION = '1.2_03'
 
 cdef extern from "lz4.h":
     int LZ4_compress_default(const char* source, char* dest, int inputSize, int maxOutputSize) nogil
@@ -48,7 +49,19 @@ cdef extern from "zstd.h":
     const char* ZSTD_getErrorName(size_t code) nogil
 
 
-buffer = Buffer(bytearray, size=0)
+class ThreadLocalBuffer(threading.local):
+    """
+    a Buffer per thread: the (de)compressors write into it with the GIL released,
+    so threads compressing concurrently must not share it.
+    """
+    def __init__(self):
+        self.buffer = Buffer(bytearray, size=0)
+
+    def get(self, size=None, init=False):
+        return self.buffer.get(size, init)
+
+
+buffer = ThreadLocalBuffer()
 
 
 cdef class CompressorBase:
@@ -92,6 +92,7 @@
 # chunker algorithms
 CH_BUZHASH = "buzhash"
 CH_FIXED = "fixed"
+CH_FASTCDC = "fastcdc"
 CH_FAIL = "fail"
 
 # buzhash chunker params
@@ -106,6 +107,26 @@
 # chunker params for the items metadata stream, finer granularity
 ITEMS_CHUNKER_PARAMS = (CH_BUZHASH, 15, 19, 17, HASH_WINDOW_SIZE)
 
+# read-ahead when chunking big files: number of queued blocks, block size
+READAHEAD_DEPTH = 4
+READAHEAD_READ_SIZE = 2 * 1024 * 1024
+
+# chunk big files using multiple threads (buzhash chunker only): max. threads, min. file size
+PARALLEL_CHUNKING_THREADS = 4
+PARALLEL_CHUNKING_MIN_SIZE = 64 * 1024 * 1024
+
+# borg create: max. worker threads hashing and compressing chunks, max. queued new chunks per worker thread
+CREATE_WORKER_THREADS = 8
+CREATE_WORKER_QUEUE = 4
+# hash batches of chunks in parallel parts of at least that size
+PARALLEL_HASHING_MIN_SIZE = 1024 * 1024
+
+# cache sync: merge that many archive chunk indexes at once into the master index, using up to that many threads
+CACHE_SYNC_MERGE_BATCH = 16
+CACHE_SYNC_MERGE_THREADS = 4
+# cache sync: max. number of archive chunk indexes built in parallel (one item metadata parser thread each)
+CACHE_SYNC_PARSE_THREADS = 4
+
 # normal on-disk data, allocated (but not written, all zeros), not allocated hole (all zeros)
 CH_DATA, CH_ALLOC, CH_HOLE = 0, 1, 2
 
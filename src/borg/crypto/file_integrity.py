@@ -1,6 +1,7 @@
 import hashlib
 import io
 import json
+import mmap
 import os
 from hmac import compare_digest
 from typing import Callable
@@ -35,6 +36,17 @@ def write(self, data):
     def read(self, n=None):
         return self.fd.read(n)
 
+    def mmap_read(self, n):
+        """
+        Like read(n), but return a memoryview of a copy-on-write memory mapping of the file.
+
+        Modifications of the returned data do not go to the file.
+        """
+        offset = self.tell()
+        data = memoryview(mmap.mmap(self.fileno(), 0, access=mmap.ACCESS_COPY))[offset : offset + n]
+        self.seek(offset + len(data))
+        return data
+
     def flush(self):
         self.fd.flush()
 
@@ -87,6 +99,11 @@ def read(self, n=None):
         self.hash.update(data)
         return data
 
+    def mmap_read(self, n):
+        data = super().mmap_read(n)
+        self.hash.update(data)
+        return data
+
     def hexdigest(self):
         """
         Return current digest bytes as hex-string.
@@ -183,6 +200,12 @@ def parse_integrity_data(cls, path: str, data: str):
             logger.warning("Could not parse integrity data for %s: %s", path, e)
             raise FileIntegrityError(path)
 
+    def mmap_read(self, n):
+        if not self.writing and not self.digests:
+            # nothing to verify, so we don't need to look at the data
+            return super().mmap_read(n)
+        return self.hasher.mmap_read(n)
+
     def hash_part(self, partname, is_final=False):
         if not self.writing and not self.digests:
             return
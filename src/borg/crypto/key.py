@@ -27,6 +27,7 @@
 
 
 from .low_level import AES, bytes_to_int, num_cipher_blocks, hmac_sha256, blake2b_256
+from .low_level import hmac_sha256_batch, blake2b_256_batch
 from .low_level import AES256_CTR_HMAC_SHA256, AES256_CTR_BLAKE2b, AES256_OCB, CHACHA20_POLY1305
 from . import low_level
 
@@ -178,6 +179,11 @@ def id_hash(self, data):
         """Return HMAC hash using the "id" HMAC key"""
         raise NotImplementedError
 
+    def id_hash_batch(self, data, boundaries):
+        """Return the id_hash of each data[offset:offset + length] for the (offset, length, ...) boundaries"""
+        data = memoryview(data)
+        return [self.id_hash(data[boundary[0] : boundary[0] + boundary[1]]) for boundary in boundaries]
+
     def encrypt(self, id, data):
         pass
 
@@ -274,6 +280,9 @@ class ID_BLAKE2b_256:
     def id_hash(self, data):
         return blake2b_256(self.id_key, data)
 
+    def id_hash_batch(self, data, boundaries):
+        return blake2b_256_batch(self.id_key, data, boundaries)
+
     def init_from_random_data(self):
         super().init_from_random_data()
         enc_key = os.urandom(32)
@@ -292,6 +301,9 @@ class ID_HMAC_SHA_256:
     def id_hash(self, data):
         return hmac_sha256(self.id_key, data)
 
+    def id_hash_batch(self, data, boundaries):
+        return hmac_sha256_batch(self.id_key, data, boundaries)
+
 
 class AESKeyBase(KeyBase):
     """
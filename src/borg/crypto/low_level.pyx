@@ -41,7 +41,7 @@ from math import ceil
 from cpython cimport PyMem_Malloc, PyMem_Free
 from cpython.buffer cimport PyBUF_SIMPLE, PyObject_GetBuffer, PyBuffer_Release
 
-API_VERSION = '1.3_01'
+API_VERSION = '1.3_02'
 
 cdef extern from "openssl/crypto.h":
     int CRYPTO_memcmp(const void *a, const void *b, size_t len)
@@ -84,6 +84,12 @@ cdef extern from "openssl/evp.h":
     int EVP_CTRL_AEAD_SET_TAG
     int EVP_CTRL_AEAD_SET_IVLEN
 
+    const EVP_MD *EVP_sha256() nogil
+
+cdef extern from "openssl/hmac.h":
+    unsigned char *HMAC(const EVP_MD *evp_md, const void *key, int key_len,
+                        const unsigned char *d, size_t n, unsigned char *md, unsigned int *md_len) nogil
+
 
 import struct
 
@@ -708,9 +714,67 @@ def hmac_sha256(key, data):
     return hmac.digest(key, data, 'sha256')
 
 
+def hmac_sha256_batch(key, data, boundaries):
+    """
+    Return the list of hmac_sha256(key, data[offset:offset + length]) for the (offset, length, ...)
+    tuples in boundaries, see Chunker.chunkify_batch.
+
+    All slices are hashed in one go, without holding the GIL.
+    """
+    cdef Py_buffer kdata = ro_buffer(key)
+    cdef Py_buffer idata = ro_buffer(data)
+    cdef Py_ssize_t i, count = len(boundaries)
+    cdef Py_ssize_t *slices = <Py_ssize_t *> PyMem_Malloc(2 * count * sizeof(Py_ssize_t) + 1)
+    cdef unsigned char *digests = <unsigned char *> PyMem_Malloc(32 * count + 1)
+    cdef const unsigned char *base = <const unsigned char *> idata.buf
+    cdef int failed = 0
+    try:
+        if not slices or not digests:
+            raise MemoryError
+        for i, boundary in enumerate(boundaries):
+            offset, length = boundary[0], boundary[1]
+            if offset < 0 or length < 0 or offset + length > idata.len:
+                raise ValueError('boundary (%d, %d) is outside of the data' % (offset, length))
+            slices[2 * i] = offset
+            slices[2 * i + 1] = length
+        with nogil:
+            for i in range(count):
+                if HMAC(EVP_sha256(), kdata.buf, <int> kdata.len, base + slices[2 * i], slices[2 * i + 1],
+                        digests + 32 * i, NULL) == NULL:
+                    failed = 1
+                    break
+        if failed:
+            raise CryptoError('HMAC failed')
+        return [digests[32 * i:32 * i + 32] for i in range(count)]
+    finally:
+        PyMem_Free(slices)
+        PyMem_Free(digests)
+        PyBuffer_Release(&kdata)
+        PyBuffer_Release(&idata)
+
+
 def blake2b_256(key, data):
     return hashlib.blake2b(key+data, digest_size=32).digest()
 
 
+def blake2b_256_batch(key, data, boundaries):
+    """
+    Return the list of blake2b_256(key, data[offset:offset + length]) for the (offset, length, ...)
+    tuples in boundaries, see Chunker.chunkify_batch.
+
+    The key is hashed only once, each slice is hashed by a copy of that hash state (without
+    concatenating key and data).
+    """
+    keyed = hashlib.blake2b(key, digest_size=32)
+    view = memoryview(data)
+    digests = []
+    for boundary in boundaries:
+        offset, length = boundary[0], boundary[1]
+        h = keyed.copy()
+        h.update(view[offset:offset + length])
+        digests.append(h.digest())
+    return digests
+
+
 def blake2b_128(data):
     return hashlib.blake2b(data, digest_size=16).digest()
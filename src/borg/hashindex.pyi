@@ -1,4 +1,4 @@
-from typing import NamedTuple, Tuple, Type, Union, IO, Iterator, Any
+from typing import NamedTuple, Tuple, Type, Union, IO, Iterator, Iterable, Any, List, Optional
 
 API_VERSION: str
 
@@ -11,10 +11,15 @@ class IndexBase:
     MAX_VALUE: int
     MAX_LOAD_FACTOR: int
     def __init__(
-        self, capacity: int = ..., path: PATH_OR_FILE = ..., permit_compact: bool = ..., usable: Union[int, float] = ...
+        self,
+        capacity: int = ...,
+        path: PATH_OR_FILE = ...,
+        permit_compact: bool = ...,
+        usable: Union[int, float] = ...,
+        mmap: bool = ...,
     ): ...
     @classmethod
-    def read(cls, path: PATH_OR_FILE, permit_compact: bool = False): ...
+    def read(cls, path: PATH_OR_FILE, permit_compact: bool = False, mmap: bool = False): ...
     def write(self, path: PATH_OR_FILE) -> None: ...
     def clear(self) -> None: ...
     def setdefault(self, key: bytes, value: bytes) -> None: ...
@@ -24,6 +29,7 @@ class IndexBase:
     def __len__(self) -> int: ...
     def size(self) -> int: ...
     def compact(self) -> Any: ...
+    def contains_many(self, keys: bytes) -> List[bool]: ...
 
 class ChunkIndexEntry(NamedTuple):
     refcount: int
@@ -40,8 +46,15 @@ class ChunkIndex(IndexBase):
     def add(self, key: bytes, refs: int, size: int) -> None: ...
     def decref(self, key: bytes) -> CIE: ...
     def incref(self, key: bytes) -> CIE: ...
+    def decref_many(self, keys: bytes) -> List[Optional[CIE]]: ...
+    def incref_many(self, keys: bytes) -> List[Optional[CIE]]: ...
+    def set_many(self, keys: bytes, value: CIE) -> None: ...
+    def get_many(self, keys: bytes) -> List[Optional[ChunkIndexEntry]]: ...
     def iteritems(self, marker: bytes = ...) -> Iterator: ...
     def merge(self, other_index) -> None: ...
+    def merge_many(self, indexes: Iterable, threads: int = ...) -> None: ...
+    def merge_sorted(self, sources: Iterable) -> None: ...
+    def write_sorted(self, fd: IO) -> int: ...
     def stats_against(self, master_index) -> Tuple: ...
     def summarize(self) -> Tuple: ...
     def zero_csize_ids(self) -> int: ...
@@ -61,6 +74,8 @@ class NSKeyIterator:
 
 class NSIndex(IndexBase):
     def iteritems(self, *args, **kwargs) -> Iterator: ...
+    def part_keys(self, part: int, parts: int, mask: int = ..., value: int = ...) -> bytes: ...
+    def get_many(self, keys: bytes) -> List[Optional[NSIndexEntry]]: ...
     def __contains__(self, key: bytes) -> bool: ...
     def __getitem__(self, key: bytes) -> Any: ...
     def __setitem__(self, key: bytes, value: Any) -> None: ...
@@ -78,8 +93,26 @@ class FuseVersionsIndex(IndexBase):
     def __getitem__(self, key: bytes) -> Any: ...
     def __setitem__(self, key: bytes, value: Any) -> None: ...
 
+class FileCacheEntry(NamedTuple):
+    age: int
+    inode: int
+    size: int
+    cmtime: int
+    chunks: List[Tuple[bytes, int]]
+
+class FilesCacheIndex(IndexBase):
+    @classmethod
+    def read(cls, fd: IO) -> "FilesCacheIndex": ...  # type: ignore[override]
+    def write(self, fd: IO, ttl: int, newest_cmtime: int) -> int: ...  # type: ignore[override]
+    def refresh(self, key: bytes, inode: int) -> None: ...
+    def detach(self) -> None: ...
+    def __contains__(self, key: bytes) -> bool: ...
+    def __getitem__(self, key: bytes) -> FileCacheEntry: ...
+    def __setitem__(self, key: bytes, value: FileCacheEntry) -> None: ...
+
 class CacheSynchronizer:
     size_totals: int
     num_files_totals: int
-    def __init__(self, chunks_index: Any) -> None: ...
+    def __init__(self, chunks_index: Any, threaded: bool = ...) -> None: ...
     def feed(self, chunk: bytes) -> None: ...
+    def finish(self) -> None: ...
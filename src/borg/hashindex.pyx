@@ -1,35 +1,57 @@
 from collections import namedtuple
+import struct
+import zlib
 
 cimport cython
-from libc.stdint cimport uint32_t, UINT32_MAX, uint64_t
-from libc.string cimport memcpy
-from cpython.buffer cimport PyBUF_SIMPLE, PyObject_GetBuffer, PyBuffer_Release
+from libc.stdint cimport uint32_t, UINT32_MAX, uint64_t, int64_t
+from libc.stdlib cimport malloc, realloc, free
+from libc.string cimport memcpy, memcmp
+from cpython.buffer cimport PyBUF_SIMPLE, PyBUF_WRITABLE, PyObject_GetBuffer, PyBuffer_Release
 from cpython.bytes cimport PyBytes_FromStringAndSize, PyBytes_CheckExact, PyBytes_GET_SIZE, PyBytes_AS_STRING
 
-API_VERSION = '1.2_01'
+from .crypto.file_integrity import FileLikeWrapper
+
+API_VERSION = '1.2_09'
 
 
 cdef extern from "_hashindex.c":
     ctypedef struct HashIndex:
-        pass
+        int key_size
+        int value_size
 
     ctypedef struct FuseVersionsElement:
         uint32_t version
         char hash[16]
 
-    HashIndex *hashindex_read(object file_py, int permit_compact, int legacy) except *
-    HashIndex *hashindex_init(int capacity, int key_size, int value_size)
+    HashIndex *hashindex_read(object file_py, int permit_compact, int legacy, int mmap) except *
+    HashIndex *hashindex_init(int64_t capacity, int key_size, int value_size)
     void hashindex_free(HashIndex *index)
-    int hashindex_len(HashIndex *index)
-    int hashindex_size(HashIndex *index)
+    int64_t hashindex_len(HashIndex *index)
+    int64_t hashindex_size(HashIndex *index)
     void hashindex_write(HashIndex *index, object file_py, int legacy) except *
-    unsigned char *hashindex_get(HashIndex *index, unsigned char *key)
-    unsigned char *hashindex_next_key(HashIndex *index, unsigned char *key)
+    void hashindex_write_transformed(HashIndex *index, object file_py,
+                                     int (*transform)(void *ctx, unsigned char *bucket) noexcept nogil, void *ctx,
+                                     int64_t num_entries) except *
+    int hashindex_migrate_all(HashIndex *index)
+    int hashindex_migrate_lookups(HashIndex *index, int64_t lookups)
+    int hashindex_detach_buffer(HashIndex *index)
+    # lookups do not touch any Python objects, so they can be done without holding the GIL
+    unsigned char *hashindex_get(HashIndex *index, unsigned char *key) nogil
+    unsigned char *hashindex_next_key(HashIndex *index, unsigned char *key) nogil
+    int64_t hashindex_part_keys(HashIndex *index, int64_t part, int64_t parts, unsigned char *out,
+                                int flags_offset, uint32_t mask, uint32_t value)
+    int64_t hashindex_part_size(HashIndex *index, int64_t parts)
     int hashindex_delete(HashIndex *index, unsigned char *key)
     int hashindex_set(HashIndex *index, unsigned char *key, void *value)
     uint64_t hashindex_compact(HashIndex *index)
-    uint32_t _htole32(uint32_t v)
-    uint32_t _le32toh(uint32_t v)
+    int hashindex_merge_many(HashIndex *index, HashIndex **sources, int num_sources, uint32_t max_refcount, int threads)
+    int hashindex_merge_entry(HashIndex *index, const unsigned char *key, const uint32_t *values, uint32_t max_refcount)
+    unsigned char **hashindex_sorted_keys(HashIndex *index)
+    void hashindex_prefetch(HashIndex *index, const unsigned char *key) nogil
+    uint32_t _htole32(uint32_t v) nogil
+    uint32_t _le32toh(uint32_t v) nogil
+    uint64_t _htole64(uint64_t v) nogil
+    uint64_t _le64toh(uint64_t v) nogil
 
     double HASH_MAX_LOAD
 
@@ -42,7 +64,9 @@ cdef extern from "cache_sync/cache_sync.c":
     const char *cache_sync_error(const CacheSyncCtx *ctx)
     uint64_t cache_sync_num_files_totals(const CacheSyncCtx *ctx)
     uint64_t cache_sync_size_totals(const CacheSyncCtx *ctx)
-    int cache_sync_feed(CacheSyncCtx *ctx, void *data, uint32_t length)
+    int cache_sync_feed(CacheSyncCtx *ctx, void *data, uint32_t length) nogil
+    int cache_sync_start(CacheSyncCtx *ctx)
+    int cache_sync_finish(CacheSyncCtx *ctx) nogil
     void cache_sync_free(CacheSyncCtx *ctx)
 
     uint32_t _MAX_VALUE
@@ -50,6 +74,23 @@ cdef extern from "cache_sync/cache_sync.c":
 
 cdef _NoDefault = object()
 
+# how many keys ahead of the current one the *_many methods prefetch
+cdef Py_ssize_t PREFETCH_AHEAD = 8
+
+
+cdef Py_buffer ro_buffer(object data) except *:
+    cdef Py_buffer view
+    PyObject_GetBuffer(data, &view, PyBUF_SIMPLE)
+    return view
+
+
+cdef inline const unsigned char *batch_key(HashIndex *index, const unsigned char *keys, Py_ssize_t i,
+                                            Py_ssize_t count, int key_size):
+    """return the i-th of *count* concatenated *keys*, prefetch for a key some positions ahead"""
+    if i + PREFETCH_AHEAD < count:
+        hashindex_prefetch(index, keys + (i + PREFETCH_AHEAD) * key_size)
+    return keys + i * key_size
+
 """
 The HashIndex is *not* a general purpose data structure. The value size must be at least 4 bytes, and these
 first bytes are used for in-band signalling in the data structure itself.
@@ -63,6 +104,9 @@ to MAX_VALUE (inclusive). The following reserved values beyond MAX_VALUE are cur
 
 None of the publicly available classes in this module will accept nor return a reserved value;
 AssertionError is raised instead.
+
+Deleting an entry may move other entries within the hash table, so an index must not be modified
+while iterating over it.
 """
 
 assert UINT32_MAX == 2**32-1
@@ -94,14 +138,14 @@ cdef class IndexBase:
     MAX_LOAD_FACTOR = HASH_MAX_LOAD
     MAX_VALUE = _MAX_VALUE
 
-    def __cinit__(self, capacity=0, path=None, permit_compact=False, usable=None):
+    def __cinit__(self, capacity=0, path=None, permit_compact=False, usable=None, mmap=False):
         self.key_size = self._key_size
         if path:
             if isinstance(path, (str, bytes)):
                 with open(path, 'rb') as fd:
-                    self.index = hashindex_read(fd, permit_compact, self.legacy)
+                    self.index = hashindex_read(FileLikeWrapper(fd) if mmap else fd, permit_compact, self.legacy, mmap)
             else:
-                self.index = hashindex_read(path, permit_compact, self.legacy)
+                self.index = hashindex_read(path, permit_compact, self.legacy, mmap)
             assert self.index, 'hashindex_read() returned NULL with no exception set'
         else:
             if usable is not None:
@@ -115,8 +159,16 @@ cdef class IndexBase:
             hashindex_free(self.index)
 
     @classmethod
-    def read(cls, path, permit_compact=False):
-        return cls(path=path, permit_compact=permit_compact)
+    def read(cls, path, permit_compact=False, mmap=False):
+        """
+        Read an index from *path* (a file name or a file object).
+
+        With *mmap*, the buckets are not read, but memory mapped (copy-on-write) from the file, if the file
+        object supports that (see FileLikeWrapper.mmap_read). This is much faster and shares memory with
+        other processes using the same index. The first modification of the index costs about as much as
+        reading it would have, so this is mainly useful for read-only uses.
+        """
+        return cls(path=path, permit_compact=permit_compact, mmap=mmap)
 
     def write(self, path):
         if isinstance(path, (str, bytes)):
@@ -125,6 +177,18 @@ cdef class IndexBase:
         else:
             hashindex_write(self.index, path, self.legacy)
 
+    cdef int _migrate(self, int64_t lookups) except -1:
+        """move buckets of an incremental resize in progress along with *lookups* lookups, see _hashindex.c"""
+        if not hashindex_migrate_lookups(self.index, lookups):
+            raise MemoryError
+        return 0
+
+    cdef int _migrate_all(self) except -1:
+        """finish an incremental resize in progress, so entries stay where they are while iterating"""
+        if not hashindex_migrate_all(self.index):
+            raise MemoryError
+        return 0
+
     def clear(self):
         hashindex_free(self.index)
         self.index = hashindex_init(0, self.key_size, self.value_size)
@@ -172,6 +236,26 @@ cdef class IndexBase:
     def compact(self):
         return hashindex_compact(self.index)
 
+    def contains_many(self, keys):
+        """
+        Return a list telling for each of *keys* whether it is in the index.
+
+        *keys* is a bytes-like object with the keys concatenated. This (like all *_many methods) is faster
+        than single lookups, because while a key is looked up, memory for the following keys is prefetched.
+        """
+        cdef Py_buffer keys_buf = ro_buffer(keys)
+        cdef Py_ssize_t i, count = keys_buf.len // self.key_size
+        try:
+            assert keys_buf.len % self.key_size == 0
+            self._migrate(count)
+            result = [False] * count
+            for i in range(count):
+                result[i] = hashindex_get(self.index, <unsigned char *>batch_key(
+                    self.index, <const unsigned char *>keys_buf.buf, i, count, self.key_size)) != NULL
+            return result
+        finally:
+            PyBuffer_Release(&keys_buf)
+
 
 cdef class FuseVersionsIndex(IndexBase):
     # 4 byte version + 16 byte file contents hash
@@ -181,6 +265,7 @@ cdef class FuseVersionsIndex(IndexBase):
     def __getitem__(self, key):
         cdef FuseVersionsElement *data
         assert len(key) == self.key_size
+        self._migrate(1)
         data = <FuseVersionsElement *>hashindex_get(self.index, <unsigned char *>key)
         if data == NULL:
             raise KeyError(key)
@@ -200,6 +285,7 @@ cdef class FuseVersionsIndex(IndexBase):
 
     def __contains__(self, key):
         assert len(key) == self.key_size
+        self._migrate(1)
         return hashindex_get(self.index, <unsigned char *>key) != NULL
 
 
@@ -212,6 +298,7 @@ cdef class NSIndex(IndexBase):
 
     def __getitem__(self, key):
         assert len(key) == self.key_size
+        self._migrate(1)
         data = <uint32_t *>hashindex_get(self.index, <unsigned char *>key)
         if not data:
             raise KeyError(key)
@@ -219,6 +306,17 @@ cdef class NSIndex(IndexBase):
         assert segment <= _MAX_VALUE, "maximum number of segments reached"
         return NSIndexEntry(segment, _le32toh(data[1]), _le32toh(data[2]))
 
+    def get(self, key, default=None):
+        # like IndexBase.get, but without raising (and catching) a KeyError for a missing key.
+        assert len(key) == self.key_size
+        self._migrate(1)
+        data = <uint32_t *>hashindex_get(self.index, <unsigned char *>key)
+        if not data:
+            return default
+        cdef uint32_t segment = _le32toh(data[0])
+        assert segment <= _MAX_VALUE, "maximum number of segments reached"
+        return NSIndexEntry(segment, _le32toh(data[1]), _le32toh(data[2]))
+
     def __setitem__(self, key, value):
         assert len(key) == self.key_size
         cdef uint32_t[4] data
@@ -234,17 +332,40 @@ cdef class NSIndex(IndexBase):
     def __contains__(self, key):
         cdef uint32_t segment
         assert len(key) == self.key_size
+        self._migrate(1)
         data = <uint32_t *>hashindex_get(self.index, <unsigned char *>key)
         if data != NULL:
             segment = _le32toh(data[0])
             assert segment <= _MAX_VALUE, "maximum number of segments reached"
         return data != NULL
 
+    def get_many(self, keys):
+        """Return a list with the NSIndexEntry (or None, if missing) for each of the concatenated *keys*."""
+        cdef Py_buffer keys_buf = ro_buffer(keys)
+        cdef Py_ssize_t i, count = keys_buf.len // self.key_size
+        cdef const uint32_t *data
+        cdef uint32_t segment
+        try:
+            assert keys_buf.len % self.key_size == 0
+            self._migrate(count)
+            result = [None] * count
+            for i in range(count):
+                data = <const uint32_t *>hashindex_get(self.index, <unsigned char *>batch_key(
+                    self.index, <const unsigned char *>keys_buf.buf, i, count, self.key_size))
+                if data != NULL:
+                    segment = _le32toh(data[0])
+                    assert segment <= _MAX_VALUE, "maximum number of segments reached"
+                    result[i] = NSIndexEntry(segment, _le32toh(data[1]), _le32toh(data[2]))
+            return result
+        finally:
+            PyBuffer_Release(&keys_buf)
+
     def iteritems(self, marker=None, mask=0, value=0):
         """iterate over all items or optionally only over items having specific flag values"""
         cdef const unsigned char *key
         assert isinstance(mask, int)
         assert isinstance(value, int)
+        self._migrate_all()
         iter = NSKeyIterator(self.key_size, mask, value)
         iter.idx = self
         iter.index = self.index
@@ -255,10 +376,29 @@ cdef class NSIndex(IndexBase):
             iter.key = key - self.key_size
         return iter
 
+    def part_keys(self, part, parts, mask=0, value=0):
+        """
+        Return the concatenated keys in the *part*-th of *parts* (0 <= part < parts) slices of the hash table,
+        optionally only of items having specific flag values.
+
+        Together, the parts contain every key exactly once (if the index is not modified meanwhile), in iteritems
+        order. Unlike iterating with a marker, getting a part does not depend on the previous one.
+        """
+        cdef int64_t count
+        assert 0 <= part < parts
+        assert isinstance(mask, int)
+        assert isinstance(value, int)
+        self._migrate_all()
+        keys = PyBytes_FromStringAndSize(NULL, hashindex_part_size(self.index, parts) * self.key_size)
+        count = hashindex_part_keys(self.index, part, parts, <unsigned char *>PyBytes_AS_STRING(keys),
+                                    3 * sizeof(uint32_t), mask, value)
+        return keys[:count * self.key_size]
+
     def flags(self, key, mask=0xFFFFFFFF, value=None):
         """query and optionally set flags"""
         assert len(key) == self.key_size
         assert isinstance(mask, int)
+        self._migrate(1)
         data = <uint32_t *>hashindex_get(self.index, <unsigned char *>key)
         if not data:
             raise KeyError(key)
@@ -317,6 +457,7 @@ cdef class NSIndex1(IndexBase):  # legacy borg 1.x
 
     def __getitem__(self, key):
         assert len(key) == self.key_size
+        self._migrate(1)
         data = <uint32_t *>hashindex_get(self.index, <unsigned char *>key)
         if not data:
             raise KeyError(key)
@@ -337,6 +478,7 @@ cdef class NSIndex1(IndexBase):  # legacy borg 1.x
     def __contains__(self, key):
         cdef uint32_t segment
         assert len(key) == self.key_size
+        self._migrate(1)
         data = <uint32_t *>hashindex_get(self.index, <unsigned char *>key)
         if data != NULL:
             segment = _le32toh(data[0])
@@ -346,6 +488,7 @@ cdef class NSIndex1(IndexBase):  # legacy borg 1.x
     def iteritems(self, marker=None, mask=0, value=0):
         cdef const unsigned char *key
         assert mask == 0 and value == 0, "using mask/value is not supported for old index"
+        self._migrate_all()
         iter = NSKeyIterator1(self.key_size)
         iter.idx = self
         iter.index = self.index
@@ -391,6 +534,183 @@ cdef class NSKeyIterator1:  # legacy borg 1.x
 ChunkIndexEntry = namedtuple('ChunkIndexEntry', 'refcount size')
 
 
+"""
+Sorted chunk index format, used for the archive chunk indexes in chunks.archive.d.
+
+The entries are stored in ascending key order, in blocks of up to SORTED_BLOCK_ENTRIES entries::
+
+    header: magic "BORG_SCI", version (uint8), key size (uint8), 6 reserved bytes, number of entries (uint64)
+    blocks: number of entries, size of the keys part, size of the values part (uint32 each), keys, values
+
+In the keys part, each key is stored as the length of the prefix it shares with the previous key of the
+block (uint8), followed by the rest of the key. The values part is zlib compressed, it contains the
+refcounts of all entries, then their sizes, as LEB128 varints. All integers are little endian.
+
+As the keys are sorted, any number of such indexes can be merged by a streaming k-way merge.
+"""
+
+SORTED_MAGIC = b'BORG_SCI'
+SORTED_HEADER = struct.Struct('<8sBB6xQ')
+SORTED_BLOCK_HEADER = struct.Struct('<III')
+
+cdef enum:
+    SORTED_VERSION = 1
+    SORTED_BLOCK_ENTRIES = 4096
+    VARINT_MAX_LEN = 5  # LEB128 of an uint32_t
+
+
+cdef inline Py_ssize_t write_varint(unsigned char *p, uint32_t value) noexcept:
+    cdef Py_ssize_t n = 0
+    while value >= 0x80:
+        p[n] = (value & 0x7f) | 0x80
+        value >>= 7
+        n += 1
+    p[n] = value
+    return n + 1
+
+
+cdef inline bint read_varint(const unsigned char *p, Py_ssize_t end, Py_ssize_t *pos, uint32_t *value) noexcept:
+    cdef uint64_t result = 0
+    cdef int shift = 0
+    cdef unsigned char b
+    while pos[0] < end and shift < 7 * VARINT_MAX_LEN:
+        b = p[pos[0]]
+        pos[0] += 1
+        result |= <uint64_t>(b & 0x7f) << shift
+        if not b & 0x80:
+            if result > UINT32_MAX:
+                return False
+            value[0] = <uint32_t>result
+            return True
+        shift += 7
+    return False
+
+
+@cython.internal
+cdef class SortedIndexReader:
+    """Decode the entries of a sorted chunk index (in a bytes-like object) block by block."""
+    cdef Py_buffer data
+    cdef int key_size
+    cdef Py_ssize_t pos
+    cdef uint64_t remaining  # entries not decoded yet, according to the header
+    cdef unsigned char *keys  # keys of the current block
+    cdef uint32_t *values  # (refcount, size) pairs of the current block, little endian like in the buckets
+    cdef int count, current
+
+    def __cinit__(self, data, int key_size):
+        self.data = ro_buffer(data)
+        self.key_size = key_size
+        self.count = self.current = 0
+        self.keys = <unsigned char *> malloc(SORTED_BLOCK_ENTRIES * key_size)
+        self.values = <uint32_t *> malloc(SORTED_BLOCK_ENTRIES * 2 * sizeof(uint32_t))
+        if not self.keys or not self.values:
+            raise MemoryError
+        if self.data.len < SORTED_HEADER.size:
+            raise ValueError('sorted chunk index: truncated header')
+        magic, version, header_key_size, self.remaining = SORTED_HEADER.unpack_from(
+            (<const char *> self.data.buf)[:SORTED_HEADER.size])
+        if magic != SORTED_MAGIC:
+            raise ValueError(f'sorted chunk index: unknown magic {magic!r}')
+        if version != SORTED_VERSION or header_key_size != key_size:
+            raise ValueError(f'sorted chunk index: unsupported version {version} or key size {header_key_size}')
+        self.pos = SORTED_HEADER.size
+
+    def __dealloc__(self):
+        free(self.keys)
+        free(self.values)
+        PyBuffer_Release(&self.data)
+
+    cdef int advance(self) except -1:
+        """Go to the next entry, return 0 if there is none."""
+        self.current += 1
+        if self.current < self.count:
+            return 1
+        return self.read_block()
+
+    cdef inline const unsigned char *key(self) noexcept:
+        return self.keys + self.current * self.key_size
+
+    cdef inline const uint32_t *value(self) noexcept:
+        return self.values + 2 * self.current
+
+    cdef int read_block(self) except -1:
+        cdef const unsigned char *buf = <const unsigned char *> self.data.buf
+        cdef const unsigned char *p
+        cdef Py_ssize_t end, pos
+        cdef Py_ssize_t count, keys_len, values_len
+        cdef uint32_t value
+        cdef int i, j, prefix
+        if self.pos == self.data.len:
+            if self.remaining:
+                raise ValueError('sorted chunk index: truncated')
+            self.count = self.current = 0
+            return 0
+        if self.data.len - self.pos < SORTED_BLOCK_HEADER.size:
+            raise ValueError('sorted chunk index: truncated block header')
+        count, keys_len, values_len = SORTED_BLOCK_HEADER.unpack_from(
+            (<const char *> buf + self.pos)[:SORTED_BLOCK_HEADER.size])
+        self.pos += SORTED_BLOCK_HEADER.size
+        if not 0 < count <= SORTED_BLOCK_ENTRIES or <uint64_t> count > self.remaining or \
+                keys_len + values_len > self.data.len - self.pos:
+            raise ValueError('sorted chunk index: invalid block header')
+        # keys
+        p = buf + self.pos
+        end = keys_len
+        pos = 0
+        for i in range(count):
+            if pos >= end:
+                raise ValueError('sorted chunk index: truncated keys')
+            prefix = p[pos]
+            pos += 1
+            if prefix > self.key_size or (i == 0 and prefix) or end - pos < self.key_size - prefix:
+                raise ValueError('sorted chunk index: invalid key')
+            if prefix:
+                memcpy(self.keys + i * self.key_size, self.keys + (i - 1) * self.key_size, prefix)
+            memcpy(self.keys + i * self.key_size + prefix, p + pos, self.key_size - prefix)
+            pos += self.key_size - prefix
+        self.pos += keys_len
+        # values
+        try:
+            values = zlib.decompress((<const char *> buf + self.pos)[:values_len])
+        except zlib.error as err:
+            raise ValueError(f'sorted chunk index: {err}') from None
+        self.pos += values_len
+        p = <const unsigned char *> PyBytes_AS_STRING(values)
+        end = PyBytes_GET_SIZE(values)
+        pos = 0
+        for j in range(2):
+            for i in range(count):
+                if not read_varint(p, end, &pos, &value):
+                    raise ValueError('sorted chunk index: invalid value')
+                self.values[2 * i + j] = _htole32(value)
+        self.remaining -= count
+        self.count = count
+        self.current = 0
+        return 1
+
+
+cdef inline bint reader_less(const unsigned char **keys, int a, int b, int key_size) noexcept:
+    """order of the readers in the merge heap: by current key, then by position (so later sources come later)"""
+    cdef int c = memcmp(keys[a], keys[b], key_size)
+    return c < 0 or (c == 0 and a < b)
+
+
+cdef void heap_sift_down(int *heap, int n, int i, const unsigned char **keys, int key_size) noexcept:
+    cdef int child, tmp
+    while True:
+        child = 2 * i + 1
+        if child >= n:
+            break
+        if child + 1 < n and reader_less(keys, heap[child + 1], heap[child], key_size):
+            child += 1
+        if not reader_less(keys, heap[child], heap[i], key_size):
+            break
+        tmp = heap[i]
+        heap[i] = heap[child]
+        heap[child] = tmp
+        i = child
+
+
 cdef class ChunkIndex(IndexBase):
     """
     Mapping of 32 byte keys to (refcount, size), which are all 32-bit unsigned.
@@ -412,6 +732,7 @@ cdef class ChunkIndex(IndexBase):
 
     def __getitem__(self, key):
         assert len(key) == self.key_size
+        self._migrate(1)
         data = <uint32_t *>hashindex_get(self.index, <unsigned char *>key)
         if not data:
             raise KeyError(key)
@@ -419,6 +740,18 @@ cdef class ChunkIndex(IndexBase):
         assert refcount <= _MAX_VALUE, "invalid reference count"
         return ChunkIndexEntry(refcount, _le32toh(data[1]))
 
+    def get(self, key, default=None):
+        # like IndexBase.get, but without raising (and catching) a KeyError for a missing key:
+        # when backing up new data, most lookups are misses.
+        assert len(key) == self.key_size
+        self._migrate(1)
+        data = <uint32_t *>hashindex_get(self.index, <unsigned char *>key)
+        if not data:
+            return default
+        cdef uint32_t refcount = _le32toh(data[0])
+        assert refcount <= _MAX_VALUE, "invalid reference count"
+        return ChunkIndexEntry(refcount, _le32toh(data[1]))
+
     def __setitem__(self, key, value):
         assert len(key) == self.key_size
         cdef uint32_t[2] data
@@ -431,6 +764,7 @@ cdef class ChunkIndex(IndexBase):
 
     def __contains__(self, key):
         assert len(key) == self.key_size
+        self._migrate(1)
         data = <uint32_t *>hashindex_get(self.index, <unsigned char *>key)
         if data != NULL:
             assert _le32toh(data[0]) <= _MAX_VALUE, "invalid reference count"
@@ -439,6 +773,7 @@ cdef class ChunkIndex(IndexBase):
     def incref(self, key):
         """Increase refcount for 'key', return (refcount, size)"""
         assert len(key) == self.key_size
+        self._migrate(1)
         data = <uint32_t *>hashindex_get(self.index, <unsigned char *>key)
         if not data:
             raise KeyError(key)
@@ -452,6 +787,7 @@ cdef class ChunkIndex(IndexBase):
     def decref(self, key):
         """Decrease refcount for 'key', return (refcount, size)"""
         assert len(key) == self.key_size
+        self._migrate(1)
         data = <uint32_t *>hashindex_get(self.index, <unsigned char *>key)
         if not data:
             raise KeyError(key)
@@ -463,8 +799,109 @@ cdef class ChunkIndex(IndexBase):
         data[0] = _htole32(refcount)
         return refcount, _le32toh(data[1])
 
+    def get_many(self, keys):
+        """Return a list with the ChunkIndexEntry (or None, if missing) for each of the concatenated *keys*."""
+        cdef Py_buffer keys_buf = ro_buffer(keys)
+        cdef Py_ssize_t i, count = keys_buf.len // self.key_size
+        cdef const uint32_t *data
+        cdef uint32_t refcount
+        try:
+            assert keys_buf.len % self.key_size == 0
+            self._migrate(count)
+            result = [None] * count
+            for i in range(count):
+                data = <const uint32_t *>hashindex_get(self.index, <unsigned char *>batch_key(
+                    self.index, <const unsigned char *>keys_buf.buf, i, count, self.key_size))
+                if data != NULL:
+                    refcount = _le32toh(data[0])
+                    assert refcount <= _MAX_VALUE, "invalid reference count"
+                    result[i] = ChunkIndexEntry(refcount, _le32toh(data[1]))
+            return result
+        finally:
+            PyBuffer_Release(&keys_buf)
+
+    def set_many(self, keys, value):
+        """Set each of the concatenated *keys* to the same (refcount, size) *value*."""
+        cdef Py_buffer keys_buf = ro_buffer(keys)
+        cdef Py_ssize_t i, count = keys_buf.len // self.key_size
+        cdef uint32_t[2] data
+        cdef uint32_t refcount = value[0]
+        assert refcount <= _MAX_VALUE, "invalid reference count"
+        data[0] = _htole32(refcount)
+        data[1] = _htole32(value[1])
+        try:
+            assert keys_buf.len % self.key_size == 0
+            for i in range(count):
+                if not hashindex_set(self.index, <unsigned char *>batch_key(
+                        self.index, <const unsigned char *>keys_buf.buf, i, count, self.key_size), data):
+                    raise Exception('hashindex_set failed')
+        finally:
+            PyBuffer_Release(&keys_buf)
+
+    def incref_many(self, keys):
+        """
+        Increase the refcount of each of the concatenated *keys*, in order.
+
+        Return a list with (refcount, size) for each key, like incref, or None for keys which are not in the
+        index (which are skipped).
+        """
+        cdef Py_buffer keys_buf = ro_buffer(keys)
+        cdef Py_ssize_t i, count = keys_buf.len // self.key_size
+        cdef uint32_t *data
+        cdef uint32_t refcount
+        try:
+            assert keys_buf.len % self.key_size == 0
+            self._migrate(count)
+            result = [None] * count
+            for i in range(count):
+                data = <uint32_t *>hashindex_get(self.index, <unsigned char *>batch_key(
+                    self.index, <const unsigned char *>keys_buf.buf, i, count, self.key_size))
+                if data != NULL:
+                    refcount = _le32toh(data[0])
+                    assert refcount <= _MAX_VALUE, "invalid reference count"
+                    if refcount != _MAX_VALUE:
+                        refcount += 1
+                    data[0] = _htole32(refcount)
+                    result[i] = refcount, _le32toh(data[1])
+            return result
+        finally:
+            PyBuffer_Release(&keys_buf)
+
+    def decref_many(self, keys):
+        """
+        Decrease the refcount of each of the concatenated *keys*, in order.
+
+        Return a list with (refcount, size) for each key, like decref, or None for keys which are not in the
+        index or already have a refcount of zero (which are skipped). So if a key occurs more than once and
+        its refcount drops to zero, its later occurrences give None, as if it had been deleted meanwhile.
+        """
+        cdef Py_buffer keys_buf = ro_buffer(keys)
+        cdef Py_ssize_t i, count = keys_buf.len // self.key_size
+        cdef uint32_t *data
+        cdef uint32_t refcount
+        try:
+            assert keys_buf.len % self.key_size == 0
+            self._migrate(count)
+            result = [None] * count
+            for i in range(count):
+                data = <uint32_t *>hashindex_get(self.index, <unsigned char *>batch_key(
+                    self.index, <const unsigned char *>keys_buf.buf, i, count, self.key_size))
+                if data != NULL:
+                    refcount = _le32toh(data[0])
+                    assert refcount <= _MAX_VALUE, "invalid reference count"
+                    if refcount == 0:
+                        continue
+                    if refcount != _MAX_VALUE:
+                        refcount -= 1
+                    data[0] = _htole32(refcount)
+                    result[i] = refcount, _le32toh(data[1])
+            return result
+        finally:
+            PyBuffer_Release(&keys_buf)
+
     def iteritems(self, marker=None):
         cdef const unsigned char *key
+        self._migrate_all()
         iter = ChunkKeyIterator(self.key_size)
         iter.idx = self
         iter.index = self.index
@@ -565,6 +1002,165 @@ cdef class ChunkIndex(IndexBase):
                 break
             self._add(key, <uint32_t*> (key + self.key_size))
 
+    def write_sorted(self, fd):
+        """
+        Write this index in the sorted chunk index format to the file object *fd*, return the number of bytes written.
+
+        The result is a lot smaller than the hash table written by write(), even if compacted.
+        """
+        cdef unsigned char **keys = hashindex_sorted_keys(self.index)
+        cdef int64_t count = hashindex_len(self.index)
+        cdef int64_t start, i, n
+        cdef unsigned char *keys_buf = NULL
+        cdef unsigned char *values_buf = NULL
+        cdef const unsigned char *key
+        cdef const unsigned char *previous
+        cdef Py_ssize_t keys_len, values_len
+        cdef int prefix, j
+        if not keys:
+            raise MemoryError
+        try:
+            keys_buf = <unsigned char *> malloc(SORTED_BLOCK_ENTRIES * (1 + self.key_size))
+            values_buf = <unsigned char *> malloc(SORTED_BLOCK_ENTRIES * 2 * VARINT_MAX_LEN)
+            if not keys_buf or not values_buf:
+                raise MemoryError
+            header = SORTED_HEADER.pack(SORTED_MAGIC, SORTED_VERSION, self.key_size, count)
+            fd.write(header)
+            written = len(header)
+            for start in range(0, count, SORTED_BLOCK_ENTRIES):
+                n = min(SORTED_BLOCK_ENTRIES, count - start)
+                keys_len = values_len = 0
+                previous = NULL
+                for i in range(n):
+                    key = keys[start + i]
+                    prefix = 0
+                    if previous:
+                        while prefix < self.key_size and key[prefix] == previous[prefix]:
+                            prefix += 1
+                    keys_buf[keys_len] = prefix
+                    memcpy(keys_buf + keys_len + 1, key + prefix, self.key_size - prefix)
+                    keys_len += 1 + self.key_size - prefix
+                    previous = key
+                for j in range(2):
+                    for i in range(n):
+                        key = keys[start + i]
+                        values_len += write_varint(values_buf + values_len,
+                                                   _le32toh((<const uint32_t *> (key + self.key_size))[j]))
+                values = zlib.compress(values_buf[:values_len])
+                block = SORTED_BLOCK_HEADER.pack(n, keys_len, len(values)) + keys_buf[:keys_len] + values
+                fd.write(block)
+                written += len(block)
+            return written
+        finally:
+            free(keys)
+            free(keys_buf)
+            free(values_buf)
+
+    def merge_sorted(self, sources):
+        """
+        Merge indexes in the sorted chunk index format (bytes-like objects, see write_sorted) into this index,
+        same result as reading and merging them one after the other.
+
+        This is a k-way merge, so every key is merged into this index only once, no matter how many of the
+        sources contain it. Raises ValueError if a source is corrupted.
+        """
+        cdef int num_readers, n, i
+        cdef Py_ssize_t pending = 0
+        cdef const unsigned char **keys = NULL
+        cdef int *heap = NULL
+        cdef unsigned char *merged = NULL  # merged entries (key, refcount, size), not added to this index yet
+        cdef unsigned char *entry
+        cdef uint64_t refcount
+        cdef uint32_t source_refcount
+        cdef SortedIndexReader reader
+        cdef list readers = [SortedIndexReader(source, self.key_size) for source in sources]
+        num_readers = len(readers)
+        try:
+            keys = <const unsigned char **> malloc(max(num_readers, 1) * sizeof(unsigned char *))
+            heap = <int *> malloc(max(num_readers, 1) * sizeof(int))
+            merged = <unsigned char *> malloc(SORTED_BLOCK_ENTRIES * (self.key_size + 8))
+            if not keys or not heap or not merged:
+                raise MemoryError
+            n = 0
+            for i in range(num_readers):
+                reader = <SortedIndexReader> readers[i]
+                if reader.advance():
+                    keys[i] = reader.key()
+                    heap[n] = i
+                    n += 1
+            for i in reversed(range(n // 2)):
+                heap_sift_down(heap, n, i, keys, self.key_size)
+            while n:
+                entry = merged + pending * (self.key_size + 8)
+                memcpy(entry, keys[heap[0]], self.key_size)
+                refcount = 0
+                while n and memcmp(keys[heap[0]], entry, self.key_size) == 0:
+                    i = heap[0]
+                    reader = <SortedIndexReader> readers[i]
+                    source_refcount = _le32toh(reader.value()[0])
+                    assert source_refcount <= _MAX_VALUE, "invalid reference count"
+                    refcount += source_refcount
+                    (<uint32_t *> (entry + self.key_size))[1] = reader.value()[1]
+                    if reader.advance():
+                        keys[i] = reader.key()
+                    else:
+                        n -= 1
+                        heap[0] = heap[n]
+                    heap_sift_down(heap, n, 0, keys, self.key_size)
+                (<uint32_t *> (entry + self.key_size))[0] = _htole32(min(refcount, _MAX_VALUE))
+                pending += 1
+                if pending == SORTED_BLOCK_ENTRIES or not n:
+                    self._add_entries(merged, pending)
+                    pending = 0
+        finally:
+            free(keys)
+            free(heap)
+            free(merged)
+
+    cdef _add_entries(self, const unsigned char *entries, Py_ssize_t count):
+        """_add all *count* concatenated (key, refcount, size) *entries*, prefetching like the *_many methods"""
+        cdef Py_ssize_t i
+        cdef int rc
+        cdef const unsigned char *key
+        for i in range(count):
+            if i + PREFETCH_AHEAD < count:
+                hashindex_prefetch(self.index, entries + (i + PREFETCH_AHEAD) * (self.key_size + 8))
+            key = entries + i * (self.key_size + 8)
+            rc = hashindex_merge_entry(self.index, key, <const uint32_t *> (key + self.key_size), _MAX_VALUE)
+            assert rc != -1, "invalid reference count"
+            if not rc:
+                raise Exception('hashindex_set failed')
+
+    def merge_many(self, indexes, int threads=1):
+        """
+        Merge all ChunkIndexes in *indexes* into this index, same result as merging them one after the other.
+
+        With *threads* > 1, the work is split by key over that many threads (not holding the GIL),
+        the given indexes are only read by them, so mmapped ones are fine.
+        """
+        cdef HashIndex **sources
+        cdef int i, rc
+        indexes = list(indexes)
+        for other in indexes:
+            if not isinstance(other, ChunkIndex):
+                raise TypeError('merge_many needs ChunkIndex instances')
+            if other is self:
+                raise ValueError('can not merge an index into itself')
+            if (<ChunkIndex>other).key_size != self.key_size:
+                raise ValueError('key sizes do not match')
+        sources = <HashIndex **> malloc(max(len(indexes), 1) * sizeof(HashIndex *))
+        if not sources:
+            raise MemoryError
+        try:
+            for i, other in enumerate(indexes):
+                sources[i] = (<ChunkIndex>other).index
+            rc = hashindex_merge_many(self.index, sources, len(indexes), _MAX_VALUE, threads)
+        finally:
+            free(sources)
+        assert rc != -1, "invalid reference count"
+        if not rc:
+            raise Exception('hashindex_merge_many failed')
+
 
 cdef class ChunkKeyIterator:
     cdef ChunkIndex idx
@@ -594,21 +1190,372 @@ cdef class ChunkKeyIterator:
         return (<char *>self.key)[:self.key_size], ChunkIndexEntry(refcount, _le32toh(value[1]))
 
 
-cdef Py_buffer ro_buffer(object data) except *:
-    cdef Py_buffer view
-    PyObject_GetBuffer(data, &view, PyBUF_SIMPLE)
-    return view
+# note: cmtime is either a ctime or a mtime (nanoseconds), chunks is a list of (id, size)
+FileCacheEntry = namedtuple('FileCacheEntry', 'age inode size cmtime chunks')
+
+
+"""
+Files cache format, used for cache/files.
+
+    header: magic "BORG_FCI", version (uint8), key size (uint8), padding size (uint8), 1 reserved byte,
+            generation (uint32), number of chunk list entries (uint64)
+    chunk lists: chunk id (32 bytes), chunk size (uint32)
+    padding: zero bytes, so the hash table starts at a multiple of 8 bytes (its values are used in place)
+    hash table: as written by hashindex_write, the values are FilesCacheValue
+
+All integers are little endian. The chunk lists and the hash table are memory mapped when reading, so
+opening the files cache does not depend on the number of files in it.
+
+The generation is incremented each time the files cache is read, entries store the generation they were
+last seen in, the age of an entry is the difference. This way, no entry needs to be touched to age it.
+"""
+
+FILES_CACHE_MAGIC = b'BORG_FCI'
+FILES_CACHE_HEADER = struct.Struct('<8sBBBxIQ')
+
+cdef enum:
+    FILES_CACHE_VERSION = 2
+    FILES_CACHE_BLOCK_ENTRIES = 4096  # chunk list entries written at once
+    CHUNK_ID_SIZE = 32
+    CHUNK_ENTRY_SIZE = CHUNK_ID_SIZE + 4
+
+ctypedef struct FilesCacheValue:
+    uint32_t chunks_count  # first, as the hash table uses the first 4 value bytes for signalling
+    uint32_t seen  # generation
+    uint64_t inode
+    uint64_t size
+    uint64_t cmtime
+    uint64_t chunks_offset  # in chunk list entries
+
+ctypedef struct FilesCacheOffsets:
+    int key_size
+    uint64_t offset
+    uint32_t generation
+    uint32_t ttl
+    int64_t newest_cmtime
+
+
+cdef files_cache_padding(chunks):
+    """number of zero bytes between the chunk lists and the hash table of a files cache"""
+    return -(FILES_CACHE_HEADER.size + chunks * CHUNK_ENTRY_SIZE) % 8
+
+
+cdef inline bint files_cache_keep(const FilesCacheValue *value, uint32_t generation, uint32_t ttl,
+                                  int64_t newest_cmtime) noexcept nogil:
+    """whether to write an entry to the files cache, see FilesCacheIndex.write"""
+    cdef uint32_t age = generation - _le32toh(value.seen)
+    return age == 0 and <int64_t> _le64toh(value.cmtime) < newest_cmtime or 0 < age < ttl
+
+
+cdef int files_cache_pack_offset(void *ctx, unsigned char *bucket) noexcept nogil:
+    """
+    set the chunk list offset of an entry to where FilesCacheIndex.write puts its chunk list,
+    return 0 if the entry is not kept
+    """
+    cdef FilesCacheOffsets *offsets = <FilesCacheOffsets *> ctx
+    cdef FilesCacheValue *value = <FilesCacheValue *> (bucket + offsets.key_size)
+    if not files_cache_keep(value, offsets.generation, offsets.ttl, offsets.newest_cmtime):
+        return 0
+    value.chunks_offset = _htole64(offsets.offset)
+    offsets.offset += _le32toh(value.chunks_count)
+    return 1
+
+
+cdef class FilesCacheIndex(IndexBase):
+    """
+    Mapping of 32 byte path hashes to FileCacheEntry.
+
+    The entries have a fixed size, the chunk lists are stored separately: the ones read from the files
+    cache in a copy-on-write memory mapping of it, the ones added later in a contiguous arena. If an entry
+    is replaced, its chunk list space is reused if the new chunk list fits, otherwise that space stays
+    unused until the files cache is written (which only writes the chunk lists still in use).
+    """
+    value_size = sizeof(FilesCacheValue)
+
+    cdef Py_buffer mapped  # chunk lists read from the files cache
+    cdef uint64_t mapped_count  # in chunk list entries, offsets from there on are in the arena
+    cdef unsigned char *arena
+    cdef uint64_t arena_used, arena_allocated  # in chunk list entries
+    cdef uint32_t generation
+
+    def __dealloc__(self):
+        if self.mapped.buf:
+            PyBuffer_Release(&self.mapped)
+        free(self.arena)
+
+    cdef int _reserve(self, uint64_t count) except -1:
+        """make room for *count* more chunk list entries in the arena"""
+        cdef uint64_t allocated = self.arena_allocated or FILES_CACHE_BLOCK_ENTRIES
+        cdef unsigned char *arena
+        if self.arena_used + count <= self.arena_allocated:
+            return 0
+        while allocated < self.arena_used + count:
+            allocated *= 2
+        arena = <unsigned char *> realloc(self.arena, allocated * CHUNK_ENTRY_SIZE)
+        if not arena:
+            raise MemoryError
+        self.arena = arena
+        self.arena_allocated = allocated
+        return 0
+
+    cdef unsigned char *_find_chunks(self, const FilesCacheValue *value) noexcept nogil:
+        """return the chunk list of *value*, NULL if it is empty or not in the mapping or the arena"""
+        cdef uint64_t offset = _le64toh(value.chunks_offset)
+        cdef uint32_t count = _le32toh(value.chunks_count)
+        if count == 0:
+            return NULL
+        if offset < self.mapped_count and count <= self.mapped_count - offset:
+            return <unsigned char *> self.mapped.buf + offset * CHUNK_ENTRY_SIZE
+        offset -= self.mapped_count
+        if offset < self.arena_used and count <= self.arena_used - offset:
+            return self.arena + offset * CHUNK_ENTRY_SIZE
+        return NULL
+
+    cdef unsigned char *_chunks(self, const FilesCacheValue *value) except? NULL:
+        """return the chunk list of *value* (NULL if empty), raise ValueError if it is not in the mapping or the arena"""
+        cdef unsigned char *chunks = self._find_chunks(value)
+        if not chunks and value.chunks_count:
+            raise ValueError('invalid files cache entry')
+        return chunks
+
+    def __getitem__(self, key):
+        assert len(key) == self.key_size
+        self._migrate(1)
+        cdef const FilesCacheValue *value = <const FilesCacheValue *> hashindex_get(self.index, <unsigned char *>key)
+        if not value:
+            raise KeyError(key)
+        cdef uint32_t i, count = _le32toh(value.chunks_count)
+        cdef const unsigned char *chunk = self._chunks(value)
+        chunks = [None] * count
+        for i in range(count):
+            chunks[i] = (PyBytes_FromStringAndSize(<const char *> chunk, CHUNK_ID_SIZE),
+                         _le32toh((<const uint32_t *> (chunk + CHUNK_ID_SIZE))[0]))
+            chunk += CHUNK_ENTRY_SIZE
+        return FileCacheEntry(<uint32_t> (self.generation - _le32toh(value.seen)), _le64toh(value.inode),
+                              _le64toh(value.size), <int64_t> _le64toh(value.cmtime), chunks)
+
+    def __setitem__(self, key, entry):
+        assert len(key) == self.key_size
+        age, inode, size, cmtime, chunks = entry
+        cdef uint32_t seen = self.generation - <uint32_t> age
+        cdef int64_t cmtime_ns = cmtime
+        cdef uint32_t count = len(chunks)
+        cdef FilesCacheValue value
+        cdef const FilesCacheValue *old
+        cdef const unsigned char *id
+        cdef unsigned char *chunk
+        assert count <= _MAX_VALUE, "too many chunks"
+        # put the chunk list behind the used part of the arena first, so a bad chunk leaves everything as it was
+        self._reserve(count)
+        chunk = self.arena + self.arena_used * CHUNK_ENTRY_SIZE
+        for chunk_id, chunk_size in chunks:
+            id = chunk_id
+            assert len(chunk_id) == CHUNK_ID_SIZE
+            memcpy(chunk, id, CHUNK_ID_SIZE)
+            (<uint32_t *> (chunk + CHUNK_ID_SIZE))[0] = _htole32(chunk_size)
+            chunk += CHUNK_ENTRY_SIZE
+        old = <const FilesCacheValue *> hashindex_get(self.index, <unsigned char *>key)
+        if old and _le32toh(old.chunks_count) >= count:
+            value.chunks_offset = old.chunks_offset
+            if count:
+                memcpy(self._chunks(old), self.arena + self.arena_used * CHUNK_ENTRY_SIZE, count * CHUNK_ENTRY_SIZE)
+        else:
+            value.chunks_offset = _htole64(self.mapped_count + self.arena_used)
+            self.arena_used += count
+        value.chunks_count = _htole32(count)
+        value.seen = _htole32(seen)
+        value.inode = _htole64(inode)
+        value.size = _htole64(size)
+        value.cmtime = _htole64(<uint64_t> cmtime_ns)
+        if not hashindex_set(self.index, <unsigned char *>key, &value):
+            raise Exception('hashindex_set failed')
+
+    def __contains__(self, key):
+        assert len(key) == self.key_size
+        self._migrate(1)
+        return hashindex_get(self.index, <unsigned char *>key) != NULL
+
+    def refresh(self, key, inode):
+        """Mark the entry for *key* as seen (age 0) with inode number *inode*, keeping its chunk list."""
+        assert len(key) == self.key_size
+        self._migrate(1)
+        cdef FilesCacheValue *value = <FilesCacheValue *> hashindex_get(self.index, <unsigned char *>key)
+        if not value:
+            raise KeyError(key)
+        value.seen = _htole32(self.generation)
+        value.inode = _htole64(inode)
+
+    def clear(self):
+        super().clear()
+        if self.mapped.buf:
+            PyBuffer_Release(&self.mapped)
+        self.mapped_count = self.arena_used = 0
+
+    def detach(self):
+        """
+        Copy the hash table and chunk lists still used from the file the index was read from into memory
+        and release the memory mapping, so the file can be removed (not permitted on Windows while mapped).
+        """
+        cdef unsigned char *arena
+        if not hashindex_detach_buffer(self.index):
+            raise MemoryError
+        if not self.mapped_count:
+            return
+        # the arena continues the mapped chunk lists, so the chunk list offsets do not change
+        arena = <unsigned char *> malloc((self.mapped_count + self.arena_allocated) * CHUNK_ENTRY_SIZE)
+        if not arena:
+            raise MemoryError
+        memcpy(arena, self.mapped.buf, self.mapped_count * CHUNK_ENTRY_SIZE)
+        if self.arena_used:
+            memcpy(arena + self.mapped_count * CHUNK_ENTRY_SIZE, self.arena, self.arena_used * CHUNK_ENTRY_SIZE)
+        free(self.arena)
+        self.arena = arena
+        self.arena_used += self.mapped_count
+        self.arena_allocated += self.mapped_count
+        self.mapped_count = 0
+        PyBuffer_Release(&self.mapped)
+
+    def size(self):
+        """Return size (bytes) of hash table and chunk lists."""
+        return hashindex_size(self.index) + (self.mapped_count + self.arena_allocated) * CHUNK_ENTRY_SIZE
+
+    @classmethod
+    def read(cls, fd):
+        """
+        Read a files cache from the file object *fd* (an empty file is an empty files cache).
+
+        The chunk lists and hash table get memory mapped if *fd* supports that (see FileLikeWrapper.mmap_read),
+        so the file must not be modified in place while the returned index is in use.
+
+        The age of all entries is incremented by one. Raises ValueError if the data is invalid.
+        """
+        header = fd.read(FILES_CACHE_HEADER.size)
+        if not header:
+            return cls()
+        if len(header) != FILES_CACHE_HEADER.size:
+            raise ValueError('files cache header is truncated')
+        magic, version, key_size, padding, generation, chunks = FILES_CACHE_HEADER.unpack(header)
+        if magic != FILES_CACHE_MAGIC or version != FILES_CACHE_VERSION or key_size != cls._key_size:
+            raise ValueError('unknown files cache format')
+        if padding != files_cache_padding(chunks):
+            raise ValueError('files cache hash table is not aligned')
+        try:
+            mapped = fd.mmap_read(chunks * CHUNK_ENTRY_SIZE)
+        except AttributeError:
+            mapped = bytearray(fd.read(chunks * CHUNK_ENTRY_SIZE))
+        if len(mapped) != chunks * CHUNK_ENTRY_SIZE:
+            raise ValueError('files cache chunk lists are truncated')
+        if fd.read(padding) != bytes(padding):
+            raise ValueError('files cache padding is invalid')
+        cdef FilesCacheIndex index = cls(path=fd, mmap=True)
+        if index.index.key_size != cls._key_size or index.index.value_size != cls.value_size:
+            raise ValueError('unknown files cache format')
+        PyObject_GetBuffer(mapped, &index.mapped, PyBUF_WRITABLE)
+        index.mapped_count = chunks
+        index.generation = generation + 1
+        return index
+
+    def write(self, fd, ttl, newest_cmtime):
+        """
+        Write the files cache to the file object *fd*, return the number of entries written.
+
+        Only entries of files seen in this backup (age 0) that are older than *newest_cmtime* are kept,
+        to avoid issues with filesystem snapshots and cmtime granularity. Entries from older backups are
+        kept while their age is below *ttl*. The other entries are only left out of the file, this index
+        is not modified (it is still used after checkpoints), but it must not be modified while this runs.
+
+        The entries are scanned and their chunk lists collected without holding the GIL, only the writes to
+        *fd* need it.
+        """
+        cdef unsigned char *key = NULL
+        cdef const FilesCacheValue *value
+        cdef uint32_t max_age = ttl
+        cdef int64_t newest = newest_cmtime
+        cdef FilesCacheOffsets offsets
+        cdef uint64_t chunks = 0, n = 0, count
+        cdef int64_t kept = 0
+        cdef uint32_t generation = self.generation
+        cdef int key_size = self.key_size
+        cdef unsigned char *chunk
+        cdef unsigned char *buf = NULL
+        if not hashindex_migrate_all(self.index):
+            raise MemoryError
+        with nogil:
+            while True:
+                key = hashindex_next_key(self.index, key)
+                if not key:
+                    break
+                value = <const FilesCacheValue *> (key + key_size)
+                if files_cache_keep(value, generation, max_age, newest):
+                    chunks += _le32toh(value.chunks_count)
+                    kept += 1
+        padding = files_cache_padding(chunks)
+        fd.write(FILES_CACHE_HEADER.pack(FILES_CACHE_MAGIC, FILES_CACHE_VERSION, self.key_size, padding,
+                                         self.generation, chunks))
+        buf = <unsigned char *> malloc(FILES_CACHE_BLOCK_ENTRIES * CHUNK_ENTRY_SIZE)
+        if not buf:
+            raise MemoryError
+        try:
+            # the chunk lists, in the order of the entries, see hashindex_write_transformed
+            while True:
+                with nogil:
+                    # collect chunk lists until one does not fit into the buffer (or is invalid)
+                    chunk = NULL
+                    while True:
+                        key = hashindex_next_key(self.index, key)
+                        if not key:
+                            break
+                        value = <const FilesCacheValue *> (key + key_size)
+                        if not files_cache_keep(value, generation, max_age, newest) or not value.chunks_count:
+                            continue
+                        count = _le32toh(value.chunks_count)
+                        chunk = self._find_chunks(value)
+                        if not chunk or n + count > FILES_CACHE_BLOCK_ENTRIES:
+                            break
+                        memcpy(buf + n * CHUNK_ENTRY_SIZE, chunk, count * CHUNK_ENTRY_SIZE)
+                        n += count
+                        chunk = NULL
+                if key and not chunk:
+                    raise ValueError('invalid files cache entry')
+                if n:
+                    fd.write(buf[:n * CHUNK_ENTRY_SIZE])
+                    n = 0
+                if not key:
+                    break
+                if count > FILES_CACHE_BLOCK_ENTRIES:
+                    fd.write(chunk[:count * CHUNK_ENTRY_SIZE])
+                else:
+                    memcpy(buf, chunk, count * CHUNK_ENTRY_SIZE)
+                    n = count
+        finally:
+            free(buf)
+        fd.write(bytes(padding))
+        offsets.key_size = self.key_size
+        offsets.offset = 0
+        offsets.generation = self.generation
+        offsets.ttl = max_age
+        offsets.newest_cmtime = newest
+        hashindex_write_transformed(self.index, fd, files_cache_pack_offset, &offsets, kept)
+        return kept
 
 
 cdef class CacheSynchronizer:
+    """
+    Parse msgpacked items fed to it and add the chunks referenced by them to the *chunks* index.
+
+    With *threaded*, the data is parsed by a thread of its own (not holding the GIL), while the caller
+    can go on fetching more data. *chunks* must then not be used until finish() returned.
+    """
     cdef ChunkIndex chunks
     cdef CacheSyncCtx *sync
+    cdef int threaded
 
-    def __cinit__(self, chunks):
+    def __cinit__(self, chunks, threaded=False):
         self.chunks = chunks
         self.sync = cache_sync_init(self.chunks.index)
         if not self.sync:
             raise Exception('cache_sync_init failed')
+        self.threaded = threaded and cache_sync_start(self.sync)
 
     def __dealloc__(self):
         if self.sync:
@@ -617,12 +1564,28 @@ cdef class CacheSynchronizer:
     def feed(self, chunk):
         cdef Py_buffer chunk_buf = ro_buffer(chunk)
         cdef int rc
-        rc = cache_sync_feed(self.sync, chunk_buf.buf, chunk_buf.len)
+        if self.threaded:
+            with nogil:
+                rc = cache_sync_feed(self.sync, chunk_buf.buf, chunk_buf.len)
+        else:
+            rc = cache_sync_feed(self.sync, chunk_buf.buf, chunk_buf.len)
         PyBuffer_Release(&chunk_buf)
         if not rc:
-            error = cache_sync_error(self.sync)
-            if error != NULL:
-                raise ValueError('cache_sync_feed failed: ' + error.decode('ascii'))
+            self._raise_error('cache_sync_feed')
+
+    def finish(self):
+        """Wait until all data fed so far is parsed (only needed with *threaded*)."""
+        cdef int rc
+        with nogil:
+            rc = cache_sync_finish(self.sync)
+        self.threaded = False
+        if not rc:
+            self._raise_error('cache_sync_finish')
+
+    cdef _raise_error(self, what):
+        error = cache_sync_error(self.sync)
+        if error != NULL:
+            raise ValueError(f'{what} failed: ' + error.decode('ascii'))
 
     @property
     def num_files_totals(self):
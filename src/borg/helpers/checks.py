@@ -17,13 +17,13 @@ def check_extension_modules():
     from .. import platform, compress, crypto, item, chunker, hashindex
 
     msg = """The Borg binary extension modules do not seem to be properly installed."""
-    if hashindex.API_VERSION != "1.2_01":
+    if hashindex.API_VERSION != "1.2_09":
         raise RTError(msg)
-    if chunker.API_VERSION != "1.2_01":
+    if chunker.API_VERSION != "1.2_03":
         raise RTError(msg)
-    if compress.API_VERSION != "1.2_02":
+    if compress.API_VERSION != "1.2_03":
         raise RTError(msg)
-    if crypto.low_level.API_VERSION != "1.3_01":
+    if crypto.low_level.API_VERSION != "1.3_02":
         raise RTError(msg)
     if item.API_VERSION != "1.2_01":
         raise RTError(msg)
@@ -145,6 +145,7 @@ class RepositoryServer:  # pragma: no cover
         "flags_many",
         "get",
         "list",
+        "list_packed",
         "scan",
         "negotiate",
         "open",
@@ -981,6 +982,26 @@ def __len__(self):
     def list(self, limit=None, marker=None, mask=0, value=0):
         """actual remoting is done via self.call in the @api decorator"""
 
+    @api(since=parse_version("2.0.0b10"))
+    def list_packed(self, part, parts, mask=0, value=0):
+        """actual remoting is done via self.call in the @api decorator"""
+
+    def list_packed_many(self, parts, mask=0, value=0):
+        # unlike list calls, which need the previous result as marker, these can all be in flight at the same time.
+        if self.server_version < parse_version("2.0.0b10"):
+            # older servers do not have list_packed, page through the IDs using list (the number of parts differs).
+            marker = None
+            while True:
+                result = self.list(limit=LIST_SCAN_LIMIT, marker=marker, mask=mask, value=value)
+                if not result:
+                    break
+                marker = result[-1]
+                yield b"".join(result)
+            return
+        yield from self.call_many(
+            "list_packed", [{"part": part, "parts": parts, "mask": mask, "value": value} for part in range(parts)]
+        )
+
     @api(since=parse_version("2.0.0b3"))
     def scan(self, limit=None, state=None):
         """actual remoting is done via self.call in the @api decorator"""
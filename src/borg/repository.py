@@ -560,7 +560,8 @@ def _read_integrity(self, transaction_id, key):
             return
         return integrity[key]
 
-    def open_index(self, transaction_id, auto_recover=True):
+    def open_index(self, transaction_id, auto_recover=True, readonly=False):
+        # readonly: the index is (probably) only used for lookups, so we memory map it instead of reading it.
         if transaction_id is None:
             return NSIndex()
         index_path = os.path.join(self.path, "index.%d" % transaction_id)
@@ -569,9 +570,9 @@ def open_index(self, transaction_id, auto_recover=True):
         try:
             with IntegrityCheckedFile(index_path, write=False, integrity_data=integrity_data) as fd:
                 if variant == 2:
-                    return NSIndex.read(fd)
+                    return NSIndex.read(fd, mmap=readonly)
                 if variant == 1:  # legacy
-                    return NSIndex1.read(fd)
+                    return NSIndex1.read(fd, mmap=readonly)
         except (ValueError, OSError, FileIntegrityError) as exc:
             logger.warning("Repository index missing or corrupted, trying to recover from: %s", exc)
             os.unlink(index_path)
@@ -580,7 +581,7 @@ def open_index(self, transaction_id, auto_recover=True):
             self.prepare_txn(self.get_transaction_id())
             # don't leave an open transaction around
             self.commit(compact=False)
-            return self.open_index(self.get_transaction_id())
+            return self.open_index(self.get_transaction_id(), readonly=readonly)
 
     def _unpack_hints(self, transaction_id):
         hints_path = os.path.join(self.path, "hints.%d" % transaction_id)
@@ -1224,12 +1225,12 @@ def rollback(self):
 
     def __len__(self):
         if not self.index:
-            self.index = self.open_index(self.get_transaction_id())
+            self.index = self.open_index(self.get_transaction_id(), readonly=True)
         return len(self.index)
 
     def __contains__(self, id):
         if not self.index:
-            self.index = self.open_index(self.get_transaction_id())
+            self.index = self.open_index(self.get_transaction_id(), readonly=True)
         return id in self.index
 
     def list(self, limit=None, marker=None, mask=0, value=0):
@@ -1239,9 +1240,28 @@ def list(self, limit=None, marker=None, mask=0, value=0):
         if mask and value are given, only return IDs where flags & mask == value (default: all IDs).
         """
         if not self.index:
-            self.index = self.open_index(self.get_transaction_id())
+            self.index = self.open_index(self.get_transaction_id(), readonly=True)
         return [id_ for id_, _ in islice(self.index.iteritems(marker=marker, mask=mask, value=value), limit)]
 
+    def list_packed(self, part, parts, mask=0, value=0):
+        """
+        list the IDs in the <part>-th of <parts> (0 <= part < parts) slices of the index - in index (pseudo-random)
+        order, concatenated into one bytes object.
+
+        unlike with list, the call for a part does not depend on the result of the previous one, so the parts can
+        be requested in parallel. all parts together contain each ID exactly once.
+
+        if mask and value are given, only return IDs where flags & mask == value (default: all IDs).
+        """
+        if not self.index:
+            self.index = self.open_index(self.get_transaction_id(), readonly=True)
+        return self.index.part_keys(part, parts, mask=mask, value=value)
+
+    def list_packed_many(self, parts, mask=0, value=0):
+        """yield list_packed(part, parts, mask, value) for all parts, in order"""
+        for part in range(parts):
+            yield self.list_packed(part, parts, mask=mask, value=value)
+
     def scan(self, limit=None, state=None):
         """
         list (the next) <limit> chunk IDs from the repository - in on-disk order, so that a client
@@ -1263,7 +1283,7 @@ def scan(self, limit=None, state=None):
             raise ValueError("please use limit > 0 or limit = None")
         transaction_id = self.get_transaction_id()
         if not self.index:
-            self.index = self.open_index(transaction_id)
+            self.index = self.open_index(transaction_id, readonly=True)
         # smallest valid seg is <uint32> 0, smallest valid offs is <uint32> 8
         start_segment, start_offset, end_segment = state if state is not None else (0, 0, transaction_id)
         ids, segment, offset = [], 0, 0
@@ -1307,7 +1327,7 @@ def flags(self, id, mask=0xFFFFFFFF, value=None):
         :return: (previous) flags value (only masked bits)
         """
         if not self.index:
-            self.index = self.open_index(self.get_transaction_id())
+            self.index = self.open_index(self.get_transaction_id(), readonly=True)
         return self.index.flags(id, mask, value)
 
     def flags_many(self, ids, mask=0xFFFFFFFF, value=None):
@@ -1315,7 +1335,7 @@ def flags_many(self, ids, mask=0xFFFFFFFF, value=None):
 
     def get(self, id, read_data=True):
         if not self.index:
-            self.index = self.open_index(self.get_transaction_id())
+            self.index = self.open_index(self.get_transaction_id(), readonly=True)
         try:
             in_index = NSIndexEntry(*((self.index[id] + (None,))[:3]))  # legacy: index entries have no size element
             return self.io.read(in_index.segment, in_index.offset, id, expected_size=in_index.size, read_data=read_data)
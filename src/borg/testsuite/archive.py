@@ -1,6 +1,7 @@
 import json
 import os
 from collections import OrderedDict
+from concurrent.futures import ThreadPoolExecutor
 from datetime import datetime, timezone
 from io import StringIO
 from unittest.mock import Mock
@@ -8,9 +9,11 @@
 import pytest
 
 from . import rejected_dotdot_paths
+from .hashindex import H
 from ..crypto.key import PlaintextKey
 from ..archive import Archive, CacheChunkBuffer, RobustUnpacker, valid_msgpacked_dict, ITEM_KEYS, Statistics
-from ..archive import BackupOSError, backup_io, backup_io_iter, get_item_uid_gid
+from ..archive import BackupOSError, backup_io, backup_io_iter, get_item_uid_gid, cached_hash_batch
+from ..constants import CH_DATA, CH_HOLE, ROBJ_ARCHIVE_STREAM
 from ..helpers import msgpack
 from ..item import Item, ArchiveItem
 from ..manifest import Manifest
@@ -118,6 +121,43 @@ def test_timestamp_parsing(monkeypatch, isoformat, expected):
     assert a.ts == expected
 
 
+def test_delete_forced_corrupted_item():
+    repository = Mock()
+    key = PlaintextKey(repository)
+    manifest = Manifest(key, repository)
+    archive = Archive(manifest, "test", create=True)
+    items = [
+        {"path": "a", "chunks": [(H(1), 1)]},
+        {"path": "b", "chunks": [(H(2), 2), (H(3), 3)]},
+        {"path": "c", "chunks": [(b"corrupted", 4)]},
+        {"path": "d", "chunks": [(H(4), 4)]},
+    ]
+    data = b"".join(msgpack.packb(item) for item in items)
+    items_id = key.id_hash(data)
+    repository.get_many.return_value = [archive.repo_objs.format(items_id, {}, data, ro_type=ROBJ_ARCHIVE_STREAM)]
+    repository.async_response.return_value = None
+    archive.metadata = ArchiveItem(items=[items_id], item_ptrs=[])
+    archive.id = H(0)
+    manifest.archives["test"] = (archive.id, datetime.now(timezone.utc))
+
+    class DecrefCache:
+        def __init__(self):
+            self.decrefs = []
+
+        def chunk_decref(self, id, size, stats, wait=True):
+            self.decrefs.append(id)
+
+        def chunk_decref_many(self, chunks, stats, wait=True):
+            self.decrefs.extend(id for id, _ in chunks)
+            return []
+
+    archive.cache = DecrefCache()
+    archive.delete(Statistics(), forced=1)
+    # the chunks of the items before the corrupted one are released nevertheless
+    assert archive.cache.decrefs == [items_id, H(1), H(2), H(3), H(0)]
+    assert "test" not in manifest.archives
+
+
 class MockCache:
     class MockRepo:
         def async_response(self, wait=True):
@@ -274,6 +314,18 @@ def test_key_length_msgpacked_items():
     assert valid_msgpacked_dict(msgpack.packb(data), item_keys_serialized)
 
 
+def test_cached_hash_batch():
+    key = PlaintextKey(None)
+    data = os.urandom(3 * 1024 * 1024)
+    boundaries = [(0, 700 * 1024, CH_DATA), (700 * 1024, 1024, CH_HOLE)]
+    boundaries += [(offset, 256 * 1024, CH_DATA) for offset in range(1024 * 1024, len(data), 256 * 1024)]
+    expected = [key.id_hash(data[offset : offset + size]) for offset, size, _ in boundaries]
+    expected[1] = key.id_hash(bytes(1024))
+    assert [id for id, _ in cached_hash_batch(data, boundaries, key)] == expected
+    with ThreadPoolExecutor(max_workers=2) as workers:
+        assert [id for id, _ in cached_hash_batch(data, boundaries, key, workers=workers)] == expected
+
+
 def test_backup_io():
     with pytest.raises(BackupOSError):
         with backup_io:
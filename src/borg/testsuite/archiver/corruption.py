@@ -110,7 +110,7 @@ def test_chunks_archive(archiver):
         pytest.skip("Only LocalCache has a per-archive chunks index cache.")
     assert len(os.listdir(chunks_archive)) == 4  # two archives, one chunks cache and one .integrity file each
 
-    corrupt(os.path.join(chunks_archive, target_id + ".compact"))
+    corrupt(os.path.join(chunks_archive, target_id + ".sorted"))
 
     # Trigger cache sync by changing the manifest ID in the cache config
     config_path = os.path.join(archiver.cache_path, "config")
@@ -260,6 +260,36 @@ def test_create_stdin_checkpointing(archivers, request):
     assert out == input_data
 
 
+def test_create_mmap(archivers, request):
+    archiver = request.getfixturevalue(archivers)
+    input_data = randbytes(3000000)
+    create_regular_file(archiver.input_path, "file1", contents=input_data)
+    create_regular_file(archiver.input_path, "empty", size=0)
+    cmd(archiver, "rcreate", RK_ENCRYPTION)
+    cmd(archiver, "create", "--mmap", "--chunker-params=buzhash,10,16,12,4095", "test", "input")
+    cmd(archiver, "create", "--chunker-params=buzhash,10,16,12,4095", "test2", "input")
+    # same chunks as without --mmap
+    out1 = cmd(archiver, "list", "test", "input/file1", "--format", "{num_chunks}")
+    out2 = cmd(archiver, "list", "test2", "input/file1", "--format", "{num_chunks}")
+    assert int(out1) == int(out2) > 1
+    out = cmd(archiver, "extract", "test", "input/file1", "--stdout", binary_output=True)
+    assert out == input_data
+
+
+def test_create_sparse_buzhash(archivers, request):
+    archiver = request.getfixturevalue(archivers)
+    input_data = randbytes(300000)
+    hole_size = 5 * 1024 * 1024
+    with open(os.path.join(archiver.input_path, "sparse"), "wb") as fd:
+        fd.write(input_data)
+        fd.seek(hole_size, os.SEEK_CUR)
+        fd.write(input_data)
+    cmd(archiver, "rcreate", RK_ENCRYPTION)
+    cmd(archiver, "create", "--sparse", "--chunker-params=buzhash,10,16,12,4095", "test", "input")
+    out = cmd(archiver, "extract", "test", "input/sparse", "--stdout", binary_output=True)
+    assert out == input_data + bytes(hole_size) + input_data
+
+
 def test_create_erroneous_file(archivers, request):
     archiver = request.getfixturevalue(archivers)
     chunk_size = 1000  # fixed chunker with this size, also volume based checkpointing after that volume
@@ -183,6 +183,22 @@ def test_recreate_fixed_rechunkify(archivers, request):
     assert num_chunks == 2
 
 
+def test_recreate_fastcdc_rechunkify(archivers, request):
+    archiver = request.getfixturevalue(archivers)
+    with open(os.path.join(archiver.input_path, "file"), "wb") as fd:
+        fd.write(os.urandom(8192))
+    cmd(archiver, "rcreate", RK_ENCRYPTION)
+    cmd(archiver, "create", "test", "input", "--chunker-params", "fixed,4096")
+    output = cmd(archiver, "list", "test", "input/file", "--format", "{num_chunks}")
+    num_chunks = int(output)
+    assert num_chunks == 2
+    cmd(archiver, "recreate", "--chunker-params", "fastcdc,7,9,8")
+    output = cmd(archiver, "list", "test", "input/file", "--format", "{num_chunks}")
+    num_chunks = int(output)
+    assert num_chunks >= 16  # max. chunk size is 512B
+    check_cache(archiver)
+
+
 def test_recreate_no_rechunkify(archivers, request):
     archiver = request.getfixturevalue(archivers)
     with open(os.path.join(archiver.input_path, "file"), "wb") as fd:
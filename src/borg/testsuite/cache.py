@@ -1,5 +1,8 @@
 import io
 import os.path
+import stat
+import time
+from types import SimpleNamespace
 
 from ..helpers.msgpack import packb
 
@@ -8,9 +11,11 @@
 from .hashindex import H
 from .key import TestKey
 from ..archive import Statistics
-from ..cache import AdHocCache
+from ..constants import ROBJ_FILE_STREAM
+from ..cache import AdHocCache, LocalCache
 from ..crypto.key import AESOCBRepoKey
 from ..hashindex import ChunkIndex, CacheSynchronizer
+from ..item import ChunkListEntry
 from ..manifest import Manifest
 from ..repository import Repository
 
@@ -60,6 +65,21 @@ def test_multiple(self, index, sync):
         assert index[H(2)] == (2, 2)
         assert index[H(3)] == (1, 1)
 
+    @pytest.mark.parametrize("piece_size", [1, 7, 1000])
+    def test_skip_nested(self, index, sync, piece_size):
+        deep = 1
+        for _ in range(20):
+            deep = [deep]
+        nested = [1.5, None, True, {"a": [b"x" * 300, -1, 2**40]}, "s" * 70000, deep]
+        data = packb({"xattrs": {b"user.foo": b"bar" * 100}, "stuff": nested, "chunks": [(H(1), 1)], "more": nested})
+        data += packb({"chunks": [(H(1), 1), (H(2), 2)], "stuff": nested})
+        for i in range(0, len(data), piece_size):
+            sync.feed(data[i : i + piece_size])
+        assert len(index) == 2
+        assert index[H(1)] == (2, 1)
+        assert index[H(2)] == (1, 2)
+        assert sync.num_files_totals == 2
+
     @pytest.mark.parametrize(
         "elem,error",
         (
@@ -160,6 +180,36 @@ def test_refcount_one_below_max_value(self):
         assert index[H(0)] == (ChunkIndex.MAX_VALUE, 1234)
 
 
+    def test_threaded(self, index):
+        sync = CacheSynchronizer(index, threaded=True)
+        items = [{"chunks": [(H(i % 100), i), (H(100 + i % 7), 1)], "foo": "bar"} for i in range(1000)]
+        data = b"".join(packb(item) for item in items)
+        for i in range(0, len(data), 123):
+            sync.feed(data[i : i + 123])
+        sync.finish()
+        assert len(index) == 107
+        assert index[H(1)] == (10, 1)
+        assert index[H(100)] == (143, 1)
+        assert sync.num_files_totals == 1000
+        assert sync.size_totals == sum(i + 1 for i in range(1000))
+
+    def test_threaded_corrupted(self, index):
+        sync = CacheSynchronizer(index, threaded=True)
+        with pytest.raises(ValueError) as excinfo:
+            for _ in range(100):
+                sync.feed(packb({"chunks": [(H(1), 1)]}) + packb({"chunks": {1: 2}}))
+            sync.finish()
+        assert str(excinfo.value).endswith(" failed: Unexpected object: map")
+
+    def test_threaded_read_index(self):
+        index = self.make_index_with_refcount(1)
+        sync = CacheSynchronizer(index, threaded=True)
+        sync.feed(packb({"chunks": [(H(i), 1) for i in range(1000)]}))
+        sync.finish()
+        assert len(index) == 1000
+        assert index[H(0)] == (2, 1234)
+
+
 class TestAdHocCache:
     @pytest.fixture
     def repository(self, tmpdir):
@@ -226,3 +276,114 @@ def test_existing_incref_after_add_chunk(self, cache):
         """This case occurs with part files, see Archive.chunk_file."""
         assert cache.add_chunk(H(1), {}, b"5678", stats=Statistics()) == (H(1), 4)
         assert cache.chunk_incref(H(1), 4, Statistics()) == (H(1), 4)
+
+    def test_worker_threads(self, cache, repository):
+        stats = Statistics()
+        buffer = bytearray(1000)
+        contents = [bytes([i]) * 1000 for i in range(20)]
+        ids = [cache.key.id_hash(data) for data in contents]
+        cache.add_chunk(H(2), {}, contents[0], stats=stats)  # stored synchronously, for comparison
+        with cache.worker_threads(3):
+            for id, data in zip(ids, contents):
+                buffer[:] = data
+                assert cache.add_chunk(id, {}, memoryview(buffer), stats=stats, wait=False) == (id, 1000)
+            buffer[:] = bytes(1000)  # add_chunk must not keep referring to the buffer
+            # pending chunks are known to the cache already, and can be deleted again
+            assert cache.seen_chunk(ids[0]) == 1
+            assert cache.add_chunk(ids[0], {}, contents[0], stats=stats, wait=False) == (ids[0], 1000)
+            cache.chunk_decref(ids[1], 1000, stats)
+            cache.flush_chunks()
+        assert cache.workers is None
+        for id, data in zip(ids, contents):
+            if id == ids[1]:
+                with pytest.raises(Repository.ObjectNotFound):
+                    repository.get(id)
+            else:
+                meta, stored = cache.repo_objs.parse(id, repository.get(id), ro_type=ROBJ_FILE_STREAM)
+                assert stored == data
+                assert meta == cache.repo_objs.parse_meta(H(2), repository.get(H(2)), ro_type=ROBJ_FILE_STREAM)
+
+
+class TestLocalCache:
+    @pytest.fixture
+    def repository(self, tmpdir):
+        with Repository(os.path.join(str(tmpdir), "repository"), exclusive=True, create=True) as repository:
+            yield repository
+
+    @pytest.fixture
+    def manifest(self, repository, monkeypatch):
+        monkeypatch.setenv("BORG_PASSPHRASE", "test")
+        key = AESOCBRepoKey.create(repository, TestKey.MockArgs())
+        Manifest(key, repository).write()
+        return Manifest.load(repository, key=key, operations=Manifest.NO_OPERATION_CHECK)
+
+    @pytest.fixture
+    def cache_path(self, tmpdir):
+        return str(tmpdir.join("cache"))
+
+    @pytest.fixture
+    def cache(self, manifest, cache_path):
+        with LocalCache(manifest, path=cache_path, cache_mode="cis") as cache:
+            yield cache
+
+    @staticmethod
+    def st(ino, ctime):
+        return SimpleNamespace(st_mode=stat.S_IFREG | 0o644, st_ino=ino, st_size=4, st_ctime_ns=ctime)
+
+    def memorize(self, cache):
+        cache.begin_txn()
+        cache.memorize_file(b"foo", H(10), self.st(1, 1000), [ChunkListEntry(H(1), 4)])
+
+    def test_files_cache_commit(self, cache, manifest, cache_path):
+        # without start_commit, commit writes the files cache itself
+        self.memorize(cache)
+        cache.commit()
+        cache.close()
+        with LocalCache(manifest, path=cache_path, cache_mode="cis") as cache:
+            # read with the integrity data recorded by commit (a mismatch would give an empty files cache)
+            assert cache.file_known_and_unchanged(b"foo", H(10), self.st(1, 1000)) == (True, [(H(1), 4)])
+            assert cache.file_known_and_unchanged(b"foo", H(10), self.st(1, 1001)) == (True, None)
+
+    def test_files_cache_commit_win32(self, cache, manifest, cache_path, monkeypatch):
+        # Windows does not permit removing the mapped files cache, the index is detached from it first
+        monkeypatch.setattr("borg.cache.is_win32", True)
+        self.memorize(cache)
+        cache.commit()
+        cache.close()
+        with LocalCache(manifest, path=cache_path, cache_mode="cis") as cache:
+            cache.begin_txn()
+            cache.memorize_file(b"bar", H(11), self.st(2, 1000), [ChunkListEntry(H(2), 4)])
+            cache.memorize_file(b"baz", H(12), self.st(3, 2000), [ChunkListEntry(H(3), 4)])  # newest cmtime
+            cache.commit()
+            assert cache.file_known_and_unchanged(b"foo", H(10), self.st(1, 1000)) == (True, [(H(1), 4)])
+        with LocalCache(manifest, path=cache_path, cache_mode="cis") as cache:
+            assert cache.file_known_and_unchanged(b"foo", H(10), self.st(1, 1000)) == (True, [(H(1), 4)])
+            assert cache.file_known_and_unchanged(b"bar", H(11), self.st(2, 1000)) == (True, [(H(2), 4)])
+
+    def test_files_cache_writer_exception(self, cache, monkeypatch):
+        class WriteError(Exception):
+            pass
+
+        def write_files_cache():
+            raise WriteError
+
+        self.memorize(cache)
+        monkeypatch.setattr(cache, "_write_files_cache", write_files_cache)
+        cache.start_commit()
+        with pytest.raises(WriteError):
+            cache.commit()
+
+    def test_files_cache_writer_close(self, cache, monkeypatch):
+        written = []
+
+        def write_files_cache():
+            time.sleep(0.2)
+            written.append(True)
+
+        self.memorize(cache)
+        monkeypatch.setattr(cache, "_write_files_cache", write_files_cache)
+        cache.start_commit()
+        assert cache._files_cache_writer is not None
+        cache.close()
+        assert written == [True]
+        assert cache._files_cache_writer is None
@@ -1,11 +1,13 @@
 from io import BytesIO
 import os
+import random
 import tempfile
 
 import pytest
 
 from .chunker import cf
-from ..chunker import Chunker, ChunkerFixed, sparsemap, has_seek_hole, ChunkerFailing
+from ..chunker import Chunker, ChunkerFastCDC, ChunkerFixed, sparsemap, has_seek_hole, ChunkerFailing, get_chunker
+from ..chunker import buzhash_scan_kernels, set_buzhash_scan_kernel
 from ..constants import *  # NOQA
 
 BS = 4096  # fs block size
@@ -178,3 +180,297 @@ def test_buzhash_chunksize_distribution():
     # most chunks should be cut due to buzhash triggering, not due to clipping at min/max size:
     assert min_count < 10
     assert max_count < 10
+
+
+@pytest.mark.parametrize("kernel", buzhash_scan_kernels())
+@pytest.mark.parametrize("window_size", [65, 4095, 7351])
+def test_buzhash_scan_kernels_bit_exact(kernel, window_size):
+    # all kernels must cut at exactly the same places as the scalar kernel
+    data = os.urandom(300000) + bytes(70000) + os.urandom(200000)
+
+    def chunk_sizes(kernel, seed, min_exp, max_exp, mask_bits):
+        previous = set_buzhash_scan_kernel(kernel)
+        try:
+            chunker = Chunker(seed, min_exp, max_exp, mask_bits, window_size)
+            return [c.meta["size"] for c in chunker.chunkify(BytesIO(data))]
+        finally:
+            set_buzhash_scan_kernel(previous)
+
+    for seed, min_exp, max_exp, mask_bits in (0, 10, 16, 12), (1234567653, 4, 15, 4), (-1, 6, 17, 1):
+        expected = chunk_sizes("scalar", seed, min_exp, max_exp, mask_bits)
+        assert sum(expected) == len(data)
+        assert chunk_sizes(kernel, seed, min_exp, max_exp, mask_bits) == expected
+
+
+def test_set_buzhash_scan_kernel():
+    assert "scalar" in buzhash_scan_kernels()
+    previous = set_buzhash_scan_kernel("scalar")
+    assert set_buzhash_scan_kernel(previous) == "scalar"
+    with pytest.raises(ValueError):
+        set_buzhash_scan_kernel("nonexistent")
+
+
+@pytest.mark.parametrize("minexp, maxexp, maskbits", [(6, 10, 8), (10, 16, 12), (12, 15, 15), (4, 5, 4)])
+def test_fastcdc_chunk_sizes(minexp, maxexp, maskbits):
+    data = os.urandom(1000000)
+    chunker = ChunkerFastCDC(0, minexp, maxexp, maskbits)
+    chunks = cf(chunker.chunkify(BytesIO(data)))
+    assert b"".join(chunks) == data
+    sizes = [len(c) for c in chunks]
+    assert all(1 << minexp <= size <= 1 << maxexp for size in sizes[:-1])
+    assert 0 < sizes[-1] <= 1 << maxexp
+    if maxexp - minexp >= 4:
+        # normalized chunking: the average chunk size is near the target size
+        average = sum(sizes) / len(sizes)
+        assert (1 << maskbits) / 2 < average < (1 << maskbits) * 2
+
+
+def test_fastcdc_content_defined():
+    rnd = random.Random(0)  # how fast the cutting places resynchronize depends on the data
+    data = rnd.randbytes(500000)
+    chunks1 = cf(ChunkerFastCDC(0, 8, 16, 12).chunkify(BytesIO(data)))
+    chunks2 = cf(ChunkerFastCDC(0, 8, 16, 12).chunkify(BytesIO(rnd.randbytes(1234) + data)))
+    # after inserting data at the beginning, the cutting places resynchronize
+    assert len(set(chunks1) & set(chunks2)) >= len(chunks1) - 3
+    # a different seed gives different cutting places
+    chunks3 = cf(ChunkerFastCDC(1, 8, 16, 12).chunkify(BytesIO(data)))
+    assert chunks1 != chunks3
+
+
+def test_fastcdc_small_and_zeros():
+    assert cf(ChunkerFastCDC(0, 6, 10, 8).chunkify(BytesIO(b""))) == []
+    assert cf(ChunkerFastCDC(0, 6, 10, 8).chunkify(BytesIO(b"foobar"))) == [b"foobar"]
+    # all-zero data is not cut by content, but at max. chunk size
+    chunks = cf(ChunkerFastCDC(0, 6, 10, 8).chunkify(BytesIO(bytes(5000))))
+    assert chunks == [1024] * 4 + [904]
+
+
+@pytest.mark.parametrize(
+    "algo, params, size",
+    [
+        ("buzhash", (10, 16, 12, 4095), 1000000),
+        ("buzhash", (19, 23, 21, 4095), 150000000),  # more than one mmap window
+        ("fastcdc", (10, 16, 12), 1000000),
+        ("fastcdc", (19, 23, 21), 150000000),
+        ("buzhash", (10, 16, 12, 4095), 1000),  # smaller than min. chunk size
+    ],
+)
+def test_chunkify_mmap(tmpdir, algo, params, size):
+    fn = str(tmpdir / "file")
+    with open(fn, "wb") as fd:
+        for i in range(0, size, 1000000):
+            fd.write(os.urandom(min(size - i, 1000000)))
+    with open(fn, "rb") as fd:
+        expected = cf(get_chunker(algo, *params, seed=0).chunkify(fd, fd.fileno()))
+    with open(fn, "rb") as fd:
+        chunks = list(get_chunker(algo, *params, seed=0, use_mmap=True).chunkify(fd, fd.fileno()))
+        # all the chunks are still valid after the chunker moved on
+        assert cf(chunks) == expected
+    del chunks
+
+
+def test_chunkify_mmap_not_mappable(tmpdir):
+    # without a OS-level file handle, mmap mode just reads
+    data = os.urandom(100000)
+    chunker = get_chunker("buzhash", 10, 16, 12, 4095, seed=0, use_mmap=True)
+    assert b"".join(cf(chunker.chunkify(BytesIO(data)))) == data
+    # empty files can not be mmap'd
+    fn = str(tmpdir / "empty")
+    open(fn, "wb").close()
+    with open(fn, "rb") as fd:
+        assert cf(chunker.chunkify(fd, fd.fileno())) == []
+
+
+@pytest.mark.parametrize(
+    "algo, params, readahead, read_size",
+    [
+        ("buzhash", (10, 16, 12, 4095), 1, 1000),
+        ("buzhash", (10, 16, 12, 4095), 4, 65536),
+        ("buzhash", (19, 23, 21, 4095), 4, 2 * 1024 * 1024),
+        ("fastcdc", (10, 16, 12), 2, 12345),
+    ],
+)
+def test_chunkify_readahead(tmpdir, algo, params, readahead, read_size):
+    fn = str(tmpdir / "file")
+    data = os.urandom(20000000)
+    with open(fn, "wb") as fd:
+        fd.write(data)
+    with open(fn, "rb") as fd:
+        expected = cf(get_chunker(algo, *params, seed=0).chunkify(fd, fd.fileno()))
+    chunker = get_chunker(algo, *params, seed=0, readahead=readahead, read_size=read_size)
+    with open(fn, "rb") as fd:
+        assert cf(chunker.chunkify(fd, fd.fileno())) == expected
+    # stop early and close the file, then reuse the chunker
+    with open(fn, "rb") as fd:
+        it = chunker.chunkify(fd, fd.fileno())
+        for _ in zip(range(3), it):
+            pass
+    with open(fn, "rb") as fd:
+        assert cf(chunker.chunkify(fd, fd.fileno())) == expected
+    assert b"".join(expected) == data
+
+
+@pytest.mark.parametrize(
+    "params, threads, kw",
+    [
+        ((10, 16, 12, 4095), 2, {}),
+        ((10, 16, 12, 65), 4, {}),
+        ((6, 17, 15, 7351), 3, {}),  # some chunks cut at max. size
+        ((19, 23, 21, 4095), 8, {}),
+        ((10, 16, 12, 4095), 4, dict(readahead=2, read_size=100000)),
+        ((10, 16, 12, 4095), 4, dict(use_mmap=True)),
+    ],
+)
+def test_chunkify_parallel(tmpdir, monkeypatch, params, threads, kw):
+    from .. import chunker as chunker_module
+
+    monkeypatch.setattr(chunker_module, "PARALLEL_CHUNKING_MIN_SIZE", 0)
+    fn = str(tmpdir / "file")
+    with open(fn, "wb") as fd:
+        fd.write(os.urandom(10000000) + bytes(3000000) + os.urandom(12345) + b"foobar" * 1000000)
+    for size in (None, 70000, 5200, 1100, 100, 0):
+        if size is not None:
+            with open(fn, "r+b") as fd:
+                fd.truncate(size)
+        with open(fn, "rb") as fd:
+            expected = cf(Chunker(0, *params).chunkify(fd, fd.fileno()))
+        with open(fn, "rb") as fd:
+            chunks = cf(Chunker(0, *params, threads=threads, **kw).chunkify(fd, fd.fileno()))
+        assert chunks == expected
+
+
+@pytest.mark.parametrize("block_size", [4096, 1000, 65])
+def test_chunkify_fixed_zero_detection(tmpdir, block_size):
+    # a single non-zero byte anywhere in a block must make it a data block
+    size = 3 * block_size + 17
+    positions = [0, 1, 15, 16, 63, 64, block_size - 1, block_size + 37, size - 1]
+    data = bytearray(size)
+    for pos in positions:
+        data[pos] = 1
+    expected = []
+    for offset in range(0, size, block_size):
+        block = bytes(data[offset : offset + block_size])
+        expected.append(block if any(block) else len(block))
+    fn = str(tmpdir / "file")
+    with open(fn, "wb") as fd:
+        fd.write(data)
+    assert cf(ChunkerFixed(block_size).chunkify(BytesIO(data))) == expected
+    with open(fn, "rb") as fd:
+        assert cf(ChunkerFixed(block_size).chunkify(fd, fd.fileno())) == expected
+    # an all-zero block is detected as such, no matter where the zeros are
+    for offset in range(0, size, block_size):
+        data[offset : offset + block_size] = bytes(len(data[offset : offset + block_size]))
+        chunks = cf(ChunkerFixed(block_size).chunkify(BytesIO(data)))
+        assert chunks[offset // block_size] == len(data[offset : offset + block_size])
+
+
+def test_chunkify_fixed_fmap(tmpdir):
+    data = os.urandom(20000)
+    fn = str(tmpdir / "file")
+    with open(fn, "wb") as fd:
+        fd.write(data)
+    # fmap not covering the file completely and with a range reaching beyond EOF
+    fmap = [(0, 1000, True), (5000, 3000, False), (9000, 4096, True), (18000, 10000, True)]
+    expected = [data[0:1000], 3000, data[9000:13000], data[13000:13096], data[18000:20000]]
+    with open(fn, "rb") as fd:
+        assert cf(ChunkerFixed(4000).chunkify(fd, fmap=fmap)) == expected
+    with open(fn, "rb") as fd:
+        assert cf(ChunkerFixed(4000).chunkify(fd, fd.fileno(), fmap=fmap)) == expected
+
+
+@pytest.mark.parametrize(
+    "kw",
+    [{}, dict(use_mmap=True), dict(readahead=2, read_size=10000), dict(threads=3), dict(threads=3, use_mmap=True)],
+)
+def test_chunkify_buzhash_fmap(tmpdir, monkeypatch, kw):
+    from .. import chunker as chunker_module
+
+    monkeypatch.setattr(chunker_module, "PARALLEL_CHUNKING_MIN_SIZE", 0)
+    data = os.urandom(3000000)
+    fn = str(tmpdir / "file")
+    with open(fn, "wb") as fd:
+        fd.write(data)
+    # the hole ranges are not read, the data ranges are chunked on their own.
+    fmap = [(0, 1000000, True), (1000000, 150000, False), (1150000, 300000, True), (1450000, 1550000, False)]
+    expected = []
+    for start, size, is_data in fmap:
+        if is_data:
+            expected.extend(cf(Chunker(0, 10, 16, 12, 4095).chunkify(BytesIO(data[start : start + size]))))
+        else:
+            expected.extend([65536] * (size // 65536) + [size % 65536])
+    with open(fn, "rb") as fd:
+        assert cf(Chunker(0, 10, 16, 12, 4095, **kw).chunkify(fd, fd.fileno(), fmap=fmap)) == expected
+    with open(fn, "rb") as fd:
+        assert cf(Chunker(0, 10, 16, 12, 4095, **kw).chunkify(fd, fmap=fmap)) == expected
+    # a data range beyond EOF
+    fmap = [(0, 1000, False), (2999000, 10000, True)]
+    with open(fn, "rb") as fd:
+        assert cf(Chunker(0, 10, 16, 12, 4095, **kw).chunkify(fd, fd.fileno(), fmap=fmap)) == [1000, data[2999000:]]
+
+
+@pytest.mark.skipif(not fs_supports_sparse(), reason="fs does not support sparse files")
+@pytest.mark.parametrize("sparse_map", [map_sparse1, map_sparse2, map_onlysparse, map_notsparse])
+def test_chunkify_buzhash_sparse(tmpdir, sparse_map):
+    fn = str(tmpdir / "sparsefile")
+    make_sparsefile(fn, sparse_map)
+    chunker = get_chunker("buzhash", 19, 23, 21, 4095, seed=0, sparse=True)
+    with open(fn, "rb") as fd:
+        allocations = [chunk.meta["allocation"] for chunk in chunker.chunkify(fd, fd.fileno())]
+    assert allocations == [CH_DATA if is_data else CH_HOLE for _, _, is_data in sparse_map]
+    with open(fn, "rb") as fd:
+        assert cf(chunker.chunkify(fd, fd.fileno())) == make_content(sparse_map)
+
+
+def flatten_batches(batches):
+    chunks = []
+    for data, boundaries in batches:
+        for offset, length, allocation in boundaries:
+            if allocation == CH_DATA:
+                chunks.append(bytes(data[offset : offset + length]))
+            else:
+                chunks.append(length)
+    return chunks
+
+
+@pytest.mark.parametrize(
+    "params, kw",
+    [
+        ((10, 16, 12, 4095), {}),
+        ((6, 17, 15, 7351), {}),  # some chunks cut at max. size
+        ((19, 23, 21, 4095), {}),
+        ((10, 16, 12, 4095), dict(use_mmap=True)),
+        ((10, 16, 12, 4095), dict(readahead=2, read_size=100000)),
+        ((10, 16, 12, 4095), dict(threads=3)),
+    ],
+)
+def test_chunkify_batch(tmpdir, monkeypatch, params, kw):
+    from .. import chunker as chunker_module
+
+    monkeypatch.setattr(chunker_module, "PARALLEL_CHUNKING_MIN_SIZE", 0)
+    fn = str(tmpdir / "file")
+    with open(fn, "wb") as fd:
+        fd.write(os.urandom(7000000) + bytes(600000) + os.urandom(12345) + b"foobar" * 100000)
+    for size in (None, 70000, 5200, 1100, 100, 0):
+        if size is not None:
+            with open(fn, "r+b") as fd:
+                fd.truncate(size)
+        with open(fn, "rb") as fd:
+            expected = cf(Chunker(0, *params).chunkify(fd, fd.fileno()))
+        with open(fn, "rb") as fd:
+            chunks = flatten_batches(Chunker(0, *params, **kw).chunkify_batch(fd, fd.fileno()))
+        assert chunks == expected
+        with open(fn, "rb") as fd:
+            assert flatten_batches(Chunker(0, *params, **kw).chunkify_batch(fd)) == expected
+
+
+def test_chunkify_batch_fmap(tmpdir):
+    data = os.urandom(3000000)
+    fn = str(tmpdir / "file")
+    with open(fn, "wb") as fd:
+        fd.write(data)
+    fmap = [(0, 1000000, True), (1000000, 150000, False), (1150000, 300000, True), (1450000, 1550000, False)]
+    with open(fn, "rb") as fd:
+        expected = cf(Chunker(0, 10, 16, 12, 4095).chunkify(fd, fd.fileno(), fmap=fmap))
+    with open(fn, "rb") as fd:
+        batches = Chunker(0, 10, 16, 12, 4095).chunkify_batch(fd, fd.fileno(), fmap=fmap)
+        assert flatten_batches(batches) == expected
@@ -1,21 +1,22 @@
 from io import BytesIO
 
 from .chunker import cf
-from ..chunker import Chunker
+from ..chunker import Chunker, ChunkerFastCDC
 from ..crypto.low_level import blake2b_256
 from ..constants import *  # NOQA
 from ..helpers import hex_to_bin
 
 
-def test_chunkpoints_unchanged():
-    def twist(size):
-        x = 1
-        a = bytearray(size)
-        for i in range(size):
-            x = (x * 1103515245 + 12345) & 0x7FFFFFFF
-            a[i] = x & 0xFF
-        return a
+def twist(size):
+    x = 1
+    a = bytearray(size)
+    for i in range(size):
+        x = (x * 1103515245 + 12345) & 0x7FFFFFFF
+        a[i] = x & 0xFF
+    return a
+
 
+def test_chunkpoints_unchanged():
     data = twist(100000)
 
     runs = []
@@ -35,3 +36,24 @@ def twist(size):
     # Future chunker optimisations must not change this, or existing repos will bloat.
     overall_hash = blake2b_256(b"", b"".join(runs))
     assert overall_hash == hex_to_bin("b559b0ac8df8daaa221201d018815114241ea5c6609d98913cd2246a702af4e3")
+
+
+def test_fastcdc_chunkpoints_unchanged():
+    data = twist(100000)
+
+    runs = []
+    for minexp in (4, 6, 7, 11, 12):
+        for maxexp in (15, 17):
+            for maskbits in (4, 7, 10, 12):
+                if minexp > maskbits:
+                    continue
+                for seed in (1849058162, 1234567653):
+                    fh = BytesIO(data)
+                    chunker = ChunkerFastCDC(seed, minexp, maxexp, maskbits)
+                    chunks = [blake2b_256(b"", c) for c in cf(chunker.chunkify(fh, -1))]
+                    runs.append(blake2b_256(b"", b"".join(chunks)))
+
+    # The "correct" hash below matches the existing fastcdc chunker behavior.
+    # Future chunker optimisations must not change this, or existing repos will bloat.
+    overall_hash = blake2b_256(b"", b"".join(runs))
+    assert overall_hash == hex_to_bin("15a96fdedb02562d93745def9d01cc63b019c0d9eba35e888a462a048be0178a")
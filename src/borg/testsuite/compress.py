@@ -1,6 +1,7 @@
 import argparse
 import os
 import zlib
+from concurrent.futures import ThreadPoolExecutor
 
 import pytest
 
@@ -47,6 +48,18 @@ def test_lz4_buffer_allocation(monkeypatch):
     assert incompressible_data == c.decompress(meta, cdata)[1]
 
 
+@pytest.mark.parametrize("c_type", ["lz4", "zstd", "zlib", "lzma"])
+def test_concurrent_compression(c_type):
+    # compressors release the GIL, each thread must get its own output buffer
+    c = Compressor(c_type)
+    datas = [os.urandom(1000) + bytes([i]) * 200000 + os.urandom(1000) for i in range(200)]
+    with ThreadPoolExecutor(max_workers=8) as executor:
+        results = list(executor.map(lambda data: c.compress({}, data), datas))
+    for data, (meta, cdata) in zip(datas, results):
+        assert len(cdata) < len(data)
+        assert c.decompress(meta, cdata)[1] == data
+
+
 @pytest.mark.parametrize("invalid_cdata", [b"\xff\xfftotalcrap", b"\x08\x00notreallyzlib"])
 def test_autodetect_invalid(invalid_cdata):
     with pytest.raises(ValueError):
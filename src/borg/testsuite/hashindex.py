@@ -86,12 +86,12 @@ def _generic_test(self, cls, make_value, sha):
 
     def test_nsindex(self):
         self._generic_test(
-            NSIndex, lambda x: (x, x, x), "0d7880dbe02b64f03c471e60e193a1333879b4f23105768b10c9222accfeac5e"
+            NSIndex, lambda x: (x, x, x), "487ab76a7eda4a4481ad3a8de76569693d9971867c649541a1e67757f638745d"
         )
 
     def test_chunkindex(self):
         self._generic_test(
-            ChunkIndex, lambda x: (x, x), "5915fcf986da12e5f3ac68e05242b9c729e6101b0460b1d4e4a9e9f7cdf1b7da"
+            ChunkIndex, lambda x: (x, x), "67e59dec25f05e6456d8a3d2f81e48910aac3679fa1255727260ae06eec2e98b"
         )
 
     def test_resize(self):
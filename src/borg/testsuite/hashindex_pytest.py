@@ -1,11 +1,14 @@
 # more hashindex tests. kept separate so we can use pytest here.
 
+import io
 import os
 import random
+import struct
 
 import pytest
 
-from ..hashindex import NSIndex
+from ..hashindex import NSIndex, ChunkIndex, FilesCacheIndex
+from ..crypto.file_integrity import IntegrityCheckedFile, FileIntegrityError
 
 
 def verify_hash_table(kv, idx):
@@ -73,3 +76,431 @@ def test_hashindex_compact():
 def test_hashindex_compact_stress():
     for _ in range(100):
         test_hashindex_compact()
+
+
+def test_hashindex_mmap(tmpdir):
+    """test that a memory mapped index behaves like a read one, also when modified"""
+    idx, kv = make_hashtables(entries=5000, loops=3)
+    path = str(tmpdir.join("idx"))
+    idx.write(path)
+    with open(path, "rb") as fd:
+        original = fd.read()
+    idx = NSIndex.read(path, mmap=True)
+    verify_hash_table(kv, idx)
+    assert sorted(k for k, _ in idx.iteritems()) == sorted(kv)
+    # modify values in place (copy-on-write), add and delete entries
+    some_key = next(iter(kv))
+    idx.flags(some_key, mask=1, value=1)
+    assert idx.flags(some_key, mask=1) == 1
+    for k in random.sample(list(kv), k=len(kv) // 2):
+        v = kv.pop(k)
+        assert idx.pop(k) == (v, v, v)
+    for i in range(5000):
+        k = random.randbytes(32)
+        idx[k] = (i, i, i)
+        kv[k] = i
+    verify_hash_table(kv, idx)
+    # the file was not modified
+    with open(path, "rb") as fd:
+        assert fd.read() == original
+
+
+def test_hashindex_mmap_integrity(tmpdir):
+    path = str(tmpdir.join("idx"))
+    idx = ChunkIndex()
+    for i in range(1000):
+        idx[random.randbytes(32)] = i, i
+    with IntegrityCheckedFile(path, write=True) as fd:
+        idx.write(fd)
+    integrity_data = fd.integrity_data
+    with IntegrityCheckedFile(path, write=False, integrity_data=integrity_data) as fd:
+        mapped = ChunkIndex.read(fd, mmap=True)
+    assert sorted(mapped.iteritems()) == sorted(idx.iteritems())
+    # corrupt the last bucket
+    with open(path, "r+b") as fd:
+        fd.seek(-1, os.SEEK_END)
+        last = fd.read(1)
+        fd.seek(-1, os.SEEK_END)
+        fd.write(bytes([last[0] ^ 1]))
+    with pytest.raises(FileIntegrityError):
+        with IntegrityCheckedFile(path, write=False, integrity_data=integrity_data) as fd:
+            ChunkIndex.read(fd, mmap=True)
+
+
+def test_hashindex_incremental_resize(tmpdir):
+    """test lookups, modifications and iteration while an incremental resize is in progress"""
+    idx = NSIndex()
+    kv = {}
+
+    def put(count):
+        for _ in range(count):
+            k = random.randbytes(32)
+            v = random.randint(0, NSIndex.MAX_VALUE - 1)
+            idx[k] = (v, v, v)
+            kv[k] = v
+
+    # a bit more than fits into the table of 65537 buckets, big tables are grown incrementally
+    put(int(65537 * NSIndex.MAX_LOAD_FACTOR) + 100)
+    # update and delete entries, some of them still in the old table (lookups migrate too, so do not
+    # verify all entries before, that would finish the resize)
+    for k in random.sample(list(kv), k=1000):
+        assert idx.get(k) == (kv[k],) * 3
+        v = kv[k] = kv[k] // 2
+        idx[k] = (v, v, v)
+    for k in random.sample(list(kv), k=1000):
+        v = kv.pop(k)
+        assert idx.pop(k) == (v, v, v)
+    put(1000)
+    verify_hash_table(kv, idx)
+    assert sorted(k for k, _ in idx.iteritems()) == sorted(kv)
+    # iterating finishes a resize, so lookups while iterating do not move entries
+    put(int(131101 * NSIndex.MAX_LOAD_FACTOR) - len(kv) + 100)
+    keys, existing = [], list(kv)
+    for k, _ in idx.iteritems():
+        assert random.choice(existing) in idx
+        keys.append(k)
+    assert sorted(keys) == sorted(kv)
+    parts = [idx.part_keys(part, 7) for part in range(7)]
+    assert sorted(k for keys in parts for k in split_keys(keys)) == sorted(kv)
+    # writing finishes the resize
+    path = str(tmpdir.join("idx"))
+    idx.write(path)
+    assert idx.size() == os.path.getsize(path)
+    verify_hash_table(kv, NSIndex.read(path))
+
+
+def test_hashindex_batched_lookups():
+    idx = ChunkIndex()
+    present = [random.randbytes(32) for _ in range(100)]
+    missing = [random.randbytes(32) for _ in range(10)]
+    for i, k in enumerate(present):
+        idx[k] = (i % 2 + 1, i)
+    keys = present + missing
+    random.shuffle(keys)
+    assert idx.contains_many(b"".join(keys)) == [k in idx for k in keys]
+    assert idx.get(missing[0]) is None and idx.get(missing[0], 42) == 42
+    assert idx.get_many(b"".join(keys)) == [idx.get(k) for k in keys]
+    expected = [(idx[k].refcount + 1, idx[k].size) if k in idx else None for k in keys]
+    assert idx.incref_many(b"".join(keys)) == expected
+    # a key given more than once is decreased more than once, but never below zero
+    key = present[0]  # refcount 2 now
+    assert idx.decref_many(key * 3 + missing[0]) == [(1, 0), (0, 0), None, None]
+    assert idx[key] == (0, 0)
+    assert idx.contains_many(b"") == []
+    with pytest.raises(AssertionError):
+        idx.get_many(b"too short")
+    nsidx = NSIndex()
+    for i, k in enumerate(present):
+        nsidx[k] = (i, i, i)
+    assert nsidx.get_many(b"".join(keys)) == [nsidx.get(k) for k in keys]
+    assert nsidx.get(missing[0], 42) == 42 and nsidx.get(present[1]) == (1, 1, 1)
+    idx.set_many(b"".join(keys), (ChunkIndex.MAX_VALUE, 0))
+    assert idx.get_many(b"".join(keys)) == [(ChunkIndex.MAX_VALUE, 0)] * len(keys)
+    assert len(idx) == len(present) + len(missing)
+
+
+def split_keys(keys, key_size=32):
+    return [keys[i : i + key_size] for i in range(0, len(keys), key_size)]
+
+
+def test_hashindex_part_keys():
+    idx = NSIndex()
+    assert idx.part_keys(0, 1) == b""
+    keys = [random.randbytes(32) for _ in range(1000)]
+    for i, k in enumerate(keys):
+        idx[k] = (i, 0, 0)
+        if i % 3 == 0:
+            idx.flags(k, mask=1, value=1)
+    # the parts together are the iteration order, independent of how many parts there are
+    in_order = [k for k, _ in idx.iteritems()]
+    for parts in (1, 2, 7, 1000, 5000):
+        assert split_keys(b"".join(idx.part_keys(part, parts) for part in range(parts))) == in_order
+    flagged = b"".join(idx.part_keys(part, 3, mask=1, value=1) for part in range(3))
+    assert split_keys(flagged) == [k for k, _ in idx.iteritems(mask=1, value=1)]
+    assert sorted(split_keys(flagged)) == sorted(keys[::3])
+    with pytest.raises(AssertionError):
+        idx.part_keys(3, 3)
+
+
+@pytest.mark.parametrize("threads", [1, 2, 3, 4])
+def test_chunkindex_merge_many(tmpdir, threads):
+    keys = [random.randbytes(32) for _ in range(2000)]
+    sources = []
+    for n in range(5):
+        source = ChunkIndex()
+        for i, k in enumerate(random.sample(keys, 1500)):
+            source[k] = (n + 1, n * 1000 + i)
+        sources.append(source)
+    sources[0][keys[0]] = sources[1][keys[0]] = (ChunkIndex.MAX_VALUE - 1, 0)  # saturates
+    path = str(tmpdir.join("idx"))
+    sources[4].write(path)
+    sources[4] = ChunkIndex.read(path, mmap=True)
+    expected = ChunkIndex()
+    master = ChunkIndex()
+    expected[keys[1]] = master[keys[1]] = (1, 1)
+    for source in sources:
+        expected.merge(source)
+    master.merge_many(sources, threads=threads)
+    assert sorted(master.iteritems()) == sorted(expected.iteritems())
+    assert master[keys[0]].refcount == ChunkIndex.MAX_VALUE
+    with pytest.raises(ValueError):
+        master.merge_many([master], threads=threads)
+
+def test_chunkindex_sorted_format():
+    keys = [random.randbytes(32) for _ in range(10000)] + [bytes(31) + bytes([i]) for i in range(10)]
+    sources = []
+    for n in range(4):
+        source = ChunkIndex()
+        for i, k in enumerate(random.sample(keys, 7000)):
+            source[k] = (n + 1, random.randrange(2**32))
+        sources.append(source)
+    sources[0][keys[0]] = sources[1][keys[0]] = (ChunkIndex.MAX_VALUE - 1, 0)  # saturates
+    datas = []
+    for source in sources:
+        fd = io.BytesIO()
+        assert source.write_sorted(fd) == len(fd.getvalue()) < source.size()
+        datas.append(fd.getvalue())
+    # roundtrip
+    idx = ChunkIndex()
+    idx.merge_sorted([datas[0]])
+    assert sorted(idx.iteritems()) == sorted(sources[0].iteritems())
+    # k-way merge
+    expected = ChunkIndex()
+    master = ChunkIndex()
+    expected[keys[1]] = master[keys[1]] = (1, 1)
+    for source in sources:
+        expected.merge(source)
+    master.merge_sorted(datas)
+    assert sorted(master.iteritems()) == sorted(expected.iteritems())
+    assert master[keys[0]].refcount == ChunkIndex.MAX_VALUE
+    empty = io.BytesIO()
+    ChunkIndex().write_sorted(empty)
+    master.merge_sorted([empty.getvalue()])
+    assert len(master) == len(expected)
+    # corrupted
+    for data in (datas[0][:-1], datas[0][:100], datas[0] + b"x", b"BORG_IDX" + datas[0][8:]):
+        with pytest.raises(ValueError):
+            ChunkIndex().merge_sorted([data])
+
+
+def test_hashindex_header_version3(tmpdir):
+    """version 3 index files have 64-bit counts, they are only written for tables with >= 2**31 buckets"""
+    idx = ChunkIndex()
+    kv = {random.randbytes(32): (i + 1, i) for i in range(100)}
+    for k, v in kv.items():
+        idx[k] = v
+    path = str(tmpdir.join("idx"))
+    idx.write(path)
+    with open(path, "rb") as fd:
+        data = bytearray(fd.read())
+    version, num_entries, num_buckets, num_empty = struct.unpack_from("<iiii", data, 8)
+    assert version == 2 and num_entries == 100
+    # convert to version 3
+    struct.pack_into("<iiii", data, 8, 3, 0, 0, 0)
+    struct.pack_into("<qqq", data, 32, num_entries, num_buckets, num_empty)
+    with open(path, "wb") as fd:
+        fd.write(data)
+    idx = ChunkIndex.read(path)
+    assert len(idx) == 100
+    assert dict(idx.iteritems()) == kv
+    struct.pack_into("<i", data, 8, 4)
+    with open(path, "wb") as fd:
+        fd.write(data)
+    with pytest.raises(ValueError, match="Unsupported header version"):
+        ChunkIndex.read(path)
+
+
+def test_hashindex_no_tombstones(tmpdir):
+    def HH(x, y):
+        # same x means same home bucket
+        return struct.pack("<II", x, y) + bytes(24)
+
+    def tombstones(idx):
+        path = str(tmpdir.join("idx"))
+        idx.write(path)
+        with open(path, "rb") as fd:
+            data = fd.read()
+        markers = [data[offset + 32 : offset + 36] for offset in range(1024, len(data), 48)]
+        return markers.count(b"\xfe\xff\xff\xff")
+
+    idx = NSIndex()
+    # colliding entries, with some entries of other home buckets in between and wrapping around the table end
+    for y in range(300):
+        idx[HH(1020, y)] = (y, y, y)
+        if y % 10 == 0:
+            idx[HH(1021 + y // 10, y)] = (y, y, y)
+    for y in range(0, 300, 2):
+        del idx[HH(1020, y)]
+    assert tombstones(idx) == 0
+    assert [HH(1020, y) in idx for y in range(300)] == [y % 2 == 1 for y in range(300)]
+    assert [idx.get(HH(1021 + y // 10, y)) for y in range(0, 300, 10)] == [(y, y, y) for y in range(0, 300, 10)]
+    assert idx.size() == 1024 + 1031 * 48  # no resize happened
+
+    # index files written by older versions may have tombstones, they are purged when reading
+    idx = NSIndex()
+    for y in range(10):
+        idx[HH(5, y)] = (y, y, y)
+    path = str(tmpdir.join("old"))
+    idx.write(path)
+    with open(path, "r+b") as fd:
+        # mark the first entry as deleted
+        fd.seek(1024 + 5 * 48 + 32)
+        fd.write(b"\xfe\xff\xff\xff")
+        fd.seek(8 + 4)
+        fd.write(struct.pack("<i", 9))  # num_entries
+    idx = NSIndex.read(path)
+    assert tombstones(idx) == 0
+    assert [HH(5, y) in idx for y in range(10)] == [False] + [True] * 9
+
+
+def test_files_cache_index():
+    def chunks(n):
+        return [(random.randbytes(32), random.randint(1, 2**32 - 1)) for _ in range(n)]
+
+    def written(files, ttl=20, newest_cmtime=2**63 - 1):
+        fd = io.BytesIO()
+        count = files.write(fd, ttl=ttl, newest_cmtime=newest_cmtime)
+        return count, fd.getvalue()
+
+    files = FilesCacheIndex()
+    entries = {}
+    for i in range(1000):
+        key = random.randbytes(32)
+        entries[key] = (i % 3, random.randbytes(8)[0] << 56 | i, i * 1000, -(10**18) + i, chunks(i % 7))
+        files[key] = entries[key]
+    # bigger than a block of the files cache format
+    key = random.randbytes(32)
+    entries[key] = (0, 1, 2, 3, chunks(5000))
+    files[key] = entries[key]
+    assert len(files) == len(entries)
+    for key, entry in entries.items():
+        assert files[key] == entry
+        assert files.get(key).chunks == entry[4]
+    assert random.randbytes(32) not in files
+    assert FilesCacheIndex.read(io.BytesIO(b"")).get(key) is None
+
+    # reading increments the age
+    count, data = written(files)
+    assert count == len(entries)
+    files2 = FilesCacheIndex.read(io.BytesIO(data))
+    for key, entry in entries.items():
+        assert files2[key] == (entry[0] + 1,) + entry[1:]
+
+    # ttl and newest cmtime
+    count, data = written(files, ttl=2, newest_cmtime=-(10**18) + 500)
+    files2 = FilesCacheIndex.read(io.BytesIO(data))
+    expected = {k for k, e in entries.items() if e[0] == 0 and e[3] < -(10**18) + 500 or e[0] == 1}
+    assert count == len(files2) == len(expected)
+    for key in expected:
+        assert files2[key][4] == entries[key][4]
+    assert all((key in files2) == (key in expected) for key in entries)
+    # the entries left out of the file are still in the index (it is used after checkpoints), a second write is equal
+    assert len(files) == len(entries)
+    for key, entry in entries.items():
+        assert files[key] == entry
+    assert written(files, ttl=2, newest_cmtime=-(10**18) + 500) == (count, data)
+    # the index read from that file can be modified
+    new_key = random.randbytes(32)
+    files2[new_key] = (0, 1, 2, 3, chunks(3))
+    assert len(files2) == len(expected) + 1
+    for key in expected:
+        assert files2[key][4] == entries[key][4]
+
+    # replacing and refreshing entries
+    key, key2 = list(entries)[:2]
+    files[key] = (1, 2, 3, 4, chunks(1))
+    files[key2] = (1, 2, 3, 4, chunks(100))
+    files.refresh(key2, 42)
+    assert files[key2][:4] == (0, 42, 3, 4)
+    with pytest.raises(KeyError):
+        files.refresh(random.randbytes(32), 1)
+    with pytest.raises(AssertionError):
+        files[key] = (1, 2, 3, 4, [(b"short", 1)])
+    assert files[key][0] == 1  # unchanged
+    count, data = written(files)
+    assert FilesCacheIndex.read(io.BytesIO(data))[key2][4] == files[key2][4]
+
+    # corrupted
+    for bad in (data[:-1], data[:40], data + b"x", b"BORG_IDX" + data[8:]):
+        with pytest.raises(ValueError):
+            FilesCacheIndex.read(io.BytesIO(bad))
+
+
+@pytest.mark.parametrize("chunk_count", [1, 2, 3])
+def test_files_cache_index_aligned(chunk_count):
+    # the values in the hash table are used in place, so it starts at a multiple of 8 bytes
+    files = FilesCacheIndex()
+    key = random.randbytes(32)
+    files[key] = (0, 1, 2, 3, [(random.randbytes(32), 1)] * chunk_count)
+    fd = io.BytesIO()
+    files.write(fd, ttl=20, newest_cmtime=2**63 - 1)
+    data = fd.getvalue()
+    padding = data[10]
+    table = 24 + 36 * chunk_count + padding
+    assert table % 8 == 0 and padding < 8
+    assert data[table - padding : table] == bytes(padding)
+    assert data[table : table + 8] == b"BORG2IDX"
+    assert FilesCacheIndex.read(io.BytesIO(data))[key][4] == files[key][4]
+    if padding:
+        with pytest.raises(ValueError):
+            FilesCacheIndex.read(io.BytesIO(data[:10] + b"\0" + data[11:]))
+        with pytest.raises(ValueError):
+            FilesCacheIndex.read(io.BytesIO(data[: table - 1] + b"x" + data[table:]))
+
+
+def test_files_cache_index_mapped(tmpdir):
+    entries = {random.randbytes(32): (0, i, i, i, [(random.randbytes(32), i + 1)] * (i % 3)) for i in range(1000)}
+    files = FilesCacheIndex()
+    for key, entry in entries.items():
+        files[key] = entry
+    path = str(tmpdir.join("files"))
+    with IntegrityCheckedFile(path, write=True) as fd:
+        assert files.write(fd, ttl=20, newest_cmtime=2**63 - 1) == len(entries)
+    integrity_data = fd.integrity_data
+    with open(path, "rb") as fd:
+        data = fd.read()
+    with IntegrityCheckedFile(path, write=False, integrity_data=integrity_data) as fd:
+        files = FilesCacheIndex.read(fd)
+    assert len(files) == len(entries)
+    # modifying the index does not modify the file
+    key, key2, key3 = list(entries)[:3]
+    files.refresh(key, 42)
+    files[key2] = (0, 1, 2, 3, [(bytes(32), 1)] * 2)
+    files[key3] = (0, 1, 2, 3, [(bytes(32), 1)] * 10)
+    new_key = random.randbytes(32)
+    files[new_key] = (0, 1, 2, 3, [(bytes(32), 1)] * 3)
+    with open(path, "rb") as fd:
+        assert fd.read() == data
+    for k, entry in entries.items():
+        if k not in (key, key2, key3):
+            assert files[k] == (1,) + entry[1:]
+    assert files[key][:2] == (0, 42)
+    assert files[key2].chunks == [(bytes(32), 1)] * 2
+    # after detaching, the index does not use the file any more
+    snapshot = {k: files[k] for k in list(entries) + [new_key]}
+    files.detach()
+    with open(path, "r+b") as fd:
+        fd.write(bytes(len(data)))
+    assert {k: files[k] for k in snapshot} == snapshot
+    files[new_key] = (0, 1, 2, 3, [(bytes(32), 2)] * 4)
+    assert files[new_key].chunks == [(bytes(32), 2)] * 4
+    files[new_key] = (0, 1, 2, 3, [(bytes(32), 1)] * 3)
+    # written again (not in place, the file is mapped), the entries not seen have age 1, below the ttl
+    path = str(tmpdir.join("files2"))
+    with IntegrityCheckedFile(path, write=True) as fd:
+        assert files.write(fd, ttl=2, newest_cmtime=2**63 - 1) == len(entries) + 1
+    with IntegrityCheckedFile(path, write=False, integrity_data=fd.integrity_data) as fd:
+        files2 = FilesCacheIndex.read(fd)
+    assert files2[key3].chunks == [(bytes(32), 1)] * 10
+    assert files2[new_key][0] == 1
+    assert files2[list(entries)[3]][0] == 2
+    # now only the entries seen in the last generation are below the ttl
+    path = str(tmpdir.join("files3"))
+    with IntegrityCheckedFile(path, write=True) as fd:
+        assert files2.write(fd, ttl=2, newest_cmtime=2**63 - 1) == 4
+    assert len(files2) == len(entries) + 1
+    with IntegrityCheckedFile(path, write=False, integrity_data=fd.integrity_data) as fd:
+        files3 = FilesCacheIndex.read(fd)
+    assert len(files3) == 4
+    assert all(k in files3 for k in (key, key2, key3, new_key))
+    assert files3[key3].chunks == [(bytes(32), 1)] * 10
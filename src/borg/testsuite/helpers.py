@@ -380,6 +380,8 @@ def test_format_timedelta():
         ("10,23,16,4095", ("buzhash", 10, 23, 16, 4095)),
         ("fixed,4096", ("fixed", 4096, 0)),
         ("fixed,4096,200", ("fixed", 4096, 200)),
+        ("fastcdc,19,23,21", ("fastcdc", 19, 23, 21)),
+        ("fastcdc,10,16,12", ("fastcdc", 10, 16, 12)),
     ],
 )
 def test_valid_chunkerparams(chunker_params, expected_return):
@@ -393,6 +395,10 @@ def test_valid_chunkerparams(chunker_params, expected_return):
         "buzhash,5,7,6,4095",  # too small min. size
         "buzhash,19,24,21,4095",  # too big max. size
         "buzhash,23,19,21,4095",  # violates min <= mask <= max
+        "fastcdc,5,7,6",  # too small min. size
+        "fastcdc,19,24,21",  # too big max. size
+        "fastcdc,19,23,18",  # violates min <= mask <= max
+        "fastcdc,19,23,21,4095",  # no window size param
         "fixed,63",  # too small block size
         "fixed,%d,%d" % (MAX_DATA_SIZE + 1, 4096),  # too big block size
         "fixed,%d,%d" % (4096, MAX_DATA_SIZE + 1),  # too big header size
@@ -16,7 +16,7 @@
 from ..helpers import IntegrityError
 from ..helpers import Location
 from ..helpers import msgpack
-from ..constants import KEY_ALGORITHMS
+from ..constants import KEY_ALGORITHMS, CH_DATA, CH_ALLOC
 from ..helpers import hex_to_bin, bin_to_hex
 
 
@@ -219,6 +219,14 @@ def test_roundtrip(self, key):
         decrypted = loaded_key.decrypt(id, encrypted)
         assert decrypted == plaintext
 
+    def test_id_hash_batch(self, key):
+        data = bytes(range(256)) * 40
+        boundaries = [(0, 1000, CH_DATA), (1000, 0, CH_DATA), (1000, 4000, CH_DATA), (5000, 5240, CH_ALLOC)]
+        expected = [key.id_hash(data[offset : offset + length]) for offset, length, _ in boundaries]
+        assert key.id_hash_batch(data, boundaries) == expected
+        assert key.id_hash_batch(memoryview(data), boundaries) == expected
+        assert key.id_hash_batch(data, []) == []
+
     def test_assert_id(self, key):
         plaintext = b"123456789"
         id = key.id_hash(plaintext)
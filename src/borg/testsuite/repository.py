@@ -15,6 +15,7 @@
 from ..remote import RemoteRepository, InvalidRPCMethod, PathNotAllowed
 from ..repository import Repository, LoggedIO, MAGIC, MAX_DATA_SIZE, TAG_DELETE, TAG_PUT2, TAG_PUT, TAG_COMMIT
 from ..repoobj import RepoObj
+from ..version import parse_version
 from .hashindex import H
 
 
@@ -221,6 +222,36 @@ def test_list(repo_fixtures, request):
         assert len(repository.list(limit=50)) == 50
 
 
+def test_list_packed(repo_fixtures, request):
+    with get_repository_from_fixture(repo_fixtures, request) as repository:
+        for x in range(100):
+            repository.put(H(x), fchunk(b"SOMEDATA"))
+        repository.commit(compact=False)
+        repo_list = repository.list()
+        packed = list(repository.list_packed_many(3))
+        assert len(packed) == 3
+        assert packed[1] == repository.list_packed(1, 3)
+        packed = b"".join(packed)
+        assert [packed[i : i + 32] for i in range(0, len(packed), 32)] == list(repo_list)
+
+
+def test_list_packed_old_server(remote_repository):
+    with remote_repository:
+        for x in range(100):
+            remote_repository.put(H(x), fchunk(b"SOMEDATA"))
+        remote_repository.commit(compact=False)
+        repo_list = remote_repository.list()
+        remote_repository.server_version = parse_version("2.0.0b9")
+        with pytest.raises(RemoteRepository.RPCServerOutdated):
+            remote_repository.list_packed(0, 3)
+        # falls back to paging through the IDs using list
+        with patch("borg.remote.LIST_SCAN_LIMIT", 30):
+            packed = list(remote_repository.list_packed_many(3))
+        assert [len(ids) // 32 for ids in packed] == [30, 30, 30, 10]
+        packed = b"".join(packed)
+        assert [packed[i : i + 32] for i in range(0, len(packed), 32)] == list(repo_list)
+
+
 def test_scan(repo_fixtures, request):
     with get_repository_from_fixture(repo_fixtures, request) as repository:
         for x in range(100):